@@ -2,9 +2,12 @@
 #include "globals.h"
 #include "custom_gui.h"
 #include "serial.h"
-#include "sensors.h"
+#include "acquisition.h"
+#include "session.h"
+#include "pids.h"
 #include "options.h"
 #include "version.h"
+#include "vehicle_info.h"
 #include "about.h"
 
 #define MSG_REFRESH  MSG_USER
@@ -17,6 +20,16 @@ static int refresh_proc(int msg, DIALOG *d, int c);
 static int obd_info_getter_proc(int msg, DIALOG *d, int c);
 static int thanks_proc(int msg, DIALOG *d, int c);
 
+static void retry_or_cancel(int retry);
+static void connection_lost();
+static void start_reading();
+static void mfr_done(ACQ_TRANSACTION *t, void *context);
+static void obd_system_done(ACQ_TRANSACTION *t, void *context);
+static void vin_done(ACQ_TRANSACTION *t, void *context);
+static void read_cvns();
+static void cvn_done(ACQ_TRANSACTION *t, void *context);
+static void calid_done(ACQ_TRANSACTION *t, void *context);
+
 static char whatisit[256];
 static char whatcanitdo[256];
 static char wheretoget[256];
@@ -25,6 +38,9 @@ static char obd_interface[16];
 static char obd_mfr[64];
 static char obd_protocol[64];
 static char obd_system[64];
+static char obd_vin[24];
+static char obd_calid[80];
+static char obd_cvn[48];
 
 #define VER_STR   "Version " SCANTOOL_VERSION_EX_STR " for " SCANTOOL_PLATFORM_STR ", " SCANTOOL_COPYRIGHT_STR
 
@@ -68,7 +84,7 @@ static DIALOG thanks_dialog[] =
 static DIALOG obd_info_dialog[] =
 {
    /* (proc)               (x)  (y)  (w)  (h)  (fg)     (bg)           (key) (flags) (d1) (d2) (dp)               (dp2) (dp3) */
-   { d_shadow_box_proc,    0,   0,   444, 188, C_BLACK, C_LIGHT_GRAY,  0,    0,      0,   0,   NULL,              NULL, NULL },
+   { d_shadow_box_proc,    0,   0,   444, 260, C_BLACK, C_LIGHT_GRAY,  0,    0,      0,   0,   NULL,              NULL, NULL },
    { d_shadow_box_proc,    0,   0,   444, 24,  C_BLACK, C_DARK_GRAY,   0,    0,      0,   0,   NULL,              NULL, NULL },
    { caption_proc,         222, 2,   218, 19,  C_WHITE, C_TRANSP,      0,    0,      0,   0,   "OBD Information", NULL, NULL },
    { d_rtext_proc,         12,  36,  108, 16,  C_BLACK, C_TRANSP,      0,    0,      0,   0,   "Interface:",      NULL, NULL },
@@ -79,8 +95,14 @@ static DIALOG obd_info_dialog[] =
    { d_text_proc,          124, 84,  316, 16,  C_BLACK, C_TRANSP,      0,    0,      0,   0,   obd_protocol,      NULL, NULL },
    { d_rtext_proc,         12,  108, 108, 16,  C_BLACK, C_TRANSP,      0,    0,      0,   0,   "OBD System:",     NULL, NULL },
    { d_text_proc,          124, 108, 316, 16,  C_BLACK, C_TRANSP,      0,    0,      0,   0,   obd_system,        NULL, NULL },
-   { refresh_proc,         140, 144, 76,  32,  C_BLACK, C_GREEN,       0,    D_EXIT, 0,   0,   "Refresh",         NULL, NULL },
-   { d_button_proc,        231, 144, 76,  32,  C_BLACK, C_DARK_YELLOW, 0,    D_EXIT, 0,   0,   "Close",           NULL, NULL },
+   { d_rtext_proc,         12,  132, 108, 16,  C_BLACK, C_TRANSP,      0,    0,      0,   0,   "VIN:",            NULL, NULL },
+   { d_text_proc,          124, 132, 316, 16,  C_BLACK, C_TRANSP,      0,    0,      0,   0,   obd_vin,           NULL, NULL },
+   { d_rtext_proc,         12,  156, 108, 16,  C_BLACK, C_TRANSP,      0,    0,      0,   0,   "Calibration ID:", NULL, NULL },
+   { d_text_proc,          124, 156, 316, 16,  C_BLACK, C_TRANSP,      0,    0,      0,   0,   obd_calid,         NULL, NULL },
+   { d_rtext_proc,         12,  180, 108, 16,  C_BLACK, C_TRANSP,      0,    0,      0,   0,   "CVN:",            NULL, NULL },
+   { d_text_proc,          124, 180, 316, 16,  C_BLACK, C_TRANSP,      0,    0,      0,   0,   obd_cvn,           NULL, NULL },
+   { refresh_proc,         140, 216, 76,  32,  C_BLACK, C_GREEN,       0,    D_EXIT, 0,   0,   "Refresh",         NULL, NULL },
+   { d_button_proc,        231, 216, 76,  32,  C_BLACK, C_DARK_YELLOW, 0,    D_EXIT, 0,   0,   "Close",           NULL, NULL },
    { obd_info_getter_proc, 0,   0,   0,   0,   0,       0,             0,    0,      0,   0,   NULL,              NULL, NULL },
    { NULL,                 0,   0,   0,   0,   0,       0,             0,    0,      0,   0,   NULL,              NULL, NULL }
 };
@@ -129,6 +151,9 @@ int obd_info_proc(int msg, DIALOG *d, int c)
          obd_mfr[0] = 0;
          obd_protocol[0] = 0;
          obd_system[0] = 0;
+         obd_vin[0] = 0;
+         obd_calid[0] = 0;
+         obd_cvn[0] = 0;
 
          popup_dialog(obd_info_dialog, -1);
       }
@@ -169,6 +194,31 @@ void clear_obd_info()
    strcpy(obd_mfr, "N/A");
    strcpy(obd_protocol, "N/A");
    strcpy(obd_system, "N/A");
+   strcpy(obd_vin, "N/A");
+   strcpy(obd_calid, "N/A");
+   strcpy(obd_cvn, "N/A");
+}
+
+
+// copies the VIN, calibration IDs, and CVNs that were read into the dialog strings
+void format_vehicle_info()
+{
+   const VEHICLE_INFO *info = get_vehicle_info();
+   int i;
+
+   strcpy(obd_vin, (info->vin[0]) ? info->vin : "N/A");
+
+   obd_calid[0] = 0;
+   for (i = 0; i < info->num_of_calids; i++)
+      sprintf(obd_calid + strlen(obd_calid), (i > 0) ? ", %s" : "%s", info->calid[i]);
+   if (info->num_of_calids == 0)
+      strcpy(obd_calid, "N/A");
+
+   obd_cvn[0] = 0;
+   for (i = 0; i < info->num_of_cvns; i++)
+      sprintf(obd_cvn + strlen(obd_cvn), (i > 0) ? ", %08lX" : "%08lX", info->cvn[i]);
+   if (info->num_of_cvns == 0)
+      strcpy(obd_cvn, "N/A");
 }
 
 
@@ -184,406 +234,285 @@ void format_id_string(char *str)
 
 // OBD info getter states
 #define OBD_INFO_IDLE         0
-#define OBD_INFO_START        1
-#define OBD_INFO_TX_0100      2
-#define OBD_INFO_WAIT_ATZ     3
-#define OBD_INFO_ECU_TIMEOUT  4
-#define OBD_INFO_WAIT_0100    5
-#define OBD_INFO_WAIT_011C    6
+#define OBD_INFO_START        1  // connect, unless the session is connected already
+#define OBD_INFO_CONNECTING   2
+#define OBD_INFO_READING      3  // the requests are chained by their callbacks
 
-#define OBD_INFO_MAX_RETRIES  3
+static int info_state = OBD_INFO_IDLE;
+static int info_changed = FALSE;  // TRUE if the dialog has to be redrawn
+static int reconnect = FALSE;     // TRUE if the interface is reset even if the session is connected
+static unsigned long known_cvn[MAX_CALIDS];  // CVNs cached with the CALIDs the last time the vehicle was seen
+static int num_of_known_cvns = 0;
 
-int obd_info_getter_proc(int msg, DIALOG *d, int c)
+
+void retry_or_cancel(int retry)
+{
+   if (retry)
+   {
+      reconnect = TRUE;
+      info_state = OBD_INFO_START;
+   }
+   else
+   {
+      clear_obd_info();
+      info_state = OBD_INFO_IDLE;
+   }
+   info_changed = TRUE;
+}
+
+
+void connection_lost()
+{
+   retry_or_cancel(alert("Connection to interface was lost", NULL, NULL, "&Retry", "&Cancel", 'r', 'c') == 1);
+}
+
+
+// the session is connected, what it found out is shown, and the rest is read
+void start_reading()
+{
+   strncpy(obd_interface, session_interface_id(), sizeof(obd_interface) - 2);  // leave room for the space
+   obd_interface[sizeof(obd_interface) - 2] = 0;
+   format_id_string(obd_interface);
+   strcpy(obd_protocol, get_protocol_string(obd_device.interface_type, obd_device.protocol));
+   info_state = OBD_INFO_READING;
+   info_changed = TRUE;
+
+   if (obd_device.interface_type == INTERFACE_ELM327)
+      session_request("at@1", AT_TIMEOUT, ACQ_RAW_RESPONSE, mfr_done, NULL);  // get mfr string
+   else
+   {
+      strcpy(obd_mfr, "N/A");
+      strcpy(obd_system, "detecting...");
+      session_request("011C", 0, 0, obd_system_done, NULL);
+   }
+}
+
+
+void mfr_done(ACQ_TRANSACTION *t, void *context)
+{
+   if (t->response_type == ACQ_TIMED_OUT)
+   {
+      connection_lost();
+      return;
+   }
+
+   strncpy(obd_mfr, t->response.data, sizeof(obd_mfr) - 1);
+   obd_mfr[sizeof(obd_mfr) - 1] = 0;
+   strcpy(obd_system, "detecting...");
+   session_request("011C", 0, 0, obd_system_done, NULL);
+   info_changed = TRUE;
+}
+
+
+void obd_system_done(ACQ_TRANSACTION *t, void *context)
 {
-   static int state = OBD_INFO_START;
-   static int device = 0;
-   static int retries = 0;
-   static char response[256];
    char buf[128];
-   int status;
+   int i;
+
+   if (t->response_type == HEX_DATA)
+   {
+      for (i = 0; i < t->lines.num_of_lines; i++)
+      {
+         get_response_line(buf, sizeof(buf), t->response.data, &t->lines.line[i]);
+         if (t->lines.line[i].service == 0x41 && strncmp(buf, "411C", 4) == 0 && t->lines.line[i].len >= 6)
+         {
+            buf[6] = 0;  // solves problem where response is padded with zeroes
+            format_pid_value(find_pid_descriptor(0x1C), strtoul(buf + 4, NULL, 16), buf);  // get OBD requirements string
+            strcpy(obd_system, buf);
+            break;
+         }
+      }
+   }
+   else if (t->response_type == ERR_NO_DATA)
+      strcpy(obd_system, "N/A");
+   else if (t->response_type == ACQ_TIMED_OUT)
+   {
+      connection_lost();
+      return;
+   }
+   else  // other errors
+   {
+      retry_or_cancel(display_error_message(t->response_type, TRUE) == 1);
+      return;
+   }
+
+   info_changed = TRUE;
+   if (get_vehicle_info()->vin[0])  // the session read it when it connected (again, if the user asked for a refresh)
+   {
+      read_cvns();
+      return;
+   }
+
+   strcpy(obd_vin, "reading...");
+   session_request("0902", 0, 0, vin_done, NULL);  // VIN, the vehicle may not have been ready when the session asked
+}
+
+
+/* Mode 09 is not essential, if the vehicle doesn't support it, or doesn't
+ * answer in time, N/A is shown.  The calibration IDs of a vehicle we've seen
+ * before are only read again if its CVNs changed (i.e., an ECU was
+ * reflashed), the CVNs themselves are always read.
+ */
+void vin_done(ACQ_TRANSACTION *t, void *context)
+{
+   if (t->response_type == HEX_DATA)
+      parse_vehicle_info(INFO_TYPE_VIN, t->response.data);
+
+   read_cvns();
+}
+
+
+void read_cvns()
+{
+   const VEHICLE_INFO *info = get_vehicle_info();
+
+   // what we know about the calibration since the last time, if anything
+   load_vehicle_profile();
+   for (num_of_known_cvns = 0; num_of_known_cvns < info->num_of_cvns; num_of_known_cvns++)
+      known_cvn[num_of_known_cvns] = info->cvn[num_of_known_cvns];
+   clear_calibration_info();
+
+   format_vehicle_info();
+   strcpy(obd_calid, empty_string);
+   strcpy(obd_cvn, "reading...");
+   session_request("0906", 0, 0, cvn_done, NULL);  // CVNs, the ECUs may take a while to calculate them
+   info_changed = TRUE;
+}
+
+
+void cvn_done(ACQ_TRANSACTION *t, void *context)
+{
+   const VEHICLE_INFO *info = get_vehicle_info();
+   int unchanged;
+   int i;
+
+   if (t->response_type == HEX_DATA)
+      parse_vehicle_info(INFO_TYPE_CVN, t->response.data);
+
+   unchanged = (info->num_of_cvns > 0 && info->num_of_cvns == num_of_known_cvns);
+   for (i = 0; unchanged && i < info->num_of_cvns; i++)
+      if (info->cvn[i] != known_cvn[i])
+         unchanged = FALSE;
+
+   // same calibration as the last time, the cached CALIDs are still current
+   if (unchanged && load_vehicle_profile() && info->num_of_calids > 0)
+   {
+      format_vehicle_info();
+      info_state = OBD_INFO_IDLE;
+      info_changed = TRUE;
+      return;
+   }
+
+   format_vehicle_info();
+   strcpy(obd_calid, "reading...");
+   session_request("0904", 0, 0, calid_done, NULL);  // calibration IDs
+   info_changed = TRUE;
+}
+
+
+void calid_done(ACQ_TRANSACTION *t, void *context)
+{
+   if (t->response_type == HEX_DATA)
+      parse_vehicle_info(INFO_TYPE_CALID, t->response.data);
+
+   format_vehicle_info();
+   if (get_vehicle_info()->num_of_calids > 0)  // the CVNs are only cached along with the CALIDs they belong to
+      save_vehicle_profile();
+   info_state = OBD_INFO_IDLE;
+   info_changed = TRUE;
+}
+
+
+/* obd_info_getter_proc:
+ *  Everything goes through the session.  If it's connected already (i.e., the
+ *  Sensor Data screen was visited), the interface isn't reset again, unless
+ *  the user asks for a refresh.
+ */
+int obd_info_getter_proc(int msg, DIALOG *d, int c)
+{
+   int error;
 
    switch (msg)
    {
       case MSG_START:
+         session_start();
+         reconnect = FALSE;
+         info_state = OBD_INFO_START;
+         break;
+
       case MSG_REFRESH:
-         state = OBD_INFO_START;
+         reconnect = TRUE;
+         info_state = OBD_INFO_START;
          break;
-         
+
+      case MSG_END:
+         session_stop();
+         info_state = OBD_INFO_IDLE;
+         break;
+
       case MSG_IDLE:
-         switch (state)
-         {
-            case OBD_INFO_IDLE:
-               break;
+         session_tick();
 
+         switch (info_state)
+         {
             case OBD_INFO_START:
                strcpy(obd_interface, "detecting...");
                strcpy(obd_mfr, empty_string);
                strcpy(obd_protocol, empty_string);
                strcpy(obd_system, empty_string);
-               retries = 0;
-               state = OBD_INFO_TX_0100;
-               return D_REDRAW;
-
-            case OBD_INFO_TX_0100:
-               if (serial_timer_running)
+               strcpy(obd_vin, empty_string);
+               strcpy(obd_calid, empty_string);
+               strcpy(obd_cvn, empty_string);
+               if (!reconnect && session_state() == SESSION_READY)
+                  start_reading();
+               else
                {
-                  // wait until we either get a prompt or the serial timer times out
-                  while ((read_comport(buf) != PROMPT) && !serial_time_out)
-                     ;
-               }
-               
-               send_command("ati"); // get chip ID
-               start_serial_timer(AT_TIMEOUT);
-               device = 0;
-               response[0] = 0;
-
-               while ((status = read_comport(buf)) != PROMPT && !serial_time_out)
-               {
-                  if(status == DATA) // if new data detected in com port buffer
-                     strcat(response, buf); // append contents of buf to response
-               }
-
-               if (status == PROMPT)  // if we got the prompt
-               {
-                  stop_serial_timer();
-                  strcat(response, buf);
-                  status = process_response("ati", response);
-
-                  if (status < INTERFACE_ID)
-                  {
-                     send_command("atz"); // reset chip
-                     start_serial_timer(ATZ_TIMEOUT);
-                     response[0] = 0;
-                     state = OBD_INFO_WAIT_ATZ;
-                  }
-                  else
-                  {
-                     format_id_string(response);
-                     strcpy(obd_interface, response);
-
-                     if ((device = status) == INTERFACE_ELM327)
-                     {
-                        send_command("at@1"); // get mfr string
-                        start_serial_timer(AT_TIMEOUT);
-                        response[0] = 0;
-
-                        while ((status = read_comport(buf)) != PROMPT && !serial_time_out)
-                        {
-                           if(status == DATA) // if new data detected in com port buffer
-                              strcat(response, buf); // append contents of buf to response
-                        }
-
-                        if (status == PROMPT)  // if we got the prompt
-                        {
-                           stop_serial_timer();
-                           strcat(response, buf);
-
-                           response[strlen(response) - 2] = 0;
-                           strcpy(obd_mfr, response);
-                           
-                           send_command("atsp0");
-                           start_serial_timer(AT_TIMEOUT);
-
-                           while ((status = read_comport(buf)) != PROMPT && !serial_time_out)
-                              ;
-
-                           if (status == PROMPT)
-                           {
-                              start_serial_timer(ECU_TIMEOUT);
-                              strcpy(obd_protocol, "waiting for ECU timeout...");
-                              state = OBD_INFO_ECU_TIMEOUT;
-                              return D_REDRAW;
-                           }
-                           else  // if serial timeout
-                           {
-                              stop_serial_timer();
-                              if (alert("Connection to interface was lost", NULL, NULL, "&Retry", "&Cancel", 'r', 'c') == 1)
-                                 state = OBD_INFO_START;
-                              else
-                              {
-                                 clear_obd_info();
-                                 state = OBD_INFO_IDLE;
-                                 return D_REDRAW;
-                              }
-                           }
-                        }
-                        else  // if serial timeout
-                        {
-                           stop_serial_timer();
-                           if (alert("Connection to interface was lost", NULL, NULL, "&Retry", "&Cancel", 'r', 'c') == 1)
-                              state = OBD_INFO_START;
-                           else
-                           {
-                              clear_obd_info();
-                              state = OBD_INFO_IDLE;
-                              return D_REDRAW;
-                           }
-                        }
-                     }
-                     else
-                        strcpy(obd_mfr, "N/A");
-                        
-                     send_command("0100");
-                     start_serial_timer(OBD_REQUEST_TIMEOUT);
-                     response[0] = 0;
-                     strcpy(obd_protocol, "detecting...");
-                     state = OBD_INFO_WAIT_0100;
-                     return D_REDRAW;
-                  }
-               }
-               else  // if serial timeout
-               {
-                  stop_serial_timer();
-                  if (retries < OBD_INFO_MAX_RETRIES)
-                  {
-                     retries++;
-                     sprintf(obd_interface, "retrying (%i)...", retries);
-                     state = OBD_INFO_TX_0100;
-                     return D_REDRAW;
-                  }
-                  else
-                  {
-                     if (alert("Connection to interface was lost", NULL, NULL, "&Retry", "&Cancel", 'r', 'c') == 1)
-                        state = OBD_INFO_START;
-                     else
-                     {
-                        clear_obd_info();
-                        state = OBD_INFO_IDLE;
-                        return D_REDRAW;
-                     }
-                  }
+                  session_connect(FALSE);
+                  strcpy(obd_protocol, "detecting...");
+                  info_state = OBD_INFO_CONNECTING;
                }
+               reconnect = FALSE;
+               info_changed = TRUE;
                break;
 
-            case OBD_INFO_WAIT_ATZ:
-               status = read_comport(buf);
-               
-               if(status == DATA) // if new data detected in com port buffer
-                  strcat(response, buf); // append contents of buf to response
-               else if (status == PROMPT)  // if we got the prompt
+            case OBD_INFO_CONNECTING:
+               switch (session_state())
                {
-                  stop_serial_timer();
-                  strcat(response, buf);
-                  status = process_response("atz", response);
-
-                  strcpy(obd_interface, response);
-                  strcpy(obd_mfr, "N/A");
-                  
-                  if (status == INTERFACE_ELM323)
-                  {
-                     start_serial_timer(ECU_TIMEOUT);
-                     strcpy(obd_protocol, "waiting for ECU timeout...");
-                     device = INTERFACE_ELM323;
-                     state = OBD_INFO_ECU_TIMEOUT;
-                  }
-                  else if (status >= INTERFACE_ID)
-                  {
-                     send_command("0100");
-                     start_serial_timer(OBD_REQUEST_TIMEOUT);
-                     response[0] = 0;
-                     strcpy(obd_protocol, "detecting...");
-                     device = status;
-                     state = OBD_INFO_WAIT_0100;
-                  }
-                  else if (status == HEX_DATA)
-                  {
-                     state = OBD_INFO_START;
+                  case SESSION_CONNECTING:
                      break;
-                  }
-                  else
-                  {
-                     if (display_error_message(status, TRUE) == 1)
-                     {
-                        state = OBD_INFO_START;
-                        break;
-                     }
-                     else
-                     {
-                        clear_obd_info();
-                        state = OBD_INFO_IDLE;
-                        return D_REDRAW;
-                     }
-                  }
-                  
-                  return D_REDRAW;
-               }
-               else if (serial_time_out)
-               {
-                  stop_serial_timer();
-                  if (alert("Connection to interface was lost", NULL, NULL, "&Retry", "&Cancel", 'r', 'c') == 1)
-                     state = OBD_INFO_START;
-                  else
-                  {
-                     clear_obd_info();
-                     state = OBD_INFO_IDLE;
-                     return D_REDRAW;
-                  }
-               }
-               break;
 
-            case OBD_INFO_ECU_TIMEOUT:
-               if (serial_time_out)
-               {
-                  stop_serial_timer();
-                  send_command("0100");
-                  start_serial_timer(OBD_REQUEST_TIMEOUT);
-                  response[0] = 0;
-                  strcpy(obd_protocol, "detecting...");
-                  state = OBD_INFO_WAIT_0100;
-                  return D_REDRAW;
-               }
-               break;
-
-            case OBD_INFO_WAIT_0100:
-               status = read_comport(buf);
+                  case SESSION_READY:
+                     start_reading();
+                     break;
 
-               if(status == DATA) // if new data detected in com port buffer
-                  strcat(response, buf); // append contents of buf to response
-               else if (status == PROMPT)  // if we got the prompt
-               {
-                  stop_serial_timer();
-                  strcat(response, buf);
-                  status = process_response("0100", response);
-
-                  if (status == HEX_DATA)
-                  {
-                     if (device != INTERFACE_ELM327)
-                        strcpy(obd_protocol, get_protocol_string(device, 0));
-                     else
-                     {
-                        send_command("atdpn");
-                        start_serial_timer(AT_TIMEOUT);
-                        response[0] = 0;
-
-                        while ((status = read_comport(buf)) != PROMPT && !serial_time_out)
-                        {
-                           if (status == DATA) // if new data detected in com port buffer
-                              strcat(response, buf); // append contents of buf to response
-                        }
-
-                        if (status == PROMPT)  // if we got the prompt
-                        {
-                           stop_serial_timer();
-                           strcat(response, buf);
-                           process_response("atdpn", response);
-
-                           status = (response[0] == 'A') ? response[1] : response[0];
-                           strcpy(obd_protocol, get_protocol_string(INTERFACE_ELM327, status - 48));
-                        }
-                        else // if serial timeout
-                        {
-                           stop_serial_timer();
-                           if (alert("Connection to interface was lost", NULL, NULL, "&Retry", "&Cancel", 'r', 'c') == 1)
-                              state = OBD_INFO_START;
-                           else
-                           {
-                              clear_obd_info();
-                              state = OBD_INFO_IDLE;
-                              return D_REDRAW;
-                           }
-                        }
-                     }
-                  }
-                  else
-                  {
-                     if (status == ERR_NO_DATA || status == UNABLE_TO_CONNECT)
-                        status = alert("There may have been a loss of connection.", "Please check connection to the vehicle,", "and make sure the ignition is ON", "&Retry", "&Cancel", 'r', 'c');
-                     else if (status >= INTERFACE_ID)
-                        status = 1;
+                  case SESSION_FAILED:
+                     error = session_error();
+                     if (error == ACQ_TIMED_OUT)
+                        connection_lost();
+                     else if (error == ERR_NO_DATA || error == UNABLE_TO_CONNECT)
+                        retry_or_cancel(alert("There may have been a loss of connection.", "Please check connection to the vehicle,", "and make sure the ignition is ON", "&Retry", "&Cancel", 'r', 'c') == 1);
                      else  // all other errors
-                        status = display_error_message(status, TRUE);
-
-                     if (status == 1)
-                     {
-                        state = OBD_INFO_START;
-                        break;
-                     }
-                     else
-                     {
-                        clear_obd_info();
-                        state = OBD_INFO_IDLE;
-                        return D_REDRAW;
-                     }
-                  }
-
-                  send_command("011C");
-                  start_serial_timer(OBD_REQUEST_TIMEOUT);
-                  response[0] = 0;
-                  strcpy(obd_system, "detecting...");
-                  state = OBD_INFO_WAIT_011C;
-                  return D_REDRAW;
-               }
-               else if (serial_time_out)
-               {
-                  stop_serial_timer();
-                  if (alert("Connection to interface was lost", NULL, NULL, "&Retry", "&Cancel", 'r', 'c') == 1)
-                     state = OBD_INFO_START;
-                  else
-                  {
-                     clear_obd_info();
-                     state = OBD_INFO_IDLE;
-                     return D_REDRAW;
-                  }
-               }
-               break;
-
-            case OBD_INFO_WAIT_011C:
-               status = read_comport(buf);
+                        retry_or_cancel(display_error_message(error, TRUE) == 1);
+                     break;
 
-               if(status == DATA) // if new data detected in com port buffer
-                  strcat(response, buf); // append contents of buf to response
-               else if (status == PROMPT)  // if we got the prompt
-               {
-                  stop_serial_timer();
-                  strcat(response, buf);
-                  status = process_response("011C", response);
-
-                  if (status == HEX_DATA)
-                  {
-                     if (find_valid_response(buf, response, "411C", NULL))
-                     {
-                        buf[6] = 0;  // solves problem where response is padded with zeroes
-                        obd_requirements_formula((int)strtol(buf + 4, NULL, 16), buf);  // get OBD requirements string
-                        strcpy(obd_system, buf);
-                     }
-                  }
-                  else if (status == ERR_NO_DATA)
-                     strcpy(obd_system, "N/A");
-                  else  // other errors
-                  {
-                     if (display_error_message(status, TRUE) == 1)
-                     {
-                        state = OBD_INFO_START;
-                        break;
-                     }
-                     else
-                        clear_obd_info();
-                  }
-
-                  state = OBD_INFO_IDLE;
-                  return D_REDRAW;
-               }
-               else if (serial_time_out)
-               {
-                  stop_serial_timer();
-                  if (alert("Connection to interface was lost", NULL, NULL, "&Retry", "&Cancel", 'r', 'c') == 1)
-                     state = OBD_INFO_START;
-                  else
-                  {
-                     clear_obd_info();
-                     state = OBD_INFO_IDLE;
-                     return D_REDRAW;
-                  }
+                  default:  // the port was changed
+                     info_state = OBD_INFO_START;
+                     break;
                }
                break;
          }
+
+         if (info_changed)
+         {
+            info_changed = FALSE;
+            return D_REDRAW;
+         }
          break;
    }
 
    return D_O_K;
 }
 
-
 int thanks_proc(int msg, DIALOG *d, int c)
 {
    int ret = d_button_proc(msg, d, c);
@@ -0,0 +1,280 @@
+#include <string.h>
+#include "globals.h"
+#ifdef ALLEGRO_WINDOWS
+   #include <winalleg.h>
+#endif
+#include "serial.h"
+#include "error_handlers.h"
+#include "clock.h"
+#include "acquisition.h"
+
+/* While the acquisition engine is running, it owns the COM port.  Requests are
+ * handed over through a ring of transactions: the GUI fills the slot at head,
+ * the engine answers the requests in order and advances done, and the GUI
+ * collects the answers at tail.  Each index is written by one side only, so
+ * the ring needs no locking.
+ *
+ * In the Windows build the engine runs in a thread of its own, so that polling
+ * does not depend on how often the dialogs idle.  Under DOS the transactions
+ * are carried out a step at a time from acq_get_response().  Either way, the
+ * next queued request is written as soon as the prompt of the previous one
+ * is seen, in the same step.  The ELM327 drops whatever it is doing when a
+ * character arrives, so a request can't be sent before the prompt.
+ *
+ * Requests are built (with their CR) when they are submitted, and sent with
+ * send_request(), which doesn't empty the receive buffer.  It's only emptied
+ * before the request that follows a time-out, when the rest of the late
+ * response could still be on its way.
+ */
+
+static ACQ_TRANSACTION ring[ACQ_QUEUE_SIZE];
+static volatile long head = 0;  // next free slot, written by the GUI
+static volatile long done = 0;  // next request to be answered, written by the engine
+static volatile long tail = 0;  // next answer to be collected, written by the GUI
+
+#ifdef ALLEGRO_WINDOWS
+   #define ACQ_WAIT_SLICE   100  // how often the thread checks whether it should quit, in milliseconds
+   static HANDLE acq_thread = NULL;
+   static HANDLE acq_wakeup = NULL;   // signalled when a request is submitted
+   static volatile int acq_quit = FALSE;
+   static DWORD WINAPI acq_thread_proc(LPVOID param);
+#else
+   static int in_progress = FALSE;    // TRUE if request was sent, waiting for the response
+   static unsigned long sent;         // clock_ms() time the request was sent
+   static int timed_out = FALSE;      // TRUE if the last request got no prompt
+   static void start_transaction(ACQ_TRANSACTION *t);
+   static void acq_step();
+#endif
+
+static int transaction_timeout(const ACQ_TRANSACTION *t);
+static void finish_transaction(ACQ_TRANSACTION *t);
+
+void acq_start()
+{
+#ifdef ALLEGRO_WINDOWS
+   DWORD thread_id;
+#endif
+
+   head = done = tail = 0;
+
+#ifdef ALLEGRO_WINDOWS
+   acq_quit = FALSE;
+   if ((acq_wakeup = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+      fatal_error("Could not create acquisition event");
+   if ((acq_thread = CreateThread(NULL, 0, acq_thread_proc, NULL, 0, &thread_id)) == NULL)
+      fatal_error("Could not create acquisition thread");
+#else
+   in_progress = FALSE;
+   timed_out = FALSE;
+#endif
+}
+
+
+/* acq_stop:
+ *  Stops the engine and throws away all requests that were not collected yet.
+ *  The COM port may be used directly again (i.e., by program_adapter_timing()).
+ */
+void acq_stop()
+{
+#ifdef ALLEGRO_WINDOWS
+   if (acq_thread)
+   {
+      acq_quit = TRUE;
+      SetEvent(acq_wakeup);
+      WaitForSingleObject(acq_thread, INFINITE);
+      CloseHandle(acq_thread);
+      CloseHandle(acq_wakeup);
+      acq_thread = NULL;
+      acq_wakeup = NULL;
+   }
+#else
+   if (in_progress)
+      stop_serial_timer();
+   in_progress = FALSE;
+#endif
+
+   head = done = tail = 0;
+}
+
+
+/* acq_submit:
+ *  Queues a request for the engine.  With a timeout of 0, the request is
+ *  given get_request_timeout() (as it is when the request is sent).  Returns
+ *  FALSE if the ring is full.
+ */
+int acq_submit(const char *cmd, int tag, int timeout, int flags)
+{
+   ACQ_TRANSACTION *t;
+
+   if (head - tail >= ACQ_QUEUE_SIZE)
+      return FALSE;
+
+   t = &ring[head & (ACQ_QUEUE_SIZE - 1)];
+   strncpy(t->cmd, cmd, sizeof(t->cmd) - 1);
+   t->cmd[sizeof(t->cmd) - 1] = 0;
+   t->tx_len = build_request(t->tx, sizeof(t->tx), t->cmd);
+   t->tag = tag;
+   t->timeout = timeout;
+   t->flags = flags;
+
+#ifdef ALLEGRO_WINDOWS
+   InterlockedExchange((LONG *)&head, head + 1);  // publish the slot
+   SetEvent(acq_wakeup);
+#else
+   head++;
+#endif
+
+   return TRUE;
+}
+
+
+// number of requests that were submitted, but whose answers were not collected yet
+int acq_pending()
+{
+   return head - tail;
+}
+
+
+/* acq_get_response:
+ *  Returns the oldest answered request, or NULL if there's none.  The
+ *  transaction stays valid until acq_release() is called.
+ */
+ACQ_TRANSACTION *acq_get_response()
+{
+#ifndef ALLEGRO_WINDOWS
+   acq_step();
+#endif
+
+   if (tail == done)
+      return NULL;
+
+   return &ring[tail & (ACQ_QUEUE_SIZE - 1)];
+}
+
+
+void acq_release()
+{
+   if (tail != done)
+      tail++;
+}
+
+
+int transaction_timeout(const ACQ_TRANSACTION *t)
+{
+   return (t->timeout > 0) ? t->timeout : get_request_timeout();
+}
+
+
+// called when the prompt is seen
+void finish_transaction(ACQ_TRANSACTION *t)
+{
+   int len = strlen(t->response.data);
+
+   if (t->flags & ACQ_RAW_RESPONSE)
+   {
+      while (len > 0 && t->response.data[len-1] <= ' ')  // the CRs before the prompt
+         t->response.data[--len] = 0;
+      t->response_type = PROMPT;
+      return;
+   }
+
+   t->response_type = process_response(t->cmd, t->response.data);
+   if (t->response_type == HEX_DATA)
+      index_response(t->response.data, &t->lines);
+}
+
+
+#ifdef ALLEGRO_WINDOWS
+
+DWORD WINAPI acq_thread_proc(LPVOID param)
+{
+   ACQ_TRANSACTION *t;
+   unsigned long sent;
+   int timed_out = FALSE;
+
+   while (!acq_quit)
+   {
+      if (done == head)  // nothing to do, wait for a request
+      {
+         WaitForSingleObject(acq_wakeup, INFINITE);
+         continue;
+      }
+
+      t = &ring[done & (ACQ_QUEUE_SIZE - 1)];
+      rx_buffer_clear(&t->response);
+      t->response_type = ACQ_TIMED_OUT;
+      if (timed_out)
+         discard_input();
+      send_request(t->tx, t->tx_len);
+      sent = clock_ms();
+
+      // wait in short slices, so acq_stop() doesn't have to wait for the whole timeout
+      while (!acq_quit && !DEADLINE_PASSED(sent + transaction_timeout(t)))
+      {
+         if (read_until_prompt(&t->response, ACQ_WAIT_SLICE) == PROMPT)
+         {
+            t->latency = clock_ms() - sent;
+            finish_transaction(t);
+            break;
+         }
+      }
+      timed_out = (t->response_type == ACQ_TIMED_OUT);
+
+      if (!acq_quit)
+         InterlockedExchange((LONG *)&done, done + 1);  // publish the answer
+   }
+
+   return 0;
+}
+
+#else
+
+void start_transaction(ACQ_TRANSACTION *t)
+{
+   rx_buffer_clear(&t->response);
+   if (timed_out)
+      discard_input();
+   send_request(t->tx, t->tx_len);
+   start_serial_timer(transaction_timeout(t));
+   sent = clock_ms();
+   in_progress = TRUE;
+}
+
+
+void acq_step()
+{
+   ACQ_TRANSACTION *t = &ring[done & (ACQ_QUEUE_SIZE - 1)];
+   int status;
+
+   if (!in_progress)
+   {
+      if (done != head)
+         start_transaction(t);
+      return;
+   }
+
+   status = read_response(&t->response);
+
+   if (status == PROMPT)
+   {
+      stop_serial_timer();
+      t->latency = clock_ms() - sent;
+      finish_transaction(t);
+   }
+   else if (serial_time_out())
+   {
+      stop_serial_timer();
+      t->response_type = ACQ_TIMED_OUT;
+   }
+   else
+      return;
+
+   timed_out = (t->response_type == ACQ_TIMED_OUT);
+   in_progress = FALSE;
+   done++;
+
+   if (done != head)  // the next request follows the prompt, it doesn't wait for the next call
+      start_transaction(&ring[done & (ACQ_QUEUE_SIZE - 1)]);
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef ACQUISITION_H
+#define ACQUISITION_H
+
+#define ACQ_QUEUE_SIZE        4   // number of transactions in the ring, must be a power of 2
+#define ACQ_TIMED_OUT        -1   // response_type of a request that did not get a prompt in time
+#define ACQ_RAW_RESPONSE      1   // acq_submit() flag: the response is not processed (i.e., AT@1 text, with its spaces)
+
+typedef struct
+{
+   char cmd[32];          // request sent to the interface
+   char tx[MAX_REQUEST_LENGTH];  // cmd with the CR, built when the request is submitted
+   int tx_len;
+   int tag;               // identifies the request to whoever submitted it
+   int timeout;           // milliseconds to wait for the prompt, 0 for get_request_timeout()
+   int flags;             // ACQ_RAW_RESPONSE
+   int response_type;     // process_response() return value, PROMPT for a raw response, or ACQ_TIMED_OUT
+   RX_BUFFER response;    // response, as processed by process_response() (without the prompt if raw)
+   RESPONSE_INDEX lines;  // lines of a HEX_DATA response, see index_response()
+   int latency;           // milliseconds from sending the request to the prompt
+} ACQ_TRANSACTION;
+
+void acq_start();
+void acq_stop();
+int acq_submit(const char *cmd, int tag, int timeout, int flags);
+int acq_pending();
+ACQ_TRANSACTION *acq_get_response();
+void acq_release();
+
+#endif
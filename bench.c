@@ -0,0 +1,271 @@
+/* bench.c:
+ *  Command-line benchmark for the serial layer.  Sends each request a number
+ *  of times to the interface (or to a recorded session, see replay.c), and
+ *  reports request->prompt latency, time to the first byte of the response,
+ *  and throughput.  The latency of an AT command, which the interface answers
+ *  by itself, is used to split the OBD round trip into interface and ECU time.
+ *
+ *  Usage: bench [-r session [-f]] [-c comport] [-b baud] [-n count] [request ...]
+ */
+
+#include <string.h>
+#include "globals.h"
+#include "serial.h"
+#include "clock.h"
+#include "replay.h"
+
+#define DEFAULT_NUM_OF_REQUESTS   100
+#define MAX_NUM_OF_REQUESTS       10000
+#define MAX_BENCH_REQUESTS        16
+#define ADAPTER_REQUEST           "atdpn"   // answered by the interface, without talking to the vehicle
+
+typedef struct
+{
+   const char *cmd;
+   unsigned long *latency;    // request->prompt time of each answered request, in microseconds
+   int num_of_samples;
+   int timeouts;
+   unsigned long first_byte;  // sum of times to the first byte of the response
+   long bytes;                // characters sent and received
+   unsigned long total_time;  // sum of latencies
+} BENCH_STATS;
+
+static const unsigned long histogram_limits[] = { 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 0 };
+
+static int timed_request(const char *cmd, RX_BUFFER *rx, unsigned long *first_byte, unsigned long *latency, int timeout);
+static void run_benchmark(BENCH_STATS *stats, int count, RX_BUFFER *rx);
+static unsigned long percentile(BENCH_STATS *stats, int pct);
+static int compare_samples(const void *a, const void *b);
+static void print_stats(BENCH_STATS *stats);
+static void print_histogram(BENCH_STATS *stats);
+
+
+int main(int argc, char **argv)
+{
+   const char *default_requests[] = { "010C", "010D", "0105", "0111" };
+   BENCH_STATS stats[MAX_BENCH_REQUESTS + 1];  // first one is the interface baseline
+   int num_of_requests = 0;
+   const char *session_file = NULL;
+   int replay_timing = REPLAY_RECORDED;
+   int count = DEFAULT_NUM_OF_REQUESTS;
+   static RX_BUFFER rx;
+   unsigned long first_byte, latency;
+   int i;
+
+   if (allegro_init() != 0 || install_timer() != 0)
+   {
+      printf("Error initializing Allegro\n");
+      return EXIT_FAILURE;
+   }
+   clock_init();
+
+   strcpy(options_file_name, "scantool.cfg");
+   set_config_file(options_file_name);
+   comport.number = get_config_int("comm", "comport_number", COM1);
+   comport.baud_rate = get_config_int("comm", "baud_rate", BAUD_RATE_9600);
+
+   stats[0].cmd = ADAPTER_REQUEST;
+   for (i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+         session_file = argv[++i];
+      else if (strcmp(argv[i], "-f") == 0)
+         replay_timing = REPLAY_FAST;
+      else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+         comport.number = atoi(argv[++i]) - 1;
+      else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+         comport.baud_rate = atoi(argv[++i]);
+      else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+         count = MID(1, atoi(argv[++i]), MAX_NUM_OF_REQUESTS);
+      else if (argv[i][0] != '-' && num_of_requests < MAX_BENCH_REQUESTS)
+         stats[++num_of_requests].cmd = argv[i];
+      else
+      {
+         printf("Usage: %s [-r session [-f]] [-c comport] [-b baud] [-n count] [request ...]\n", argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (num_of_requests == 0)
+   {
+      for (i = 0; i < sizeof(default_requests)/sizeof(default_requests[0]); i++)
+         stats[++num_of_requests].cmd = default_requests[i];
+   }
+
+   serial_module_init();
+   if (session_file && !replay_open(session_file, replay_timing))
+   {
+      printf("Could not load session %s\n", session_file);
+      return EXIT_FAILURE;
+   }
+
+   open_comport();
+   if (comport.status != READY)
+   {
+      printf("Could not open COM%i\n", comport.number + 1);
+      return EXIT_FAILURE;
+   }
+
+   // reset the interface, and let it find the vehicle protocol
+   timed_request("atz", &rx, &first_byte, &latency, ATZ_TIMEOUT);
+   if (!timed_request("0100", &rx, &first_byte, &latency, OBD_REQUEST_TIMEOUT) || process_response("0100", rx.data) != HEX_DATA)
+      printf("Warning: vehicle did not respond to 0100\n");
+   if (timed_request("atdpn", &rx, &first_byte, &latency, AT_TIMEOUT))
+      obd_device.protocol = parse_protocol_number(rx.data);
+
+   if (session_file)
+      printf("Interface: replay of %s\n", session_file);
+   else
+      printf("Interface: COM%i\n", comport.number + 1);
+   printf("Protocol: %s\n", get_protocol_string(INTERFACE_ELM327, obd_device.protocol));
+   printf("Requests: %i of each\n\n", count);
+
+   for (i = 0; i <= num_of_requests; i++)
+   {
+      run_benchmark(&stats[i], count, &rx);
+      print_stats(&stats[i]);
+      if (stats[i].num_of_samples > 0 && i > 0 && stats[0].num_of_samples > 0)
+      {
+         printf("  interface ~%.2f ms, ECU ~%.2f ms (p50)\n",
+            percentile(&stats[0], 50) / 1000.0,
+            ((long)percentile(&stats[i], 50) - (long)percentile(&stats[0], 50)) / 1000.0);
+      }
+      print_histogram(&stats[i]);
+      printf("\n");
+   }
+
+   for (i = 0; i <= num_of_requests; i++)
+      free(stats[i].latency);
+
+   serial_module_shutdown();
+   replay_close();
+
+   return EXIT_SUCCESS;
+}
+END_OF_MAIN()
+
+
+/* timed_request:
+ *  Sends cmd and reads the response into rx.  Returns FALSE if the prompt did
+ *  not arrive within timeout milliseconds.  Times are in microseconds.
+ */
+int timed_request(const char *cmd, RX_BUFFER *rx, unsigned long *first_byte, unsigned long *latency, int timeout)
+{
+   unsigned long start;
+   unsigned long now;
+   int status;
+
+   rx_buffer_clear(rx);
+   *first_byte = 0;
+   start = clock_us();
+   send_command(cmd);
+
+   for (;;)
+   {
+      status = read_response(rx);
+      now = clock_us();
+      if (*first_byte == 0 && status != EMPTY)
+         *first_byte = now - start;
+      if (status == PROMPT)
+         break;
+      if (now - start >= (unsigned long)timeout*1000)
+         return FALSE;
+   }
+
+   *latency = now - start;
+
+   return TRUE;
+}
+
+
+void run_benchmark(BENCH_STATS *stats, int count, RX_BUFFER *rx)
+{
+   unsigned long first_byte, latency;
+   int i;
+
+   if (!(stats->latency = (unsigned long *)malloc(count*sizeof(unsigned long))))
+   {
+      printf("Not enough memory\n");
+      exit(EXIT_FAILURE);
+   }
+   stats->num_of_samples = 0;
+   stats->timeouts = 0;
+   stats->first_byte = 0;
+   stats->bytes = 0;
+   stats->total_time = 0;
+
+   for (i = 0; i < count; i++)
+   {
+      if (timed_request(stats->cmd, rx, &first_byte, &latency, OBD_REQUEST_TIMEOUT))
+      {
+         stats->latency[stats->num_of_samples++] = latency;
+         stats->first_byte += first_byte;
+         stats->total_time += latency;
+         stats->bytes += strlen(stats->cmd) + 1 + rx->len + 1;  // CR, and the prompt
+      }
+      else
+         stats->timeouts++;
+   }
+
+   qsort(stats->latency, stats->num_of_samples, sizeof(unsigned long), compare_samples);
+}
+
+
+// returns the pct-th percentile of the latencies, the samples must be sorted
+unsigned long percentile(BENCH_STATS *stats, int pct)
+{
+   if (stats->num_of_samples == 0)
+      return 0;
+
+   return stats->latency[(stats->num_of_samples - 1) * pct / 100];
+}
+
+
+int compare_samples(const void *a, const void *b)
+{
+   unsigned long x = *(const unsigned long *)a;
+   unsigned long y = *(const unsigned long *)b;
+
+   return (x > y) - (x < y);
+}
+
+
+void print_stats(BENCH_STATS *stats)
+{
+   printf("%s: %i answered, %i timed out\n", stats->cmd, stats->num_of_samples, stats->timeouts);
+   if (stats->num_of_samples == 0)
+      return;
+
+   printf("  latency p50 %.2f ms, p99 %.2f ms, min %.2f ms, max %.2f ms\n",
+      percentile(stats, 50) / 1000.0, percentile(stats, 99) / 1000.0,
+      stats->latency[0] / 1000.0, stats->latency[stats->num_of_samples - 1] / 1000.0);
+   printf("  first byte %.2f ms (mean), %.1f requests/s, %.0f bytes/s\n",
+      stats->first_byte / 1000.0 / stats->num_of_samples,
+      stats->num_of_samples * 1000000.0 / MAX(stats->total_time, 1),
+      stats->bytes * 1000000.0 / MAX(stats->total_time, 1));
+}
+
+
+void print_histogram(BENCH_STATS *stats)
+{
+   int bucket, i, j, n;
+
+   i = 0;
+   for (bucket = 0; i < stats->num_of_samples; bucket++)
+   {
+      n = 0;
+      while (i < stats->num_of_samples && (histogram_limits[bucket] == 0 || stats->latency[i] < histogram_limits[bucket]))
+      {
+         n++;
+         i++;
+      }
+
+      if (histogram_limits[bucket] == 0)
+         printf("  >=%5lu ms %6i ", histogram_limits[bucket - 1] / 1000, n);
+      else
+         printf("  <%6lu ms %6i ", histogram_limits[bucket] / 1000, n);
+      for (j = 0; j < n * 50 / stats->num_of_samples; j++)
+         printf("#");
+      printf("\n");
+   }
+}
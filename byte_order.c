@@ -0,0 +1,23 @@
+#include "byte_order.h"
+
+
+// stores the num_of_bytes lowest bytes of value at dest, least significant first
+void put_le_value(unsigned char *dest, unsigned long value, int num_of_bytes)
+{
+   int i;
+
+   for (i = 0; i < num_of_bytes; i++)
+      dest[i] = (value >> (i*8)) & 0xFF;
+}
+
+
+unsigned long get_le_value(const unsigned char *src, int num_of_bytes)
+{
+   unsigned long value = 0;
+   int i;
+
+   for (i = num_of_bytes - 1; i >= 0; i--)
+      value = (value << 8) | src[i];
+
+   return value;
+}
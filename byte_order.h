@@ -0,0 +1,8 @@
+#ifndef BYTE_ORDER_H
+#define BYTE_ORDER_H
+
+// the session recordings, binary logs, and published samples are all little-endian
+void put_le_value(unsigned char *dest, unsigned long value, int num_of_bytes);
+unsigned long get_le_value(const unsigned char *src, int num_of_bytes);
+
+#endif
@@ -0,0 +1,78 @@
+#include "globals.h"
+#ifdef ALLEGRO_WINDOWS
+   #include <winalleg.h>
+#endif
+#include "clock.h"
+
+/* Monotonic clock used for timeouts, refresh rate statistics and the session
+ * recorder.  Under Windows it is read from the performance counter.  Under DOS
+ * the PIT is already programmed by Allegro (so uclock() can't be used), so one
+ * 1 kHz timer interrupt is installed for the lifetime of the program, instead
+ * of a timer being installed and removed around every request.
+ */
+
+#ifdef ALLEGRO_WINDOWS
+   static LONGLONG frequency = 0;
+#else
+   static volatile unsigned long milliseconds = 0;
+
+   static void clock_tick()
+   {
+      milliseconds++;
+   }
+   END_OF_STATIC_FUNCTION(clock_tick)
+#endif
+
+
+// must be called after install_timer()
+void clock_init()
+{
+#ifdef ALLEGRO_WINDOWS
+   LARGE_INTEGER count;
+
+   QueryPerformanceFrequency(&count);
+   frequency = count.QuadPart;
+#else
+   LOCK_VARIABLE(milliseconds);
+   LOCK_FUNCTION(clock_tick);
+   install_int_ex(clock_tick, BPS_TO_TIMER(1000));
+#endif
+}
+
+
+void clock_shutdown()
+{
+#ifndef ALLEGRO_WINDOWS
+   remove_int(clock_tick);
+#endif
+}
+
+
+// microseconds, wraps around every ~71 minutes
+unsigned long clock_us()
+{
+#ifdef ALLEGRO_WINDOWS
+   LARGE_INTEGER count;
+
+   QueryPerformanceCounter(&count);
+
+   return (unsigned long)((count.QuadPart / frequency) * 1000000 + (count.QuadPart % frequency) * 1000000 / frequency);
+#else
+   return milliseconds * 1000;
+#endif
+}
+
+
+// milliseconds, wraps around every ~49 days
+unsigned long clock_ms()
+{
+#ifdef ALLEGRO_WINDOWS
+   LARGE_INTEGER count;
+
+   QueryPerformanceCounter(&count);
+
+   return (unsigned long)((count.QuadPart / frequency) * 1000 + (count.QuadPart % frequency) * 1000 / frequency);
+#else
+   return milliseconds;
+#endif
+}
@@ -0,0 +1,12 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+// TRUE once the clock_ms() time deadline has passed (wrap-around safe)
+#define DEADLINE_PASSED(deadline)   ((long)(clock_ms() - (deadline)) >= 0)
+
+void clock_init();
+void clock_shutdown();
+unsigned long clock_us();
+unsigned long clock_ms();
+
+#endif
@@ -0,0 +1,202 @@
+#include <string.h>
+#include <ctype.h>
+#include "globals.h"
+#include "error_handlers.h"
+#include "code_defs.h"
+
+#define FIELD_DELIMITER     '\t'
+#define RECORD_DELIMITER    0xA
+
+#define READ_BLOCK_SIZE     4096  // how much of a code file is decompressed at a time
+
+/* The code definitions from codes.dat are decompressed once, when the program
+ * starts.  All of the text ends up in one string pool, with the delimiters
+ * replaced by NULs, and the table holds the codes in ascending order together
+ * with offsets of their descriptions and solutions into the pool.
+ */
+
+typedef struct
+{
+   char code[6];     // i.e., "P0123"
+   int description;  // offset into the string pool, -1 if there's no description
+   int solution;     // offset into the string pool, -1 if there's no solution
+} CODE_DEF;
+
+static CODE_DEF *code_defs = NULL;
+static int num_of_code_defs = 0;
+static char *string_pool = NULL;
+static int pool_size = 0;
+
+static int read_code_file(char code_letter);
+static void index_code_defs();
+static int end_field(int pos, int end_of_record_only, int *delimiter);
+static int compare_code_defs(const void *a, const void *b);
+
+
+/* load_code_defs:
+ *  Reads the definitions of all code letters into memory.  Returns number of
+ *  definitions loaded.
+ */
+int load_code_defs()
+{
+   const char *code_letters = "PCBU";
+   int i;
+
+   unload_code_defs();
+
+   for (i = 0; code_letters[i]; i++)
+      read_code_file(code_letters[i]);
+
+   if (pool_size > 0)
+      index_code_defs();
+
+   return num_of_code_defs;
+}
+
+
+void unload_code_defs()
+{
+   free(code_defs);
+   free(string_pool);
+   code_defs = NULL;
+   string_pool = NULL;
+   num_of_code_defs = 0;
+   pool_size = 0;
+}
+
+
+/* find_code_def:
+ *  Looks up the definition of a code (only first 5 characters are compared).
+ *  Returns FALSE if the code is not in the database.  Description and/or
+ *  solution are set to NULL if the database does not have them.
+ */
+int find_code_def(const char *code, const char **description, const char **solution)
+{
+   CODE_DEF key;
+   CODE_DEF *def;
+
+   strncpy(key.code, code, 5);
+   key.code[5] = 0;
+
+   def = bsearch(&key, code_defs, num_of_code_defs, sizeof(CODE_DEF), compare_code_defs);
+   if (def == NULL)
+      return FALSE;
+
+   *description = (def->description >= 0 && string_pool[def->description]) ? string_pool + def->description : NULL;
+   *solution = (def->solution >= 0 && string_pool[def->solution]) ? string_pool + def->solution : NULL;
+
+   return TRUE;
+}
+
+
+// appends the decompressed contents of the code file to the string pool, returns FALSE if the file could not be opened
+int read_code_file(char code_letter)
+{
+   char file_name[30];
+   PACKFILE *file;
+   int n;
+
+   sprintf(file_name, "%s#%ccodes", code_defs_file_name, tolower(code_letter));
+   packfile_password(PASSWORD);
+   file = pack_fopen(file_name, F_READ_PACKED);
+   packfile_password(NULL);
+   if (file == NULL)
+      return FALSE;
+
+   do
+   {
+      // leave room for the record delimiter between the files, and for the terminating NUL
+      if (!(string_pool = (char *)realloc(string_pool, pool_size + READ_BLOCK_SIZE + 2)))
+      {
+         sprintf(temp_error_buf, "Could not allocate enough memory for trouble code definitions [%i]", pool_size);
+         fatal_error(temp_error_buf);
+      }
+      n = pack_fread(string_pool + pool_size, READ_BLOCK_SIZE, file);
+      pool_size += MAX(n, 0);
+   } while (n == READ_BLOCK_SIZE);
+
+   pack_fclose(file);
+
+   string_pool[pool_size++] = RECORD_DELIMITER;  // in case the last record in the file was not terminated
+   string_pool[pool_size] = 0;
+
+   return TRUE;
+}
+
+
+/* index_code_defs:
+ *  Splits the string pool into records (code[\tdescription[\tsolution]]\n),
+ *  terminating each field in place, and sorts the resulting table by code.
+ */
+void index_code_defs()
+{
+   CODE_DEF *def;
+   int table_size = 0;
+   int pos = 0;
+   int code;
+   int delimiter;
+
+   while (pos < pool_size)
+   {
+      if (num_of_code_defs >= table_size)
+      {
+         table_size = (table_size > 0) ? table_size*2 : 1024;
+         if (!(code_defs = (CODE_DEF *)realloc(code_defs, table_size*sizeof(CODE_DEF))))
+         {
+            sprintf(temp_error_buf, "Could not allocate enough memory for trouble code definitions [%i]", num_of_code_defs);
+            fatal_error(temp_error_buf);
+         }
+      }
+
+      def = &code_defs[num_of_code_defs];
+      def->description = -1;
+      def->solution = -1;
+
+      code = pos;
+      pos = end_field(pos, FALSE, &delimiter);
+      if (delimiter == FIELD_DELIMITER)
+      {
+         def->description = pos;
+         pos = end_field(pos, FALSE, &delimiter);
+         if (delimiter == FIELD_DELIMITER)
+         {
+            def->solution = pos;
+            pos = end_field(pos, TRUE, &delimiter);  // solution runs to the end of the record
+         }
+      }
+
+      if (strlen(string_pool + code) >= 5)  // skip blank lines
+      {
+         strncpy(def->code, string_pool + code, 5);
+         def->code[5] = 0;
+         num_of_code_defs++;
+      }
+   }
+
+   qsort(code_defs, num_of_code_defs, sizeof(CODE_DEF), compare_code_defs);
+}
+
+
+// terminates the field that starts at pos, returns start of the next field
+int end_field(int pos, int end_of_record_only, int *delimiter)
+{
+   while (pos < pool_size && string_pool[pos] != RECORD_DELIMITER && (end_of_record_only || string_pool[pos] != FIELD_DELIMITER))
+      pos++;
+
+   if (pos >= pool_size)
+   {
+      *delimiter = RECORD_DELIMITER;
+      return pool_size;
+   }
+
+   *delimiter = string_pool[pos];
+   string_pool[pos] = 0;
+
+   return pos + 1;
+}
+
+
+int compare_code_defs(const void *a, const void *b)
+{
+   return strcmp(((const CODE_DEF *)a)->code, ((const CODE_DEF *)b)->code);
+}
@@ -0,0 +1,8 @@
+#ifndef CODE_DEFS_H
+#define CODE_DEFS_H
+
+int load_code_defs();
+void unload_code_defs();
+int find_code_def(const char *code, const char **description, const char **solution);
+
+#endif
@@ -0,0 +1,280 @@
+#include <string.h>
+#include "globals.h"
+#include "serial.h"
+#include "custom_gui.h"
+#include "error_handlers.h"
+#include "pids.h"
+#include "freeze_frame.h"
+
+#define MAX_FREEZE_FRAME_PIDS   0x60  // $01-$60, the PIDs covered by "PIDs supported" $00, $20, and $40
+#define MAX_PIDS_PER_REQUEST    3     // every PID in a mode 02 request is followed by the frame number, so only 3 fit in a CAN frame
+#define FREEZE_FRAME_DTC        0x02  // PID of the DTC that caused the freeze frame
+#define FREEZE_FRAME_TEXT       3     // textbox in freeze_frame_dialog
+
+// frame_status
+#define FRAME_NOT_READ          0     // the codes were not read since the freeze frame was cleared
+#define FRAME_READ              1     // the vehicle was asked for the freeze frame (or it had no codes to store one for)
+#define FRAME_FAILED            2     // a request was not answered, frame_data may be incomplete
+
+/* The freeze frame (frame 0 of mode 02) is read right after the trouble codes,
+ * by the same chain of session requests (see codes_response()), and kept until
+ * the codes are read or cleared again.  The first request asks for the DTC that caused the
+ * freeze frame and the first "PIDs supported" bitmap; every bitmap that comes
+ * back queues the supported PIDs that are in the PID table, and the next
+ * bitmap.  Queued PIDs are requested several at a time on CAN, so a typical
+ * freeze frame takes a handful of requests.  Data is stored raw, and decoded
+ * with the PID table when the freeze frame is displayed.
+ */
+
+static PID_DATA frame_data[MAX_FREEZE_FRAME_PIDS];  // data of the PIDs in the freeze frame, in the order they were read
+static int num_of_pids = 0;
+static unsigned long frame_dtc = 0;  // DTC that caused the freeze frame, 0 if there is no freeze frame
+static long frame_ecu = -1;          // CAN ID of the ECU that stored the freeze frame, -1 if unknown
+static int frame_status = FRAME_NOT_READ;
+static int queue[MAX_FREEZE_FRAME_PIDS + 4];  // PIDs waiting to be requested, including the DTC and "PIDs supported"
+static int queue_head = 0;
+static int queue_tail = 0;
+static int dtc_requested = FALSE;    // TRUE if the last request asked for the DTC
+
+static void enqueue_pid(int pid);
+static void add_supported_pids(int range_pid, unsigned long map);
+static void store_pid(int pid, unsigned long data);
+static void format_dtc(unsigned long dtc, char *buf);
+
+static DIALOG freeze_frame_dialog[] =
+{
+   /* (proc)             (x)  (y)  (w)  (h)  (fg)     (bg)          (key) (flags) (d1) (d2) (dp)                 (dp2) (dp3) */
+   { d_clear_proc,       0,   0,   0,   0,   0,       C_WHITE,      0,    0,      0,   0,   NULL,                NULL, NULL },
+   { d_box_proc,         25,  25,  590, 24,  C_BLACK, C_DARK_GRAY,  0,    0,      0,   0,   NULL,                NULL, NULL },
+   { caption_proc,       320, 28,  290, 19,  C_WHITE, C_TRANSP,     0,    0,      0,   0,   "Freeze Frame Data", NULL, NULL },
+   { d_textbox_proc,     25,  49,  590, 344, C_BLACK, C_LIGHT_GRAY, 0,    0,      0,   0,   NULL,                NULL, NULL },
+   { d_button_proc,      505, 408, 110, 48,  C_BLACK, C_GREEN,      'm',  D_EXIT, 0,   0,   "Main &Menu",        NULL, NULL },
+   { NULL,               0,   0,   0,   0,   0,       0,            0,    0,      0,   0,   NULL,                NULL, NULL }
+};
+
+
+// forgets the freeze frame, the next request starts reading it again
+void freeze_frame_clear()
+{
+   num_of_pids = 0;
+   frame_dtc = 0;
+   frame_ecu = -1;
+   frame_status = FRAME_NOT_READ;
+   dtc_requested = FALSE;
+
+   queue_head = queue_tail = 0;
+   enqueue_pid(FREEZE_FRAME_DTC);
+   enqueue_pid(0x00);
+}
+
+
+/* freeze_frame_next_request:
+ *  Builds the next mode 02 request into cmd (at least 15 characters), with as
+ *  many of the queued PIDs as the protocol allows.  Returns FALSE if the whole
+ *  freeze frame has been read.
+ */
+int freeze_frame_next_request(char *cmd)
+{
+   int max_pids = (is_can_protocol()) ? MAX_PIDS_PER_REQUEST : 1;
+   int n;
+
+   if (queue_head == queue_tail)
+   {
+      if (frame_status == FRAME_NOT_READ)
+         frame_status = FRAME_READ;
+      return FALSE;
+   }
+
+   strcpy(cmd, "02");
+   dtc_requested = FALSE;
+   for (n = 0; n < max_pids && queue_head < queue_tail; n++)
+   {
+      if (queue[queue_head] == FREEZE_FRAME_DTC)
+         dtc_requested = TRUE;
+      sprintf(cmd + strlen(cmd), "%02X00", queue[queue_head++]);  // frame 0
+   }
+
+   return TRUE;
+}
+
+
+/* freeze_frame_done:
+ *  Ends the read early: failed is TRUE if a request timed out, FALSE if
+ *  there was nothing to read (i.e., the vehicle reported no codes).
+ */
+void freeze_frame_done(int failed)
+{
+   queue_head = queue_tail;
+   frame_status = (failed) ? FRAME_FAILED : FRAME_READ;
+}
+
+
+/* freeze_frame_handle_response:
+ *  Stores the data from the response to the last request (as built by
+ *  freeze_frame_next_request()).  If several ECUs
+ *  answered, only the one that reported a DTC is listened to.  If the vehicle
+ *  has no freeze frame, or does not support mode 02, the rest of the queue is
+ *  dropped.
+ */
+void freeze_frame_handle_response(const char *request, char *response, int response_type)
+{
+   static RESPONSE_INDEX index;
+   MESSAGE_READER reader;
+   PID_DATA pid_data[MAX_PIDS_PER_MESSAGE];
+   const char *message;
+   char buf[256];
+   long ecu;
+   int n, i;
+
+   if (response_type == HEX_DATA)
+   {
+      index_response(response, &index);
+
+      // find out which ECU the freeze frame belongs to, before taking anyone's data
+      start_message_reader(&reader);
+      while (dtc_requested && (message = next_message(&reader, buf, sizeof(buf), response, &index, &ecu)))
+      {
+         n = split_freeze_frame_data(message, request, pid_data, MAX_PIDS_PER_MESSAGE);
+         for (i = 0; i < n; i++)
+         {
+            if (pid_data[i].pid == FREEZE_FRAME_DTC && pid_data[i].data != 0 && frame_dtc == 0)
+            {
+               frame_dtc = pid_data[i].data;
+               frame_ecu = ecu;
+            }
+         }
+      }
+
+      start_message_reader(&reader);
+      while ((message = next_message(&reader, buf, sizeof(buf), response, &index, &ecu)))
+      {
+         if (ecu >= 0 && frame_ecu >= 0 && ecu != frame_ecu)  // another ECU's freeze frame
+            continue;
+
+         n = split_freeze_frame_data(message, request, pid_data, MAX_PIDS_PER_MESSAGE);
+         for (i = 0; i < n; i++)
+         {
+            if (pid_data[i].pid == FREEZE_FRAME_DTC)
+               continue;
+            else if (pid_data[i].pid % 0x20 == 0)
+               add_supported_pids(pid_data[i].pid, pid_data[i].data);
+            else
+               store_pid(pid_data[i].pid, pid_data[i].data);
+         }
+      }
+   }
+
+   if (response_type != HEX_DATA && response_type != ERR_NO_DATA)  // NO DATA is a PID the ECU doesn't have
+      frame_status = FRAME_FAILED;
+   if (dtc_requested && frame_dtc == 0)  // nothing to read
+      queue_head = queue_tail;
+   dtc_requested = FALSE;
+}
+
+
+void enqueue_pid(int pid)
+{
+   int i;
+
+   for (i = 0; i < queue_tail; i++)  // several ECUs may support the same PID
+      if (queue[i] == pid)
+         return;
+
+   if (queue_tail < sizeof(queue)/sizeof(queue[0]))
+      queue[queue_tail++] = pid;
+}
+
+
+// queues the PIDs in the bitmap that are in the PID table, the next bitmap first so it's requested early
+void add_supported_pids(int range_pid, unsigned long map)
+{
+   int i;
+
+   if ((map & 1) && range_pid + 0x20 < MAX_FREEZE_FRAME_PIDS)
+      enqueue_pid(range_pid + 0x20);
+
+   for (i = 0; i < 0x1F; i++)
+   {
+      if (((map >> (0x1F - i)) & 1) && find_pid_descriptor(range_pid + i + 1))
+         enqueue_pid(range_pid + i + 1);
+   }
+}
+
+
+void store_pid(int pid, unsigned long data)
+{
+   int i;
+
+   for (i = 0; i < num_of_pids; i++)  // first answer wins, like on the Sensor Data page
+      if (frame_data[i].pid == pid)
+         return;
+
+   if (num_of_pids < MAX_FREEZE_FRAME_PIDS && find_pid_descriptor(pid))
+   {
+      frame_data[num_of_pids].pid = pid;
+      frame_data[num_of_pids].data = data;
+      num_of_pids++;
+   }
+}
+
+
+void format_dtc(unsigned long dtc, char *buf)
+{
+   sprintf(buf, "%c%04lX", "PCBU"[(dtc >> 14) & 0x03], dtc & 0x3FFF);
+}
+
+
+/* display_freeze_frame:
+ *  Shows the freeze frame read along with the trouble codes, decoded the same
+ *  way as the Sensor Data page, in the order of the PID table.
+ */
+int display_freeze_frame()
+{
+   const PID_DESCRIPTOR *desc;
+   char dtc[8];
+   char value[64];
+   char *text;
+   int ret;
+   int i, j;
+
+   if (!(text = (char *)malloc((get_num_of_pid_descriptors() + 4) * 128)))
+      fatal_error("Could not allocate enough memory for freeze frame text");
+
+   if (frame_status == FRAME_NOT_READ)
+      strcpy(text, "Freeze frame data is read from the vehicle along with the trouble codes.  Please read the codes first.");
+   else if (frame_dtc == 0 && frame_status == FRAME_FAILED)
+      strcpy(text, "The freeze frame could not be read from the vehicle.  Please read the codes again.");
+   else if (frame_dtc == 0)
+      strcpy(text, "The vehicle did not store a freeze frame.");
+   else
+   {
+      format_dtc(frame_dtc, dtc);
+      if (frame_ecu >= 0)
+         sprintf(text, "Freeze frame stored by ECU %lX for DTC %s\n\n", frame_ecu, dtc);
+      else
+         sprintf(text, "Freeze frame stored for DTC %s\n\n", dtc);
+      if (frame_status == FRAME_FAILED)
+         strcat(text, "Not all of the freeze frame could be read, please read the codes again for the rest.\n\n");
+
+      for (i = 0; (desc = &pid_descriptors[i])->label; i++)
+      {
+         for (j = 0; j < num_of_pids; j++)
+         {
+            if (frame_data[j].pid == strtol(desc->pid, NULL, 16))
+            {
+               format_pid_value(desc, frame_data[j].data, value);
+               sprintf(text + strlen(text), "%s %s\n", desc->label, value);
+               break;
+            }
+         }
+      }
+   }
+
+   freeze_frame_dialog[FREEZE_FRAME_TEXT].dp = text;
+   freeze_frame_dialog[FREEZE_FRAME_TEXT].d2 = 0;  // scrolled to the top
+   ret = do_dialog(freeze_frame_dialog, -1);
+   freeze_frame_dialog[FREEZE_FRAME_TEXT].dp = NULL;
+   free(text);
+
+   return ret;
+}
@@ -0,0 +1,10 @@
+#ifndef FREEZE_FRAME_H
+#define FREEZE_FRAME_H
+
+void freeze_frame_clear();
+int freeze_frame_next_request(char *cmd);
+void freeze_frame_done(int failed);
+void freeze_frame_handle_response(const char *request, char *response, int response_type);
+int display_freeze_frame();
+
+#endif
@@ -0,0 +1,269 @@
+#include <string.h>
+#include <time.h>
+#include "globals.h"
+#include "serial.h"
+#include "clock.h"
+#include "acquisition.h"
+#include "session.h"
+#include "pids.h"
+#include "publisher.h"
+#include "vehicle_info.h"
+#include "headless.h"
+
+#define MAX_HEADLESS_PIDS       32
+#define MAX_PIDS_PER_REQUEST    6  // ELM327 accepts up to 6 PIDs in a single mode 01 request on CAN
+#define DEFAULT_HEADLESS_PIDS   "0C 0D 05 11"
+
+/* Headless mode polls a set of PIDs and writes the samples to a file (or to
+ * stdout), without the GUI: there's no graphics mode, datafile, keyboard or
+ * mouse, and the session is ticked from a polling loop instead of from
+ * MSG_IDLE.  The PIDs, output file and polling interval come from the command
+ * line, or from the [headless] section of scantool.cfg.  Each sample is one
+ * line: milliseconds since the start, PID, CAN ID of the ECU (if headers are
+ * on), value in metric units, and the value as it would be shown on the
+ * Sensor Data page.
+ */
+
+static const PID_DESCRIPTOR *pids[MAX_HEADLESS_PIDS];
+static int num_of_pids = 0;
+static FILE *output = NULL;
+static unsigned long start_time;
+
+// state of the current polling cycle
+static int answered = FALSE;
+static int program_timing = FALSE;
+
+static int parse_pid_list(const char *list);
+static int connect_vehicle();
+static int pack_pids(int first, char *cmd);
+static int poll_pids();
+static void pid_response(ACQ_TRANSACTION *t, void *context);
+
+
+/* run_headless:
+ *  pid_list is a list of hex PIDs separated by spaces or commas, output_file_name
+ *  is NULL (or empty) for stdout.  Polls the PIDs every interval milliseconds (as
+ *  fast as possible if 0), count times (forever if 0).  Returns EXIT_SUCCESS
+ *  or EXIT_FAILURE.
+ */
+int run_headless(const char *pid_list, const char *output_file_name, int interval, long count)
+{
+   char temp_buf[256];
+   unsigned long next_poll;
+   time_t current_time;
+   long cycle;
+
+   if (!pid_list)
+      pid_list = get_config_string("headless", "pids", DEFAULT_HEADLESS_PIDS);
+   if (!output_file_name)
+      output_file_name = get_config_string("headless", "output_file", "");
+   if (interval < 0)
+      interval = get_config_int("headless", "interval", 0);
+
+   if (!parse_pid_list(pid_list))
+   {
+      sprintf(temp_buf, "\nNo known PIDs in \"%s\"", pid_list);
+      write_log(temp_buf);
+      return EXIT_FAILURE;
+   }
+
+   if (output_file_name[0])
+   {
+      if ((output = fopen(output_file_name, "a")) == NULL)
+      {
+         sprintf(temp_buf, "\nCould not open %s for writing", output_file_name);
+         write_log(temp_buf);
+         return EXIT_FAILURE;
+      }
+   }
+   else
+      output = stdout;
+
+   write_log("\nConnecting to the vehicle... ");
+   session_start();
+   if (comport.status != READY || !connect_vehicle())
+   {
+      write_log("Error!");
+      session_stop();
+      if (output != stdout)
+         fclose(output);
+      return EXIT_FAILURE;
+   }
+   write_log("OK");
+
+   time(&current_time);
+   fprintf(output, "# %s", ctime(&current_time));
+   fprintf(output, "# Protocol: %s\n", get_protocol_string(obd_device.interface_type, obd_device.protocol));
+   fprintf(output, "# time (ms), PID, ECU, value, text\n");
+
+   write_log("\nPolling PIDs...");
+   start_time = next_poll = clock_ms();
+   for (cycle = 0; count == 0 || cycle < count; cycle++)
+   {
+      while (!DEADLINE_PASSED(next_poll))
+         rest(1);
+      next_poll = clock_ms() + interval;
+
+      if (!poll_pids())
+         write_log("\nVehicle did not respond");
+      fflush(output);
+      publisher_flush();
+   }
+   session_stop();
+
+   if (output != stdout)
+      fclose(output);
+   output = NULL;
+
+   return EXIT_SUCCESS;
+}
+
+
+// returns number of PIDs found in list
+int parse_pid_list(const char *list)
+{
+   const PID_DESCRIPTOR *desc;
+   char *end;
+   long pid;
+
+   num_of_pids = 0;
+   while (*list && num_of_pids < MAX_HEADLESS_PIDS)
+   {
+      pid = strtol(list, &end, 16);
+      if (end == list)  // separator
+      {
+         list++;
+         continue;
+      }
+      list = end;
+
+      if ((desc = find_pid_descriptor(pid)))
+         pids[num_of_pids++] = desc;
+   }
+
+   return num_of_pids;
+}
+
+
+/* connect_vehicle:
+ *  Resets the interface and finds the vehicle with session_connect(), the
+ *  same way the main menu does, and ticks the session until it's done.
+ *  Returns FALSE if the vehicle could not be found.
+ */
+int connect_vehicle()
+{
+   session_connect(FALSE);
+   while (session_state() == SESSION_CONNECTING)
+   {
+      session_tick();
+      rest(1);
+   }
+
+   return (session_state() == SESSION_READY);
+}
+
+
+// packs the supported PIDs from first on into cmd (empty if there are none), returns the next PID to pack
+int pack_pids(int first, char *cmd)
+{
+   const int max_pids = (is_can_protocol()) ? MAX_PIDS_PER_REQUEST : 1;
+   int next, in_request;
+
+   strcpy(cmd, "01");
+   for (next = first, in_request = 0; next < num_of_pids && in_request < max_pids; next++)
+   {
+      if (is_pid_supported((int)strtol(pids[next]->pid, NULL, 16)))
+      {
+         strcat(cmd, pids[next]->pid);
+         in_request++;
+      }
+   }
+   if (in_request == 0)
+      cmd[0] = 0;
+
+   return next;
+}
+
+
+/* poll_pids:
+ *  Requests all supported PIDs once, as many in each request as the protocol
+ *  allows, and ticks the session until all of them are answered.  Returns
+ *  FALSE if the vehicle responded to none of the requests.
+ */
+int poll_pids()
+{
+   char cmd[8 + MAX_PIDS_PER_REQUEST*2];
+   int first = 0;
+
+   answered = FALSE;
+   program_timing = FALSE;
+   cmd[0] = 0;
+
+   while (cmd[0] || first < num_of_pids || session_pending() > 0)
+   {
+      if (!cmd[0] && first < num_of_pids)
+      {
+         first = pack_pids(first, cmd);
+         if (cmd[0])
+            add_response_count(cmd);
+      }
+
+      if (cmd[0] && session_request(cmd, 0, 0, pid_response, NULL))
+         cmd[0] = 0;
+      else  // queue is full, or nothing left to ask for
+      {
+         session_tick();
+         rest(1);
+      }
+   }
+
+   if (program_timing)  // we know how fast the ECUs are, tune the interface timeout for them
+   {
+      session_pause();
+      if (program_adapter_timing())
+         save_vehicle_profile();  // remember the response time, if we know the VIN
+      session_resume();
+   }
+
+   return answered;
+}
+
+
+// writes the samples in the response to the output
+void pid_response(ACQ_TRANSACTION *t, void *context)
+{
+   MESSAGE_READER reader;
+   PID_DATA pid_data[MAX_PIDS_PER_MESSAGE];
+   const PID_DESCRIPTOR *desc;
+   const char *message;
+   char buf[256];
+   char text[64];
+   char ecu_id[20];
+   int n, i;
+   long ecu;
+   float value;
+
+   if (t->response_type != HEX_DATA)
+      return;
+   answered = TRUE;
+   if (learn_response_time(t->latency))
+      program_timing = TRUE;
+
+   start_message_reader(&reader);
+   while ((message = next_message(&reader, buf, sizeof(buf), t->response.data, &t->lines, &ecu)))
+   {
+      n = split_pid_data(message, t->cmd, pid_data, MAX_PIDS_PER_MESSAGE);
+      if (ecu >= 0)
+         sprintf(ecu_id, "%lX", ecu);
+      else
+         ecu_id[0] = 0;
+      for (i = 0; i < n; i++)
+      {
+         desc = find_pid_descriptor(pid_data[i].pid);
+         value = decode_pid_value(desc, pid_data[i].data);
+         format_pid_value(desc, pid_data[i].data, text);
+         fprintf(output, "%lu,%s,%s,%g,\"%s\"\n", clock_ms() - start_time, desc->pid, ecu_id, value, text);
+         publish_sample(pid_data[i].pid, desc->bytes, ecu, clock_ms(), pid_data[i].data, value);
+      }
+   }
+}
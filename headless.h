@@ -0,0 +1,6 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+int run_headless(const char *pid_list, const char *output_file_name, int interval, long count);
+
+#endif
@@ -0,0 +1,271 @@
+#include <string.h>
+#include <time.h>
+#include "globals.h"
+#include "error_handlers.h"
+#include "clock.h"
+#include "byte_order.h"
+#include "logger.h"
+
+#define LOGGER_MAX_ROWS         256   // rows are written to the file when the buffer fills up,
+#define LOGGER_FLUSH_INTERVAL   5000  // or this many milliseconds after the last write
+#define LOGGER_MAX_ROW_TEXT     (12 + LOGGER_MAX_COLUMNS*14)  // longest CSV row
+#define LOGGER_MAX_FILES        999   // rotated files are numbered .001 to .999
+#define LOGGER_NAN              0x7FC00000UL  // bits of a quiet NaN float
+
+/* The session logger keeps a row of sensor values for each poll cycle in a
+ * buffer that is allocated once, when logging starts.  Adding a row is a copy
+ * into the buffer; the rows are formatted and written to the file in one go
+ * when the buffer is full, or every few seconds, so the disk is touched
+ * rarely and in large pieces.  CSV logs have a header line each time the set
+ * of columns changes.  Binary logs store each block of rows column by column.
+ * When the file grows past max_size, it is renamed to the next free numbered
+ * extension (scantool.001, ...) and a new file is started.  An existing file
+ * is appended to, each run starts with the header (or the column names).
+ */
+
+typedef struct
+{
+   unsigned long time;
+   unsigned long present;  // bit N is set if column N has a value
+   float values[LOGGER_MAX_COLUMNS];
+} LOG_ROW;
+
+static FILE *log_file = NULL;
+static char log_name[256];
+static int log_format = LOG_CSV;
+static long log_max_size = 0;  // 0 = no rotation
+static LOG_ROW *rows = NULL;
+static int num_of_rows = 0;
+static int columns[LOGGER_MAX_COLUMNS];
+static int num_of_columns = 0;
+static int columns_written = FALSE;  // TRUE if the file has the header for the current columns
+static unsigned char *output = NULL; // rows are formatted here before they are written
+static unsigned long next_flush;
+
+static int open_log_file();
+static void write_columns();
+static void flush_rows();
+static void rotate_log_file();
+
+
+/* logger_start:
+ *  Opens the log file and starts logging, after whatever a previous run left
+ *  in it.  format is LOG_CSV or LOG_BINARY.  max_size is in bytes, 0 if the
+ *  file should never be rotated.  Returns FALSE if the file could not be
+ *  opened.
+ */
+int logger_start(const char *file_name, int format, long max_size)
+{
+   logger_stop();
+
+   strncpy(log_name, file_name, sizeof(log_name) - 1);
+   log_name[sizeof(log_name) - 1] = 0;
+   log_format = format;
+   log_max_size = max_size;
+
+   if (!open_log_file())
+      return FALSE;
+
+   if (!(rows = (LOG_ROW *)malloc(LOGGER_MAX_ROWS*sizeof(LOG_ROW))) ||
+       !(output = (unsigned char *)malloc(LOGGER_MAX_ROWS*MAX(LOGGER_MAX_ROW_TEXT, (1 + LOGGER_MAX_COLUMNS)*4) + 3)))
+      fatal_error("Could not allocate enough memory for session logger");
+
+   num_of_rows = 0;
+   num_of_columns = 0;
+   columns_written = FALSE;
+   next_flush = clock_ms() + LOGGER_FLUSH_INTERVAL;
+
+   return TRUE;
+}
+
+
+void logger_stop()
+{
+   if (log_file == NULL)
+      return;
+
+   flush_rows();
+   fclose(log_file);
+   free(rows);
+   free(output);
+   log_file = NULL;
+   rows = NULL;
+   output = NULL;
+}
+
+
+int logger_is_running()
+{
+   return (log_file != NULL);
+}
+
+
+/* logger_write_row:
+ *  Adds a row with the values of the sensors whose PIDs are in pids.  Bit N of
+ *  present is set if values[N] is a new value.  Does nothing if the logger is
+ *  not running.
+ */
+void logger_write_row(unsigned long time, const int *pids, const float *values, unsigned long present, int num_of_pids)
+{
+   LOG_ROW *row;
+   int i;
+
+   if (log_file == NULL)
+      return;
+
+   num_of_pids = MIN(num_of_pids, LOGGER_MAX_COLUMNS);
+   if (num_of_pids != num_of_columns || memcmp(pids, columns, num_of_pids*sizeof(int)) != 0)  // page was flipped, or sensors toggled
+   {
+      flush_rows();
+      memcpy(columns, pids, num_of_pids*sizeof(int));
+      num_of_columns = num_of_pids;
+      columns_written = FALSE;
+   }
+
+   if (num_of_columns == 0)
+      return;
+
+   row = &rows[num_of_rows++];
+   row->time = time;
+   row->present = present;
+   for (i = 0; i < num_of_columns; i++)
+      row->values[i] = values[i];
+
+   if (num_of_rows == LOGGER_MAX_ROWS || DEADLINE_PASSED(next_flush))
+      flush_rows();
+}
+
+
+// appends to the file, so the log of the previous run is not lost
+int open_log_file()
+{
+   unsigned char header[LOGGER_HEADER_SIZE];
+
+   if ((log_file = fopen(log_name, (log_format == LOG_BINARY) ? "ab" : "a")) == NULL)
+      return FALSE;
+
+   if (log_format == LOG_BINARY)
+   {
+      memcpy(header, LOGGER_MAGIC, 7);
+      header[7] = LOGGER_VERSION;
+      put_le_value(header + 8, (unsigned long)time(NULL), 4);
+      fwrite(header, 1, LOGGER_HEADER_SIZE, log_file);
+   }
+
+   return TRUE;
+}
+
+
+void write_columns()
+{
+   unsigned char block[2 + LOGGER_MAX_COLUMNS];
+   int i;
+
+   if (log_format == LOG_BINARY)
+   {
+      block[0] = 'C';
+      block[1] = num_of_columns;
+      for (i = 0; i < num_of_columns; i++)
+         block[2 + i] = columns[i];
+      fwrite(block, 1, 2 + num_of_columns, log_file);
+   }
+   else
+   {
+      fprintf(log_file, "time (ms)");
+      for (i = 0; i < num_of_columns; i++)
+         fprintf(log_file, ",%02X", columns[i]);
+      fprintf(log_file, "\n");
+   }
+
+   columns_written = TRUE;
+}
+
+
+// formats the rows in the buffer and writes them to the file with one fwrite()
+void flush_rows()
+{
+   unsigned long bits;
+   int len = 0;
+   int row, i;
+
+   next_flush = clock_ms() + LOGGER_FLUSH_INTERVAL;
+   if (num_of_rows == 0)
+      return;
+
+   if (!columns_written)
+      write_columns();
+
+   if (log_format == LOG_BINARY)
+   {
+      output[len++] = 'D';
+      put_le_value(output + len, num_of_rows, 2);
+      len += 2;
+      for (row = 0; row < num_of_rows; row++, len += 4)
+         put_le_value(output + len, rows[row].time, 4);
+      for (i = 0; i < num_of_columns; i++)
+      {
+         for (row = 0; row < num_of_rows; row++, len += 4)
+         {
+            if (rows[row].present & (1UL << i))
+               memcpy(&bits, &rows[row].values[i], 4);
+            else
+               bits = LOGGER_NAN;
+            put_le_value(output + len, bits, 4);
+         }
+      }
+   }
+   else
+   {
+      for (row = 0; row < num_of_rows; row++)
+      {
+         len += sprintf((char *)output + len, "%lu", rows[row].time);
+         for (i = 0; i < num_of_columns; i++)
+         {
+            if (rows[row].present & (1UL << i))
+               len += sprintf((char *)output + len, ",%.6g", rows[row].values[i]);
+            else
+               output[len++] = ',';
+         }
+         output[len++] = '\n';
+      }
+   }
+
+   fwrite(output, 1, len, log_file);
+   num_of_rows = 0;
+
+   if (log_max_size > 0 && ftell(log_file) >= log_max_size)
+      rotate_log_file();
+}
+
+
+// renames the full file to the next free numbered extension, and starts a new one
+void rotate_log_file()
+{
+   char rotated_name[256];
+   char extension[8];
+   int i;
+
+   fclose(log_file);
+   log_file = NULL;
+
+   for (i = 1; i <= LOGGER_MAX_FILES; i++)
+   {
+      sprintf(extension, "%03i", i);
+      replace_extension(rotated_name, log_name, extension, sizeof(rotated_name));
+      if (!exists(rotated_name))
+         break;
+   }
+   if (i > LOGGER_MAX_FILES)  // all taken, the last one is overwritten
+      remove(rotated_name);
+   rename(log_name, rotated_name);
+
+   if (!open_log_file())
+   {
+      free(rows);
+      free(output);
+      rows = NULL;
+      output = NULL;
+      return;
+   }
+   columns_written = FALSE;  // each file starts with the columns
+}
@@ -0,0 +1,27 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/* Binary log layout (all numbers are little-endian):
+ *   header: "SCANLOG" + version byte, start time (32-bit time_t)
+ *   column block: 'C', number of columns (8 bits), PID of each column (8 bits each)
+ *   data block: 'D', number of rows (16 bits), clock_ms() time of each row
+ *               (32 bits each), then the values of each column in turn
+ *               (32-bit IEEE floats, NaN if the sensor had no new value)
+ * A data block belongs to the column block before it.  Each run appends a new
+ * header, followed by its own blocks.
+ */
+#define LOGGER_MAGIC          "SCANLOG"
+#define LOGGER_VERSION        1
+#define LOGGER_HEADER_SIZE    12
+#define LOGGER_MAX_COLUMNS    32
+
+// log formats
+#define LOG_CSV      0
+#define LOG_BINARY   1
+
+int logger_start(const char *file_name, int format, long max_size);
+void logger_stop();
+int logger_is_running();
+void logger_write_row(unsigned long time, const int *pids, const float *values, unsigned long present, int num_of_columns);
+
+#endif
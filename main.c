@@ -24,6 +24,13 @@
 #include "error_handlers.h"
 #include "options.h"
 #include "serial.h"
+#include "code_defs.h"
+#include "clock.h"
+#include "recorder.h"
+#include "replay.h"
+#include "headless.h"
+#include "publisher.h"
+#include "logger.h"
 #include "version.h"
 
 #if (defined ALLEGRO_DOS) || (defined ALLEGRO_STATICLINK)
@@ -34,6 +41,7 @@ END_COLOR_DEPTH_LIST
 #endif
 
 #define WINDOW_TITLE   "ScanTool.net " SCANTOOL_VERSION_EX_STR
+#define USAGE          "Usage: scantool [-headless] [-p pids] [-o file] [-i interval] [-n count]\n"
 
 
 void write_log(const char *log_string)
@@ -62,35 +70,16 @@ void write_comm_log(const char *marker, const char *data)
 #endif
 
 
-static void init()
+/* init_gui:
+ *  Brings up the graphics mode, keyboard, mouse, and resources from the
+ *  datafile.  None of this is needed in headless mode.
+ */
+static void init_gui()
 {
    char temp_buf[256];
 
-   /* initialize some varaibles with default values */
-   strcpy(options_file_name, "scantool.cfg");
-   strcpy(data_file_name, "scantool.dat");
-   strcpy(code_defs_file_name, "codes.dat");
-   
-   datafile = NULL;
-   comport.status = NOT_OPEN;
-   display_mode = 0;
-
-   set_uformat(U_ASCII);
-   
-   /* initialize hardware */
-   write_log("\nInitializing Allegro... ");
-   allegro_init();
-   write_log("OK");
-   
    set_window_title(WINDOW_TITLE);
-   
-   write_log("\nInstalling Timers... ");
-   if (install_timer() != 0)
-   {
-      write_log("Error!");
-      fatal_error("Error installing timers");
-   }
-   write_log("OK");
+
    write_log("\nInstalling Keyboard... ");
    install_keyboard();
    write_log("OK");
@@ -98,21 +87,6 @@ static void init()
    install_mouse();
    write_log("OK");
 
-   /* load options from file, the defaults will be automatically substituted if file does not exist */
-   write_log("\nLoading Preferences... ");
-   set_config_file(options_file_name);
-   load_program_options();
-   /* if config file doesn't exist or is of an incorrect version */
-   if (strcmp(get_config_string(NULL, "version", ""), SCANTOOL_VERSION_STR) != 0)
-   {
-      /* update config file */
-      remove(options_file_name);
-      set_config_file(options_file_name);
-      set_config_string(NULL, "version", SCANTOOL_VERSION_STR);
-      save_program_options();
-   }
-   write_log("OK");
-
    display_mode |= FULLSCREEN_MODE_SUPPORTED;
    
    write_log("\nTrying Windowed Graphics Mode... ");
@@ -169,10 +143,108 @@ static void init()
    gui_mg_color = C_GRAY;   // set the disabled color
    set_mouse_sprite(NULL); // make mouse use current palette
 
+   write_log("\nLoading Code Definitions... ");
+   if (load_code_defs() > 0)
+      write_log("OK");
+   else
+   {
+      sprintf(temp_buf, "Error loading %s!", code_defs_file_name);
+      write_log(temp_buf);
+   }
+}
+
+
+static void init(int headless)
+{
+   char temp_buf[256];
+
+   /* initialize some varaibles with default values */
+   strcpy(options_file_name, "scantool.cfg");
+   strcpy(data_file_name, "scantool.dat");
+   strcpy(code_defs_file_name, "codes.dat");
+   
+   datafile = NULL;
+   comport.status = NOT_OPEN;
+   display_mode = 0;
+
+   set_uformat(U_ASCII);
+   
+   /* initialize hardware */
+   write_log("\nInitializing Allegro... ");
+   allegro_init();
+   write_log("OK");
+   
+   write_log("\nInstalling Timers... ");
+   if (install_timer() != 0)
+   {
+      write_log("Error!");
+      fatal_error("Error installing timers");
+   }
+   clock_init();
+   write_log("OK");
+
+   /* load options from file, the defaults will be automatically substituted if file does not exist */
+   write_log("\nLoading Preferences... ");
+   set_config_file(options_file_name);
+   load_program_options();
+   /* if config file doesn't exist or is of an incorrect version */
+   if (strcmp(get_config_string(NULL, "version", ""), SCANTOOL_VERSION_STR) != 0)
+   {
+      /* update config file */
+      remove(options_file_name);
+      set_config_file(options_file_name);
+      set_config_string(NULL, "version", SCANTOOL_VERSION_STR);
+      save_program_options();
+   }
+   write_log("OK");
+
+   if (!headless)
+      init_gui();
+
    write_log("\nInitializing Serial Module... ");
    serial_module_init();
    write_log("OK");
 
+   /* record traffic to and from the interface, if a session file is set in the config file */
+   if (get_config_string("general", "record_session", "")[0])
+   {
+      write_log("\nStarting Session Recorder... ");
+      if (recorder_start(get_config_string("general", "record_session", "")))
+         write_log("OK");
+      else
+         write_log("Error!");
+   }
+
+   /* log sensor values, if a log file is set in the config file */
+   if (get_config_string("logger", "file", "")[0])
+   {
+      write_log("\nStarting Session Logger... ");
+      if (logger_start(get_config_string("logger", "file", ""), (strcmp(get_config_string("logger", "format", "csv"), "binary") == 0) ? LOG_BINARY : LOG_CSV, get_config_int("logger", "max_size", 0)*1024L))
+         write_log("OK");
+      else
+         write_log("Error!");
+   }
+
+   /* send samples to other programs on the network, if a publisher mode is set in the config file */
+   if (get_config_string("publisher", "mode", "")[0])
+   {
+      write_log("\nStarting Sample Publisher... ");
+      if (publisher_start(get_config_string("publisher", "mode", ""), get_config_string("publisher", "address", ""), get_config_int("publisher", "port", DEFAULT_PUBLISHER_PORT)))
+         write_log("OK");
+      else
+         write_log("Error!");
+   }
+
+   /* serve responses from a recorded session instead of the interface, if one is set in the config file */
+   if (get_config_string("comm", "replay_session", "")[0])
+   {
+      write_log("\nLoading Replay Session... ");
+      if (replay_open(get_config_string("comm", "replay_session", ""), get_config_int("comm", "replay_timing", REPLAY_RECORDED)))
+         write_log("OK");
+      else
+         write_log("Error!");
+   }
+
    sprintf(temp_buf, "\nOpening COM%i... ", comport.number + 1);
    write_log(temp_buf);
    /* try opening comport (comport.status will be set) */
@@ -194,26 +266,79 @@ static void init()
 }
 
 
-static void shut_down()
+static void shut_down(int headless)
 {
    //clean up
    flush_config_file();
+   if (recorder_is_running())
+   {
+      write_log("\nStopping Session Recorder... ");
+      recorder_stop();
+      write_log("OK");
+   }
+   if (logger_is_running())
+   {
+      write_log("\nStopping Session Logger... ");
+      logger_stop();
+      write_log("OK");
+   }
+   if (publisher_is_running())
+   {
+      write_log("\nStopping Sample Publisher... ");
+      publisher_stop();
+      write_log("OK");
+   }
    write_log("\nShutting Down Serial Module... ");
    serial_module_shutdown();
+   replay_close();
    write_log("OK");
-   write_log("\nUnloading Data File... ");
-   unload_datafile(datafile);
-   write_log("OK");
+   if (!headless)
+   {
+      write_log("\nUnloading Code Definitions... ");
+      unload_code_defs();
+      write_log("OK");
+      write_log("\nUnloading Data File... ");
+      unload_datafile(datafile);
+      write_log("OK");
+   }
+   clock_shutdown();
    write_log("\nShutting Down Allegro... ");
    allegro_exit();
    write_log("OK");
 }
 
 
-int main()
+int main(int argc, char **argv)
 {
    char temp_buf[64];
    time_t current_time;
+   int headless;
+   const char *pid_list = NULL;  // NULL means the default from scantool.cfg
+   const char *output_file_name = NULL;
+   int interval = -1;
+   long count = 0;
+   int ret = EXIT_SUCCESS;
+   int i;
+
+   for (i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "-headless") == 0)
+         continue;
+      else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+         pid_list = argv[++i];
+      else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+         output_file_name = argv[++i];
+      else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+         interval = MAX(0, atoi(argv[++i]));
+      else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+         count = MAX(0, atol(argv[++i]));
+      else
+      {
+         printf(USAGE);
+         return EXIT_FAILURE;
+      }
+   }
+   headless = (argc > 1);  // all of the options are for headless mode
    
    time(&current_time);  // get current time, and store it in current_time
    strcpy(temp_buf, ctime(&current_time));
@@ -232,15 +357,23 @@ int main()
    write_log(temp_buf);
 
    write_log("\n\nInitializing All Modules...\n---------------------------");
-   init(); // initialize everything
+   init(headless); // initialize everything
 
-   write_log("\n\nDisplaying Main Menu...\n-----------------------");
-   display_main_menu(); // dislpay main menu
-   write_log("\nMain Menu Closed");
+   if (headless)
+   {
+      write_log("\n\nRunning Headless...\n-------------------");
+      ret = run_headless(pid_list, output_file_name, interval, count);
+   }
+   else
+   {
+      write_log("\n\nDisplaying Main Menu...\n-----------------------");
+      display_main_menu(); // dislpay main menu
+      write_log("\nMain Menu Closed");
+   }
 
    write_log("\n\nShutting Down All Modules...\n----------------------------");
-   shut_down(); // shut down
+   shut_down(headless); // shut down
 
-   return EXIT_SUCCESS;
+   return ret;
 }
 END_OF_MAIN()
@@ -3,8 +3,12 @@
 #include "trouble_code_reader.h"
 #include "about.h"
 #include "sensors.h"
+#include "freeze_frame.h"
+#include "tests.h"
 #include "options.h"
 #include "serial.h"
+#include "acquisition.h"
+#include "session.h"
 #include "custom_gui.h"
 #include "main_menu.h"
 
@@ -112,113 +116,48 @@ void reset_chip()
 }
 
 
-// Reset states
-#define RESET_START        0
-#define RESET_WAIT_RX      1
-#define RESET_ECU_TIMEOUT  2
-#define RESET_WAIT_0100    3
-
+// connects through the session, the popup stays up until it's done
 int reset_proc(int msg, DIALOG *d, int c)
 {
-   static int state = RESET_START;
-   static int device = 0;
-   static char response[256];
-   char buf[128];
-   int status;
-   
+   int error;
+
    switch (msg)
    {
       case MSG_START:
-         strcpy(reset_status_msg, "Resetting hardware interface...");
-         state = RESET_START;
+         session_start();
+         session_connect(FALSE);
+         strcpy(reset_status_msg, session_status());
+         break;
+
+      case MSG_END:
+         session_stop();
          break;
-   
+
       case MSG_IDLE:
-         switch (state)
+         session_tick();
+
+         switch (session_state())
          {
-            case RESET_START:
-               if (serial_timer_running) // and if serial timer is running
+            case SESSION_CONNECTING:
+               if (strcmp(reset_status_msg, session_status()) != 0)
                {
-                  // wait until we either get a prompt or the timer times out
-                  while ((read_comport(buf) != PROMPT) && !serial_time_out)
-                     ;
+                  strcpy(reset_status_msg, session_status());
+                  return D_REDRAW;
                }
-               send_command("atz"); // reset the chip
-               start_serial_timer(ATZ_TIMEOUT);  // start serial timer
-               response[0] = 0;
-               state = RESET_WAIT_RX;
                break;
 
-            case RESET_WAIT_RX:
-               status = read_comport(buf);  // read comport
-
-               if(status == DATA) // if new data detected in com port buffer
-                  strcat(response, buf); // append contents of buf to response
-               else if(status == PROMPT) // if '>' detected
-               {
-                  stop_serial_timer();
-                  strcat(response, buf);
-                  device = process_response("atz", response);
-                  if (device == INTERFACE_ELM323 || device == INTERFACE_ELM327)
-                  {
-                     start_serial_timer(ECU_TIMEOUT);
-                     strcpy(reset_status_msg, "Waiting for ECU timeout...");
-                     state = RESET_ECU_TIMEOUT;
-                     return D_REDRAW;
-                  }
-                  else
-                     return D_CLOSE;
-               }
-               else if (serial_time_out) // if the timer timed out
-               {
+            case SESSION_FAILED:
+               error = session_error();
+               if (error == ACQ_TIMED_OUT)
                   alert("Interface was not found", NULL, NULL, "OK", NULL, 0, 0);
-                  stop_serial_timer(); // stop the timer
-                  return D_CLOSE; // close dialog
-               }
-               break;
-               
-            case RESET_ECU_TIMEOUT:
-               if (serial_time_out) // if the timer timed out
-               {
-                  stop_serial_timer(); // stop the timer
-                  if (device == INTERFACE_ELM327)
-                  {
-                     send_command("0100");
-                     start_serial_timer(OBD_REQUEST_TIMEOUT);  // start serial timer
-                     response[0] = 0;
-                     strcpy(reset_status_msg, "Detecting OBD protocol...");
-                     state = RESET_WAIT_0100;
-                     return D_REDRAW;
-                  }
-                  else
-                     return D_CLOSE; // close dialog
-               }
-               break;
-               
-            case RESET_WAIT_0100:
-               status = read_comport(buf);
+               else if (error == ERR_NO_DATA || error == UNABLE_TO_CONNECT)
+                  alert("Protocol could not be detected.", "Please check connection to the vehicle,", "and make sure the ignition is ON", "OK", NULL, 0, 0);
+               else
+                  alert("Communication error", NULL, NULL, "OK", NULL, 0, 0);
+               return D_CLOSE;
 
-               if(status == DATA) // if new data detected in com port buffer
-                  strcat(response, buf); // append contents of buf to response
-               else if (status == PROMPT)  // if we got the prompt
-               {
-                  stop_serial_timer();
-                  strcat(response, buf);
-                  status = process_response("0100", response);
-
-                  if (status == ERR_NO_DATA || status == UNABLE_TO_CONNECT)
-                     alert("Protocol could not be detected.", "Please check connection to the vehicle,", "and make sure the ignition is ON", "OK", NULL, 0, 0);
-                  else if (status != HEX_DATA)
-                     alert("Communication error", NULL, NULL, "OK", NULL, 0, 0);
-                     
-                  return D_CLOSE;
-               }
-               else if (serial_time_out) // if the timer timed out
-               {
-                  stop_serial_timer(); // stop the timer
-                  alert("Interface not found", NULL, NULL, "OK", NULL, 0, 0);
-                  return D_CLOSE;
-               }
+            default:
+               return D_CLOSE;
          }
          break;
    }
@@ -287,14 +226,13 @@ int freeze_frame_proc(int msg, DIALOG *d, int c)
    ret = nostretch_icon_proc(msg, d, c); // call the parent object
 
    if (msg == MSG_GOTMOUSE) // if we got mouse, display description
-      sprintf(button_description, "Display freeze frame data (not implemented in this version).");
+      sprintf(button_description, "Display freeze frame data, which is read from the vehicle along with the trouble codes.");
 
    if (ret == D_CLOSE)           // trap the close value
    {
-      alert("This feature is not implemented", " in this version", NULL, "OK", NULL, 0, 0);
-      //display_freeze_frame(); // display freeze frame data
-      //strcpy(button_description, welcome_message);
-      return D_REDRAWME;
+      display_freeze_frame(); // display freeze frame data
+      strcpy(button_description, welcome_message);
+      return D_REDRAW;
    }
    return ret;  // return
 }
@@ -305,14 +243,15 @@ int tests_proc(int msg, DIALOG *d, int c)
    int ret;
 
    if (msg == MSG_GOTMOUSE) // if we got mouse, display description
-      sprintf(button_description, "Display mode 5, 6, & 7 test results (not implemented in this version).");
+      sprintf(button_description, "Display monitor readiness, and on-board monitor (mode 6) test results.");
 
    ret = nostretch_icon_proc(msg, d, c); // call the parent object
 
    if (ret == D_CLOSE)           // trap the close value
-   {  
-      alert("This feature is not implemented", " in this version", NULL, "OK", NULL, 0, 0);
-      return D_REDRAWME;
+   {
+      display_tests(); // display readiness and test results
+      strcpy(button_description, welcome_message);
+      return D_REDRAW;
    }
    return ret;  // return
 }
@@ -0,0 +1,383 @@
+#include <string.h>
+#include "globals.h"
+#include "pids.h"
+
+/* Mode 01 PIDs are described by the table below instead of a formula each: the
+ * value is a bit field of the data bytes, scaled and offset into metric units,
+ * and status PIDs look their field up in a list of states.  Decoding is the
+ * same few operations for every PID, and a PID that is not in the table yet
+ * only needs a new row.  The unit table converts metric values and names the
+ * units for both systems of measurement.
+ */
+
+typedef struct
+{
+   const char *metric;
+   const char *imperial;
+   float imperial_scale;   // imperial value = metric value * imperial_scale + imperial_offset
+   float imperial_offset;
+   int imperial_precision; // number of decimals, -1 if same as metric
+   int show_sign;
+} UNIT;
+
+static const UNIT units[] =
+{
+   // metric     imperial      imperial_scale     imperial_offset  imperial_precision  show_sign
+   { "",         "",           1,                 0,               -1,                 FALSE },  // UNIT_NONE
+   { "%",        "%",          1,                 0,               -1,                 FALSE },  // UNIT_PERCENT
+   { "%",        "%",          1,                 0,               -1,                 TRUE  },  // UNIT_SIGNED_PERCENT
+   { " r/min",   " rpm",       1,                 0,               -1,                 FALSE },  // UNIT_RPM
+   { " km/h",    " mph",       1/1.609,           0,               -1,                 FALSE },  // UNIT_SPEED
+   { " km",      " miles",     1/1.609,           0,               -1,                 FALSE },  // UNIT_DISTANCE
+   { "\xB0 C",   "\xB0 F",     1.8,               32,              -1,                 FALSE },  // UNIT_TEMPERATURE
+   { "\xB0",     "\xB0",       1,                 0,               -1,                 FALSE },  // UNIT_DEGREE
+   { " kPa",     " inHg",      1/3.386389,        0,               1,                  FALSE },  // UNIT_KPA_INHG
+   { " kPa",     " psi",       0.145037738,       0,               1,                  FALSE },  // UNIT_KPA_PSI
+   { " Pa",      " in H2O",    1/249.088908,      0,               3,                  FALSE },  // UNIT_PA
+   { " g/s",     " lb/min",    0.13227736,        0,               1,                  FALSE },  // UNIT_FLOW
+   { " V",       " V",         1,                 0,               -1,                 FALSE },  // UNIT_VOLT
+   { " mA",      " mA",        1,                 0,               -1,                 FALSE }   // UNIT_MILLIAMP
+};
+
+static const PID_STATE_TEXT fuel_system_states[] =
+{
+   { 0x00, "unused" },
+   { 0x01, "open loop" },
+   { 0x02, "closed loop" },
+   { 0x04, "open loop (driving conditions)" },
+   { 0x08, "open loop (system fault)" },
+   { 0x10, "closed loop, O2 sensor fault" },
+   { -1,   "unknown: 0x%02X" }
+};
+
+// commanded secondary air status
+static const PID_STATE_TEXT secondary_air_states[] =
+{
+   { 0x01, "upstream of 1st cat. conv." },
+   { 0x02, "downstream of 1st cat. conv." },
+   { 0x04, "atmosphere / off" },
+   { -1,   "Not supported" }
+};
+
+static const PID_STATE_TEXT pto_states[] =
+{
+   { 0x00, "not active" },
+   { 0x01, "active" },
+   { -1,   "unknown: 0x%02X" }
+};
+
+// OBD requirement to which vehicle is designed
+static const PID_STATE_TEXT obd_requirements_states[] =
+{
+   { 0x01, "OBD-II (California ARB)" },
+   { 0x02, "OBD (Federal EPA)" },
+   { 0x03, "OBD and OBD-II" },
+   { 0x04, "OBD-I" },
+   { 0x05, "Not OBD compliant" },
+   { 0x06, "EOBD (Europe)" },
+   { 0x07, "EOBD and OBD-II" },
+   { 0x08, "EOBD and OBD" },
+   { 0x09, "EOBD, OBD and OBD-II" },
+   { 0x0A, "JOBD (Japan)" },
+   { 0x0B, "JOBD and OBD-II" },
+   { 0x0C, "JOBD and EOBD" },
+   { 0x0D, "JOBD, EOBD, and OBD-II" },
+   { -1,   "Unknown: 0x%02X" }
+};
+
+/* The order of the PIDs is the order of the sensors on the Sensor Data pages,
+ * and sensor states are saved in scantool.cfg by position, so new PIDs go at
+ * the end.
+ */
+const PID_DESCRIPTOR pid_descriptors[] =
+{
+   // label                             pid   bytes rate type        field: shift, mask, scale, offset, unit, precision
+   { "Absolute Throttle Position:",     "11", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Engine RPM:",                     "0C", 2, 0, PID_NUMBER,   { 0, 0xFFFF, 0.25, 0, UNIT_RPM, 0 } },
+   { "Vehicle Speed:",                  "0D", 1, 0, PID_NUMBER,   { 0, 0xFF, 1, 0, UNIT_SPEED, 0 } },
+   { "Calculated Load Value:",          "04", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Timing Advance (Cyl. #1):",       "0E", 1, 0, PID_NUMBER,   { 0, 0xFF, 0.5, -64, UNIT_DEGREE, 1 } },
+   { "Intake Manifold Pressure:",       "0B", 1, 0, PID_NUMBER,   { 0, 0xFF, 1, 0, UNIT_KPA_INHG, 0 } },
+   { "Air Flow Rate (MAF sensor):",     "10", 2, 0, PID_NUMBER,   { 0, 0xFFFF, 0.01, 0, UNIT_FLOW, 2 } },
+   { "Fuel System 1 Status:",           "03", 2, 1, PID_STATE,    { 8, 0xFF, 1, 0, UNIT_NONE, 0 }, fuel_system_states }, // Data A
+   { "Fuel System 2 Status:",           "03", 2, 1, PID_STATE,    { 0, 0xFF, 1, 0, UNIT_NONE, 0 }, fuel_system_states }, // Data B
+   // Page 2
+   { "Short Term Fuel Trim (Bank 1):",  "06", 2, 0, PID_NUMBER,   { 8, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 } }, // we're only showing bank 1 and 2 FT
+   { "Long Term Fuel Trim (Bank 1):",   "07", 2, 1, PID_NUMBER,   { 8, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 } },
+   { "Short Term Fuel Trim (Bank 2):",  "08", 2, 0, PID_NUMBER,   { 8, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 } },
+   { "Long Term Fuel Trim (Bank 2):",   "09", 2, 1, PID_NUMBER,   { 8, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 } },
+   { "Intake Air Temperature:",         "0F", 1, 1, PID_NUMBER,   { 0, 0xFF, 1, -40, UNIT_TEMPERATURE, 0 } },
+   { "Coolant Temperature:",            "05", 1, 1, PID_NUMBER,   { 0, 0xFF, 1, -40, UNIT_TEMPERATURE, 0 } },
+   { "Fuel Pressure (gauge):",          "0A", 1, 1, PID_NUMBER,   { 0, 0xFF, 3, 0, UNIT_KPA_PSI, 0 } },
+   { "Secondary air status:",           "12", 1, 1, PID_STATE,    { 0, 0x07, 1, 0, UNIT_NONE, 0 }, secondary_air_states },
+   { "Power Take-Off Status:",          "1E", 1, 1, PID_STATE,    { 0, 0x01, 1, 0, UNIT_NONE, 0 }, pto_states },
+   // Page 3
+   { "O2 Sensor 1, Bank 1:",            "14", 2, 0, PID_NUMBER,   { 8, 0xFF, 0.005, 0, UNIT_VOLT, 3 }, NULL, { 0, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 }, " @ ", " s.t. fuel trim", 0xFF }, // voltage, and short term fuel trim if the sensor is used for it
+   { "O2 Sensor 2, Bank 1:",            "15", 2, 0, PID_NUMBER,   { 8, 0xFF, 0.005, 0, UNIT_VOLT, 3 }, NULL, { 0, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 }, " @ ", " s.t. fuel trim", 0xFF },
+   { "O2 Sensor 3, Bank 1:",            "16", 2, 0, PID_NUMBER,   { 8, 0xFF, 0.005, 0, UNIT_VOLT, 3 }, NULL, { 0, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 }, " @ ", " s.t. fuel trim", 0xFF },
+   { "O2 Sensor 4, Bank 1:",            "17", 2, 0, PID_NUMBER,   { 8, 0xFF, 0.005, 0, UNIT_VOLT, 3 }, NULL, { 0, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 }, " @ ", " s.t. fuel trim", 0xFF },
+   { "O2 Sensor 1, Bank 2:",            "18", 2, 0, PID_NUMBER,   { 8, 0xFF, 0.005, 0, UNIT_VOLT, 3 }, NULL, { 0, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 }, " @ ", " s.t. fuel trim", 0xFF },
+   { "O2 Sensor 2, Bank 2:",            "19", 2, 0, PID_NUMBER,   { 8, 0xFF, 0.005, 0, UNIT_VOLT, 3 }, NULL, { 0, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 }, " @ ", " s.t. fuel trim", 0xFF },
+   { "O2 Sensor 3, Bank 2:",            "1A", 2, 0, PID_NUMBER,   { 8, 0xFF, 0.005, 0, UNIT_VOLT, 3 }, NULL, { 0, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 }, " @ ", " s.t. fuel trim", 0xFF },
+   { "O2 Sensor 4, Bank 2:",            "1B", 2, 0, PID_NUMBER,   { 8, 0xFF, 0.005, 0, UNIT_VOLT, 3 }, NULL, { 0, 0xFF, 100.0/128, -100, UNIT_SIGNED_PERCENT, 1 }, " @ ", " s.t. fuel trim", 0xFF },
+   { "OBD conforms to:",                "1C", 1, 1, PID_STATE,    { 0, 0xFF, 1, 0, UNIT_NONE, 0 }, obd_requirements_states },
+   // Page 4
+   { "O2 Sensor 1, Bank 1 (WR):",       "24", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.000122, 0, UNIT_VOLT, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 }, // o2 sensors (wide range), voltage
+   { "O2 Sensor 2, Bank 1 (WR):",       "25", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.000122, 0, UNIT_VOLT, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 3, Bank 1 (WR):",       "26", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.000122, 0, UNIT_VOLT, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 4, Bank 1 (WR):",       "27", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.000122, 0, UNIT_VOLT, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 1, Bank 2 (WR):",       "28", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.000122, 0, UNIT_VOLT, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 2, Bank 2 (WR):",       "29", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.000122, 0, UNIT_VOLT, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 3, Bank 2 (WR):",       "2A", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.000122, 0, UNIT_VOLT, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 4, Bank 2 (WR):",       "2B", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.000122, 0, UNIT_VOLT, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "Time Since Engine Start:",        "1F", 2, 1, PID_DURATION, { 0, 0xFFFF, 1, 0, UNIT_NONE, 0 } },
+   // Page 5
+   { "FRP rel. to manifold vacuum:",    "22", 2, 0, PID_NUMBER,   { 0, 0xFFFF, 0.079, 0, UNIT_KPA_PSI, 3 } }, // fuel rail pressure relative to manifold vacuum
+   { "Fuel Pressure (gauge):",          "23", 2, 0, PID_NUMBER,   { 0, 0xFFFF, 10, 0, UNIT_KPA_PSI, 0 } }, // fuel rail pressure (gauge), wide range
+   { "Commanded EGR:",                  "2C", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "EGR Error:",                      "2D", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, -12800.0/255, UNIT_SIGNED_PERCENT, 1 } },
+   { "Commanded Evaporative Purge:",    "2E", 1, 1, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Fuel Level Input:",               "2F", 1, 1, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Warm-ups since ECU reset:",       "30", 1, 1, PID_NUMBER,   { 0, 0xFF, 1, 0, UNIT_NONE, 0 } },
+   { "Distance since ECU reset:",       "31", 2, 1, PID_NUMBER,   { 0, 0xFFFF, 1, 0, UNIT_DISTANCE, 0 } },
+   { "Evap System Vapor Pressure:",     "32", 2, 1, PID_NUMBER,   { 0, 0xFFFF, 0.25, 0, UNIT_PA, 2 } },
+   // Page 6
+   { "O2 Sensor 1, Bank 1 (WR):",       "34", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.00390625, -128, UNIT_MILLIAMP, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 }, // o2 sensors (wide range), current
+   { "O2 Sensor 2, Bank 1 (WR):",       "35", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.00390625, -128, UNIT_MILLIAMP, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 3, Bank 1 (WR):",       "36", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.00390625, -128, UNIT_MILLIAMP, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 4, Bank 1 (WR):",       "37", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.00390625, -128, UNIT_MILLIAMP, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 1, Bank 2 (WR):",       "38", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.00390625, -128, UNIT_MILLIAMP, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 2, Bank 2 (WR):",       "39", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.00390625, -128, UNIT_MILLIAMP, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 3, Bank 2 (WR):",       "3A", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.00390625, -128, UNIT_MILLIAMP, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "O2 Sensor 4, Bank 2 (WR):",       "3B", 4, 0, PID_NUMBER,   { 0, 0xFFFF, 0.00390625, -128, UNIT_MILLIAMP, 3 }, NULL, { 16, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 }, ", Eq. ratio: ", "", -1 },
+   { "Distance since MIL activated:",   "21", 2, 1, PID_NUMBER,   { 0, 0xFFFF, 1, 0, UNIT_DISTANCE, 0 } },
+   // Page 7
+   { "Barometric Pressure (absolute):", "33", 1, 1, PID_NUMBER,   { 0, 0xFF, 1, 0, UNIT_KPA_INHG, 0 } },
+   { "CAT Temperature, B1S1:",          "3C", 2, 1, PID_NUMBER,   { 0, 0xFFFF, 0.1, -40, UNIT_TEMPERATURE, 1 } },
+   { "CAT Temperature, B2S1:",          "3D", 2, 1, PID_NUMBER,   { 0, 0xFFFF, 0.1, -40, UNIT_TEMPERATURE, 1 } },
+   { "CAT Temperature, B1S2:",          "3E", 2, 1, PID_NUMBER,   { 0, 0xFFFF, 0.1, -40, UNIT_TEMPERATURE, 1 } },
+   { "CAT Temperature, B2S2:",          "3F", 2, 1, PID_NUMBER,   { 0, 0xFFFF, 0.1, -40, UNIT_TEMPERATURE, 1 } },
+   { "ECU voltage:",                    "42", 2, 1, PID_NUMBER,   { 0, 0xFFFF, 0.001, 0, UNIT_VOLT, 3 } },
+   { "Absolute Engine Load:",           "43", 2, 0, PID_NUMBER,   { 0, 0xFFFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Commanded Equivalence Ratio:",    "44", 2, 0, PID_NUMBER,   { 0, 0xFFFF, 0.0000305, 0, UNIT_NONE, 3 } },
+   { "Ambient Air Temperature:",        "46", 1, 1, PID_NUMBER,   { 0, 0xFF, 1, -40, UNIT_TEMPERATURE, 0 } }, // same scaling as $0F
+   // Page 8
+   { "Relative Throttle Position:",     "45", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Absolute Throttle Position B:",   "47", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Absolute Throttle Position C:",   "48", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Accelerator Pedal Position D:",   "49", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Accelerator Pedal Position E:",   "4A", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Accelerator Pedal Position F:",   "4B", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } },
+   { "Comm. Throttle Actuator Cntrl:",  "4C", 1, 0, PID_NUMBER,   { 0, 0xFF, 100.0/255, 0, UNIT_PERCENT, 1 } }, // commanded TAC
+   { "Engine running while MIL on:",    "4D", 2, 1, PID_MINUTES,  { 0, 0xFFFF, 1, 0, UNIT_NONE, 0 } }, // minutes run by the engine while MIL activated
+   { "Time since DTCs cleared:",        "4E", 2, 1, PID_MINUTES,  { 0, 0xFFFF, 1, 0, UNIT_NONE, 0 } },
+   { NULL }
+};
+
+static short pid_index[0x100]; // position of the first descriptor of each PID in the table, -1 if the PID is not known
+static int pid_index_built = FALSE;
+
+static void build_pid_index();
+static void format_field(const PID_FIELD *field, unsigned long data, char *buf);
+static int is_requested(int pid, const char *request, int step);
+static int split_data(const char *msg, const char *request, const char *service, PID_DATA *pid_data, int max);
+
+
+int get_num_of_pid_descriptors()
+{
+   int i;
+
+   for (i = 0; pid_descriptors[i].label; i++);
+
+   return i;
+}
+
+
+void build_pid_index()
+{
+   int i;
+
+   for (i = 0; i < 0x100; i++)
+      pid_index[i] = -1;
+
+   for (i = get_num_of_pid_descriptors() - 1; i >= 0; i--)
+      pid_index[strtol(pid_descriptors[i].pid, NULL, 16)] = i;
+
+   pid_index_built = TRUE;
+}
+
+
+// returns NULL if the PID is not in the table
+const PID_DESCRIPTOR *find_pid_descriptor(int pid)
+{
+   if (!pid_index_built)
+      build_pid_index();
+
+   if (pid < 0 || pid > 0xFF || pid_index[pid] < 0)
+      return NULL;
+
+   return &pid_descriptors[pid_index[pid]];
+}
+
+
+static int hex_value(char c)
+{
+   if (c >= '0' && c <= '9')
+      return c - '0';
+
+   return (c & ~0x20) - 'A' + 10;  // upper or lower case letter
+}
+
+
+// request is the service, followed by the PIDs (step characters each, with the frame number in mode 02)
+int is_requested(int pid, const char *request, int step)
+{
+   int len = strlen(request);
+   int pos;
+
+   for (pos = 2; pos + 2 <= len; pos += step)
+   {
+      if (((hex_value(request[pos]) << 4) | hex_value(request[pos + 1])) == pid)
+         return TRUE;
+   }
+
+   return FALSE;
+}
+
+
+/* split_data:
+ *  msg is a single mode 01 or mode 02 message: the service byte, followed by
+ *  one or more PIDs, each with its data (and, in mode 02, with the number of
+ *  the freeze frame between the two).  The length of each PID's data comes from
+ *  the PID table, so all of them are extracted in one pass, up to max.  In mode
+ *  02, "PIDs supported" ($00, $20, $40) and the DTC that caused the freeze
+ *  frame ($02) are extracted too.  Stops at the first PID whose length is not
+ *  known, or at padding (i.e., '41 05 7C 00 00 00').  Returns number of PIDs
+ *  stored in pid_data.
+ *
+ *  Fuel trims ($06-$09) are one byte on a vehicle with one or two banks, and
+ *  two (bank 3 or 4 in the second) with more.  The second byte is taken unless
+ *  the message ends there, or it is one of the PIDs in request (which may be
+ *  NULL).  A single byte is stored as the first of two, so bank 1 or 2 always
+ *  decodes from the same place.
+ */
+int split_data(const char *msg, const char *request, const char *service, PID_DATA *pid_data, int max)
+{
+   const int frame_len = (strcmp(service, "42") == 0) ? 2 : 0;
+   const PID_DESCRIPTOR *desc;
+   int len = strlen(msg);
+   int num_of_pids = 0;
+   int pid, pos, end, single_byte;
+
+   if (len < 2 || strncmp(msg, service, 2) != 0)
+      return 0;
+
+   for (pos = 2; num_of_pids < max && pos + 2 + frame_len <= len; pos = end)
+   {
+      pid = (hex_value(msg[pos]) << 4) | hex_value(msg[pos + 1]);
+      single_byte = FALSE;
+      if ((desc = find_pid_descriptor(pid)))
+      {
+         end = pos + 2 + frame_len + desc->bytes*2;
+         if (pid >= 0x06 && pid <= 0x09 && (end > len || (request && is_requested((hex_value(msg[end - 2]) << 4) | hex_value(msg[end - 1]), request, frame_len + 2))))
+         {
+            end -= 2;
+            single_byte = TRUE;
+         }
+      }
+      else if (frame_len && pid % 0x20 == 0)  // PIDs supported
+         end = pos + 2 + frame_len + 8;
+      else if (frame_len && pid == 0x02)      // freeze frame DTC
+         end = pos + 2 + frame_len + 4;
+      else  // length of data for an unknown PID is unknown, we can't go any further
+         break;
+      if (end > len)  // message is truncated
+         break;
+
+      pid_data[num_of_pids].pid = pid;
+      pid_data[num_of_pids].data = 0;
+      for (pos += 2 + frame_len; pos < end; pos++)
+         pid_data[num_of_pids].data = (pid_data[num_of_pids].data << 4) | hex_value(msg[pos]);
+      if (single_byte)
+         pid_data[num_of_pids].data <<= 8;
+      num_of_pids++;
+   }
+
+   return num_of_pids;
+}
+
+
+// msg is a single mode 01 message answering request (see split_data()), returns number of PIDs stored in pid_data
+int split_pid_data(const char *msg, const char *request, PID_DATA *pid_data, int max)
+{
+   return split_data(msg, request, "41", pid_data, max);
+}
+
+
+// msg is a single mode 02 message answering request (see split_data()), returns number of PIDs stored in pid_data
+int split_freeze_frame_data(const char *msg, const char *request, PID_DATA *pid_data, int max)
+{
+   return split_data(msg, request, "42", pid_data, max);
+}
+
+
+// returns the value of the PID, in metric units (the field itself for states)
+float decode_pid_value(const PID_DESCRIPTOR *desc, unsigned long data)
+{
+   return ((data >> desc->field.shift) & desc->field.mask)*desc->field.scale + desc->field.offset;
+}
+
+
+void format_field(const PID_FIELD *field, unsigned long data, char *buf)
+{
+   const UNIT *unit = &units[field->unit];
+   float value = ((data >> field->shift) & field->mask)*field->scale + field->offset;
+   int precision = field->precision;
+
+   if (system_of_measurements != METRIC)
+   {
+      value = value*unit->imperial_scale + unit->imperial_offset;
+      if (unit->imperial_precision >= 0)
+         precision = unit->imperial_precision;
+   }
+
+   if (unit->show_sign && (int)(value*10) != 0)
+      sprintf(buf, "%+.*f%s", precision, value, (system_of_measurements == METRIC) ? unit->metric : unit->imperial);
+   else
+      sprintf(buf, "%.*f%s", precision, (unit->show_sign) ? 0.0 : value, (system_of_measurements == METRIC) ? unit->metric : unit->imperial);
+}
+
+
+/* format_pid_value:
+ *  Formats the data bytes of a PID into buf, in the units the user has chosen.
+ */
+void format_pid_value(const PID_DESCRIPTOR *desc, unsigned long data, char *buf)
+{
+   const PID_STATE_TEXT *state;
+   int field = (data >> desc->field.shift) & desc->field.mask;
+
+   switch (desc->type)
+   {
+      case PID_STATE:
+         for (state = desc->states; state->value >= 0 && state->value != field; state++);
+         sprintf(buf, state->text, field);
+         break;
+
+      case PID_DURATION:
+         sprintf(buf, "%02i:%02i:%02i", field/3600, (field % 3600)/60, field % 60);
+         break;
+
+      case PID_MINUTES:
+         sprintf(buf, "%i hrs %i min", field/60, field%60);
+         break;
+
+      default:
+         format_field(&desc->field, data, buf);
+         if (desc->aux_prefix && (long)((data >> desc->aux.shift) & desc->aux.mask) != desc->aux_unused)
+         {
+            strcat(buf, desc->aux_prefix);
+            format_field(&desc->aux, data, buf + strlen(buf));
+            strcat(buf, desc->aux_suffix);
+         }
+   }
+}
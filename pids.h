@@ -0,0 +1,75 @@
+#ifndef PIDS_H
+#define PIDS_H
+
+// Decode types
+#define PID_NUMBER     0  // value = field*scale + offset
+#define PID_STATE      1  // field is looked up in a list of states
+#define PID_DURATION   2  // field is a number of seconds, shown as hh:mm:ss
+#define PID_MINUTES    3  // field is a number of minutes, shown as hours and minutes
+
+// Units:
+#define UNIT_NONE            0
+#define UNIT_PERCENT         1
+#define UNIT_SIGNED_PERCENT  2
+#define UNIT_RPM             3
+#define UNIT_SPEED           4
+#define UNIT_DISTANCE        5
+#define UNIT_TEMPERATURE     6
+#define UNIT_DEGREE          7
+#define UNIT_KPA_INHG        8  // manifold and barometric pressure
+#define UNIT_KPA_PSI         9  // fuel pressure
+#define UNIT_PA              10
+#define UNIT_FLOW            11
+#define UNIT_VOLT            12
+#define UNIT_MILLIAMP        13
+
+#define MAX_PIDS_PER_MESSAGE  8
+
+typedef struct
+{
+   int shift;            // field = (data >> shift) & mask
+   unsigned long mask;
+   float scale;          // value = field*scale + offset, in metric units
+   float offset;
+   int unit;
+   int precision;        // number of decimals shown
+} PID_FIELD;
+
+typedef struct
+{
+   int value;
+   const char *text;     // the last state has value -1, its text is shown (with the field in hex) for unknown values
+} PID_STATE_TEXT;
+
+typedef struct
+{
+   const char *label;
+   char pid[3];
+   int bytes;            // number of data bytes expected from vehicle
+   int rate;             // default refresh rate in Hz, 0 = as fast as possible
+   int type;
+   PID_FIELD field;
+   const PID_STATE_TEXT *states;  // PID_STATE only
+   // optional second field, shown after the value (i.e., fuel trim of an O2 sensor)
+   PID_FIELD aux;
+   const char *aux_prefix;        // NULL if there is no second field
+   const char *aux_suffix;
+   long aux_unused;               // value of the second field that means it's not used, -1 if none
+} PID_DESCRIPTOR;
+
+typedef struct
+{
+   int pid;
+   unsigned long data;   // data bytes, most significant first
+} PID_DATA;
+
+extern const PID_DESCRIPTOR pid_descriptors[];
+
+int get_num_of_pid_descriptors();
+const PID_DESCRIPTOR *find_pid_descriptor(int pid);
+int split_pid_data(const char *msg, const char *request, PID_DATA *pid_data, int max);
+int split_freeze_frame_data(const char *msg, const char *request, PID_DATA *pid_data, int max);
+float decode_pid_value(const PID_DESCRIPTOR *desc, unsigned long data);
+void format_pid_value(const PID_DESCRIPTOR *desc, unsigned long data, char *buf);
+
+#endif
@@ -0,0 +1,244 @@
+#ifdef ALLEGRO_WINDOWS
+   #include <winsock2.h>  // before allegro.h, which may pull in windows.h
+   #include <ws2tcpip.h>
+#endif
+#include <string.h>
+#include "globals.h"
+#include "byte_order.h"
+#include "publisher.h"
+
+#define PUBLISHER_MAX_CLIENTS     8
+#define DEFAULT_PUBLISHER_GROUP   "239.255.0.1"  // administratively scoped multicast group
+
+/* The publisher sends samples from the sensor pipeline to other programs on
+ * the network, so any number of dashboards and loggers can watch the vehicle
+ * without asking the ECU for more data.  Samples are collected into a batch,
+ * which goes out in one send at the end of each poll cycle (or when it fills
+ * up).  In UDP mode the batch is sent to one address, usually a multicast
+ * group; in TCP mode it goes to every client connected to the listening
+ * socket.  The sockets are non-blocking: a client that can't keep up is
+ * dropped instead of holding up the polling.
+ */
+
+#ifdef ALLEGRO_WINDOWS
+
+// publisher modes
+#define PUBLISH_OFF   0
+#define PUBLISH_UDP   1
+#define PUBLISH_TCP   2
+
+static int publisher_mode = PUBLISH_OFF;
+static SOCKET publisher_socket = INVALID_SOCKET;
+static struct sockaddr_in destination;  // UDP: where batches are sent, TCP: address we listen on
+static SOCKET clients[PUBLISHER_MAX_CLIENTS];
+static int num_of_clients = 0;
+static unsigned char batch[PUBLISHER_HEADER_SIZE + PUBLISHER_MAX_RECORDS*PUBLISHER_RECORD_SIZE];
+static int num_of_records = 0;
+static unsigned long sequence = 0;
+
+static void accept_clients();
+
+
+/* publisher_start:
+ *  mode is "udp" or "tcp".  In UDP mode, address is where the batches are
+ *  sent (the default multicast group if empty); in TCP mode it's the local
+ *  address to listen on (all of them if empty).  Returns FALSE if the socket
+ *  could not be set up.
+ */
+int publisher_start(const char *mode, const char *address, int port)
+{
+   WSADATA wsa_data;
+   unsigned long non_blocking = 1;
+   int ttl = 1;  // multicast stays on the local network
+   int reuse = TRUE;
+
+   publisher_stop();
+
+   if (strcmp(mode, "udp") == 0)
+   {
+      publisher_mode = PUBLISH_UDP;
+      if (!address[0])
+         address = DEFAULT_PUBLISHER_GROUP;
+   }
+   else if (strcmp(mode, "tcp") == 0)
+      publisher_mode = PUBLISH_TCP;
+   else
+      return FALSE;
+
+   if (WSAStartup(MAKEWORD(2, 0), &wsa_data) != 0)
+   {
+      publisher_mode = PUBLISH_OFF;
+      return FALSE;
+   }
+
+   memset(&destination, 0, sizeof(destination));
+   destination.sin_family = AF_INET;
+   destination.sin_port = htons(port);
+   destination.sin_addr.s_addr = (address[0]) ? inet_addr(address) : INADDR_ANY;
+
+   if (destination.sin_addr.s_addr == INADDR_NONE)
+   {
+      publisher_stop();
+      return FALSE;
+   }
+
+   if (publisher_mode == PUBLISH_UDP)
+   {
+      if ((publisher_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET)
+      {
+         publisher_stop();
+         return FALSE;
+      }
+      setsockopt(publisher_socket, IPPROTO_IP, IP_MULTICAST_TTL, (const char *)&ttl, sizeof(ttl));
+   }
+   else
+   {
+      if ((publisher_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET)
+      {
+         publisher_stop();
+         return FALSE;
+      }
+      setsockopt(publisher_socket, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+      if (bind(publisher_socket, (struct sockaddr *)&destination, sizeof(destination)) == SOCKET_ERROR ||
+          listen(publisher_socket, PUBLISHER_MAX_CLIENTS) == SOCKET_ERROR)
+      {
+         publisher_stop();
+         return FALSE;
+      }
+   }
+   ioctlsocket(publisher_socket, FIONBIO, &non_blocking);
+
+   num_of_records = 0;
+   sequence = 0;
+
+   return TRUE;
+}
+
+
+void publisher_stop()
+{
+   int i;
+
+   if (publisher_mode == PUBLISH_OFF)
+      return;
+
+   for (i = 0; i < num_of_clients; i++)
+      closesocket(clients[i]);
+   num_of_clients = 0;
+
+   if (publisher_socket != INVALID_SOCKET)
+      closesocket(publisher_socket);
+   publisher_socket = INVALID_SOCKET;
+
+   WSACleanup();
+   publisher_mode = PUBLISH_OFF;
+}
+
+
+int publisher_is_running()
+{
+   return (publisher_mode != PUBLISH_OFF);
+}
+
+
+// adds a sample to the batch, the batch is sent if it's full
+void publish_sample(int pid, int bytes, long ecu, unsigned long time, unsigned long data, float value)
+{
+   unsigned char *record;
+   unsigned long bits;
+
+   if (publisher_mode == PUBLISH_OFF)
+      return;
+
+   if (num_of_records == PUBLISHER_MAX_RECORDS)
+      publisher_flush();
+
+   record = batch + PUBLISHER_HEADER_SIZE + num_of_records*PUBLISHER_RECORD_SIZE;
+   memcpy(&bits, &value, 4);
+   record[0] = pid;
+   record[1] = bytes;
+   put_le_value(record + 2, (ecu >= 0) ? ecu : 0, 2);
+   put_le_value(record + 4, time, 4);
+   put_le_value(record + 8, data, 4);
+   put_le_value(record + 12, bits, 4);
+   num_of_records++;
+}
+
+
+// sends the batch to the subscribers
+void publisher_flush()
+{
+   int len = PUBLISHER_HEADER_SIZE + num_of_records*PUBLISHER_RECORD_SIZE;
+   int i;
+
+   if (publisher_mode == PUBLISH_TCP)
+      accept_clients();
+
+   if (publisher_mode == PUBLISH_OFF || num_of_records == 0)
+      return;
+
+   memcpy(batch, PUBLISHER_MAGIC, 2);
+   batch[2] = PUBLISHER_VERSION;
+   batch[3] = num_of_records;
+   put_le_value(batch + 4, sequence++, 4);
+
+   if (publisher_mode == PUBLISH_UDP)
+      sendto(publisher_socket, (const char *)batch, len, 0, (struct sockaddr *)&destination, sizeof(destination));
+   else
+   {
+      for (i = 0; i < num_of_clients; i++)
+      {
+         if (send(clients[i], (const char *)batch, len, 0) != len)  // gone, or too slow (a partial batch would break the stream)
+         {
+            closesocket(clients[i]);
+            clients[i--] = clients[--num_of_clients];
+         }
+      }
+   }
+
+   num_of_records = 0;
+}
+
+
+void accept_clients()
+{
+   unsigned long non_blocking = 1;
+   SOCKET client;
+
+   while (num_of_clients < PUBLISHER_MAX_CLIENTS && (client = accept(publisher_socket, NULL, NULL)) != INVALID_SOCKET)
+   {
+      ioctlsocket(client, FIONBIO, &non_blocking);
+      clients[num_of_clients++] = client;
+   }
+}
+
+#else
+
+// there's no network stack in the DOS build
+int publisher_start(const char *mode, const char *address, int port)
+{
+   return FALSE;
+}
+
+
+void publisher_stop()
+{
+}
+
+
+int publisher_is_running()
+{
+   return FALSE;
+}
+
+
+void publish_sample(int pid, int bytes, long ecu, unsigned long time, unsigned long data, float value)
+{
+}
+
+
+void publisher_flush()
+{
+}
+
+#endif
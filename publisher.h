@@ -0,0 +1,26 @@
+#ifndef PUBLISHER_H
+#define PUBLISHER_H
+
+/* Batch layout (all numbers are little-endian):
+ *   header: "ST", version byte, number of records (8 bits), sequence number (32 bits)
+ *   records: PID (8 bits), number of data bytes (8 bits), CAN ID of the ECU
+ *            (16 bits, 0 if not known), clock_ms() time of the sample (32 bits),
+ *            data bytes (32 bits), value in metric units (32-bit IEEE float)
+ * A batch is one UDP datagram.  Over TCP, the number of records tells where
+ * the next batch starts.
+ */
+#define PUBLISHER_MAGIC           "ST"
+#define PUBLISHER_VERSION         1
+#define PUBLISHER_HEADER_SIZE     8
+#define PUBLISHER_RECORD_SIZE     16
+#define PUBLISHER_MAX_RECORDS     64  // a full batch fits in one Ethernet frame
+
+#define DEFAULT_PUBLISHER_PORT    35000
+
+int publisher_start(const char *mode, const char *address, int port);
+void publisher_stop();
+int publisher_is_running();
+void publish_sample(int pid, int bytes, long ecu, unsigned long time, unsigned long data, float value);
+void publisher_flush();
+
+#endif
@@ -0,0 +1,100 @@
+#include <string.h>
+#include <time.h>
+#include "globals.h"
+#include "error_handlers.h"
+#include "clock.h"
+#include "byte_order.h"
+#include "recorder.h"
+
+#define RECORDER_BUFFER_SIZE   65536  // frames are written to the file when the buffer fills up
+
+/* The recorder keeps everything that goes to and comes from the interface in
+ * a buffer that is allocated once, when the recording starts, and writes it to
+ * the file a buffer at a time.  Recording a frame is a copy into the buffer,
+ * so send_command() and read_comport() are not held up by the disk.  Only
+ * the thread that owns the COM port records, so the buffer needs no locking.
+ */
+
+static FILE *session_file = NULL;
+static unsigned char *buffer = NULL;
+static int buffer_len = 0;
+static unsigned long last_frame_time;
+
+static void flush_buffer();
+
+
+/* recorder_start:
+ *  Creates the session file and starts recording.  Returns FALSE if the file
+ *  could not be created.
+ */
+int recorder_start(const char *file_name)
+{
+   recorder_stop();
+
+   if ((session_file = fopen(file_name, "wb")) == NULL)
+      return FALSE;
+
+   if (!(buffer = (unsigned char *)malloc(RECORDER_BUFFER_SIZE)))
+      fatal_error("Could not allocate enough memory for session recorder");
+
+   memcpy(buffer, RECORDER_MAGIC, 7);
+   buffer[7] = RECORDER_VERSION;
+   put_le_value(buffer + 8, (unsigned long)time(NULL), 4);
+   buffer_len = RECORDER_HEADER_SIZE;
+   last_frame_time = clock_us();
+
+   return TRUE;
+}
+
+
+void recorder_stop()
+{
+   if (session_file == NULL)
+      return;
+
+   flush_buffer();
+   fclose(session_file);
+   free(buffer);
+   session_file = NULL;
+   buffer = NULL;
+   buffer_len = 0;
+}
+
+
+int recorder_is_running()
+{
+   return (session_file != NULL);
+}
+
+
+/* record_frame:
+ *  Adds len bytes of data, sent (RECORD_TX) or received (RECORD_RX), to the
+ *  session.  Does nothing if the recorder is not running.
+ */
+void record_frame(int direction, const char *data, int len)
+{
+   unsigned long now;
+
+   if (session_file == NULL || len <= 0)
+      return;
+
+   len = MIN(len, RECORDER_BUFFER_SIZE - RECORDER_FRAME_HEADER);
+   if (buffer_len + RECORDER_FRAME_HEADER + len > RECORDER_BUFFER_SIZE)
+      flush_buffer();
+
+   now = clock_us();
+   put_le_value(buffer + buffer_len, now - last_frame_time, 4);
+   buffer[buffer_len + 4] = direction;
+   put_le_value(buffer + buffer_len + 5, len, 2);
+   memcpy(buffer + buffer_len + RECORDER_FRAME_HEADER, data, len);
+   buffer_len += RECORDER_FRAME_HEADER + len;
+   last_frame_time = now;
+}
+
+
+void flush_buffer()
+{
+   if (buffer_len > 0)
+      fwrite(buffer, 1, buffer_len, session_file);
+   buffer_len = 0;
+}
@@ -0,0 +1,23 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+/* Session file layout (all numbers are little-endian):
+ *   header: "SCANREC" + version byte, start time (32-bit time_t)
+ *   frames: time since the previous frame in microseconds (32 bits),
+ *           direction (8 bits), length (16 bits), followed by the data
+ */
+#define RECORDER_MAGIC         "SCANREC"
+#define RECORDER_VERSION       1
+#define RECORDER_HEADER_SIZE   12
+#define RECORDER_FRAME_HEADER  7
+
+// frame directions
+#define RECORD_TX   0
+#define RECORD_RX   1
+
+int recorder_start(const char *file_name);
+void recorder_stop();
+int recorder_is_running();
+void record_frame(int direction, const char *data, int len);
+
+#endif
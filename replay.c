@@ -0,0 +1,188 @@
+#include <string.h>
+#include "globals.h"
+#include "error_handlers.h"
+#include "clock.h"
+#include "byte_order.h"
+#include "recorder.h"
+#include "replay.h"
+
+/* The replay backend stands in for the interface, serving the responses from
+ * a session recorded by recorder.c.  When a command is sent, the next recorded
+ * transmission of the same command is looked up (wrapping around to the start
+ * of the session, so a short recording can be replayed for as long as needed),
+ * and the frames received after it are handed out by replay_receive().  A
+ * command that was never recorded gets no response, like a dead adapter would.
+ */
+
+typedef struct
+{
+   unsigned long delay;   // microseconds since the previous frame
+   int direction;         // RECORD_TX or RECORD_RX
+   int len;
+   const char *data;
+   long next;             // position of the next frame in the session
+} REPLAY_FRAME;
+
+static unsigned char *session = NULL;
+static long session_size = 0;
+static long cursor = 0;            // next frame to be replayed
+static int frame_offset = 0;       // number of bytes of the frame at cursor that were already received
+static int replay_timing = REPLAY_FAST;
+static int responding = FALSE;     // TRUE if a command was matched and its response is being replayed
+static unsigned long command_time; // when the command was sent
+static unsigned long response_due; // time of the last received frame, relative to command_time
+
+static int get_frame(long pos, REPLAY_FRAME *frame);
+static long find_command(const char *command);
+
+
+/* replay_open:
+ *  Loads a recorded session.  timing is REPLAY_FAST or REPLAY_RECORDED.
+ *  Returns FALSE if the file could not be read, or is not a session file.
+ */
+int replay_open(const char *file_name, int timing)
+{
+   FILE *file;
+
+   replay_close();
+
+   if ((file = fopen(file_name, "rb")) == NULL)
+      return FALSE;
+
+   fseek(file, 0, SEEK_END);
+   session_size = ftell(file);
+   fseek(file, 0, SEEK_SET);
+
+   if (session_size < RECORDER_HEADER_SIZE)
+   {
+      fclose(file);
+      return FALSE;
+   }
+
+   if (!(session = (unsigned char *)malloc(session_size)))
+      fatal_error("Could not allocate enough memory for session replay");
+
+   if (fread(session, 1, session_size, file) != session_size ||
+       memcmp(session, RECORDER_MAGIC, 7) != 0 || session[7] != RECORDER_VERSION)
+   {
+      fclose(file);
+      replay_close();
+      return FALSE;
+   }
+   fclose(file);
+
+   cursor = RECORDER_HEADER_SIZE;
+   frame_offset = 0;
+   replay_timing = timing;
+   responding = FALSE;
+
+   return TRUE;
+}
+
+
+void replay_close()
+{
+   free(session);
+   session = NULL;
+   session_size = 0;
+   responding = FALSE;
+}
+
+
+int replay_is_open()
+{
+   return (session != NULL);
+}
+
+
+void replay_send(const char *command)
+{
+   REPLAY_FRAME frame;
+   long pos = find_command(command);
+
+   responding = (pos >= 0);
+   if (responding)
+   {
+      get_frame(pos, &frame);
+      cursor = frame.next;
+      frame_offset = 0;
+      command_time = clock_us();
+      response_due = 0;
+   }
+}
+
+
+/* replay_receive:
+ *  Copies the part of the recorded response that has "arrived" by now, but no
+ *  more than size-1 characters, into response.  Returns number of characters
+ *  copied.
+ */
+int replay_receive(char *response, int size)
+{
+   REPLAY_FRAME frame;
+   int len = 0;
+   int n;
+
+   while (responding && len < size - 1 && get_frame(cursor, &frame) && frame.direction == RECORD_RX)
+   {
+      if (replay_timing == REPLAY_RECORDED && frame_offset == 0)
+      {
+         if (clock_us() - command_time < response_due + frame.delay)
+            break;  // this frame did not arrive yet
+         response_due += frame.delay;
+      }
+
+      n = MIN(frame.len - frame_offset, size - 1 - len);
+      memcpy(response + len, frame.data + frame_offset, n);
+      len += n;
+      frame_offset += n;
+
+      if (frame_offset >= frame.len)
+      {
+         cursor = frame.next;
+         frame_offset = 0;
+      }
+   }
+
+   response[len] = 0;
+
+   return len;
+}
+
+
+// returns position of the next recorded transmission of command, -1 if it was never recorded
+long find_command(const char *command)
+{
+   REPLAY_FRAME frame;
+   int len = strlen(command);
+   long pos;
+   int wrapped;
+
+   for (wrapped = 0; wrapped < 2; wrapped++)
+   {
+      for (pos = (wrapped) ? RECORDER_HEADER_SIZE : cursor; get_frame(pos, &frame); pos = frame.next)
+      {
+         if (wrapped && pos >= cursor)
+            break;
+         if (frame.direction == RECORD_TX && frame.len == len && memcmp(frame.data, command, len) == 0)
+            return pos;
+      }
+   }
+
+   return -1;
+}
+
+
+int get_frame(long pos, REPLAY_FRAME *frame)
+{
+   if (pos + RECORDER_FRAME_HEADER > session_size)
+      return FALSE;
+
+   frame->delay = get_le_value(session + pos, 4);
+   frame->direction = session[pos + 4];
+   frame->len = get_le_value(session + pos + 5, 2);
+   frame->data = (const char *)session + pos + RECORDER_FRAME_HEADER;
+   frame->next = pos + RECORDER_FRAME_HEADER + frame->len;
+
+   return (frame->next <= session_size);  // the last frame may be cut short
+}
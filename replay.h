@@ -0,0 +1,14 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+// replay timing
+#define REPLAY_FAST       0   // responses are available as soon as the command is sent
+#define REPLAY_RECORDED   1   // responses arrive with the delays they were recorded with
+
+int replay_open(const char *file_name, int timing);
+void replay_close();
+int replay_is_open();
+void replay_send(const char *command);
+int replay_receive(char *response, int size);
+
+#endif
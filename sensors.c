@@ -5,38 +5,84 @@
 #include "error_handlers.h"
 #include "sensors.h"
 #include "custom_gui.h"
+#include "acquisition.h"
+#include "session.h"
+#include "clock.h"
+#include "pids.h"
+#include "publisher.h"
+#include "logger.h"
+#include "strip_chart.h"
+#include "vehicle_info.h"
 
 #define MSG_TOGGLE   MSG_USER
 #define MSG_UPDATE   MSG_USER + 1
 #define MSG_REFRESH	MSG_USER + 2
 
 #define SENSORS_PER_PAGE      9
+#define MAX_PIDS_PER_REQUEST  6 // ELM327 accepts up to 6 PIDs in a single mode 01 request on CAN, must not exceed MAX_PIDS_PER_MESSAGE
+#define PIPELINE_DEPTH        2 // number of requests queued with the session
 #define NUM_OF_RETRIES        3
 #define SENSORS_TO_TIME_OUT   2 //number of sensors that need to time out before the warning will be issued
-#define REFRESH_RATE_PRECISION 10 // how often the samples are taken, in milliseconds
+#define MAX_FRAME_RATE        20 // how many times a second changed values are painted
+#define SENSOR_LABEL_MARGIN   245
+#define SENSOR_VALUE_INDENT   8
 
 // Sensor states:
 #define SENSOR_OFF      0  // OFF,
 #define SENSOR_ACTIVE   1  // ACTIVE (returned value), 
 #define SENSOR_NA       2  // NA (displays "N/A")
 
+#define SENSOR_HISTORY  32 // number of samples kept for each sensor, must be a power of 2
+
+typedef struct
+{
+   float value;  // in metric units
+   unsigned long time;  // clock_ms() time when the sample was taken
+} SAMPLE;
 
 typedef struct
 {
-   void (*formula)(int raw_data, char *buf);
-   char label[32];
+   const PID_DESCRIPTOR *desc;  // label, PID, and how the data is decoded
    char screen_buf[64];
-   char pid[3];
    int enabled;
-   int bytes; // number of data bytes expected from vehicle
+   int rate;  // target refresh rate in Hz, 0 = as fast as possible
+   unsigned long next_poll; // clock_ms() time when the sensor is due to be polled again
+   long ecu;  // CAN ID of the ECU whose data is displayed, -1 if headers are off or no data yet
+   int value_dirty; // TRUE if the value changed since it was painted
+   int text_stale;  // TRUE if the newest sample was not formatted into screen_buf yet
+   unsigned long raw_data;  // data bytes of the newest sample
+   SAMPLE history[SENSOR_HISTORY];  // ring of decoded samples
+   int num_of_samples;  // total number of samples taken, the newest is history[(num_of_samples - 1) % SENSOR_HISTORY]
+   int logged_samples;  // value of num_of_samples when the sensor was last logged
+   int chart_channel;   // strip chart channel the sensor is plotted on, -1 if none
+   int charted_samples; // value of num_of_samples when the sensor's samples were last handed to the chart
 } SENSOR;
 
+typedef struct
+{
+   int rows[SENSORS_PER_PAGE]; // rows of sensor_dialog covered by the request
+   int size;
+   int page_id;   // value of page_id when the request was made
+} BATCH;
+
 static void load_sensor_states();
 static void save_sensor_states();
 static void fill_sensors(int page_number);
+static int build_sensor_request(int first_row, char *cmd, BATCH *batch);
+static int decode_pid_data(BATCH *batch, const char *request, const char *msg, long ecu, int *updated);
+static int handle_sensor_response(BATCH *batch, const char *request, char *vehicle_response, const RESPONSE_INDEX *index);
+static void set_batch_text(BATCH *batch, const char *text);
+static void sensor_response(ACQ_TRANSACTION *transaction, void *context);
+static void set_sensor_text(SENSOR *sensor, const char *text);
+static void paint_sensor_values();
+static void log_sensor_values();
+static void set_graph_mode(int on);
+static void select_chart_channels();
+static void feed_chart();
 
 static int reset_chip_proc(int msg, DIALOG *d, int c);
 static int options_proc(int msg, DIALOG *d, int c);
+static int graph_proc(int msg, DIALOG *d, int c);
 static int page_flipper_proc(int msg, DIALOG *d, int c);
 static int sensor_proc(int msg, DIALOG *d, int c);
 static int toggle_proc(int msg, DIALOG *d, int c);
@@ -47,50 +93,7 @@ static int inst_refresh_rate_proc(int msg, DIALOG *d, int c);
 static int avg_refresh_rate_proc(int msg, DIALOG *d, int c);
 static int page_updn_handler_proc(int msg, DIALOG *d, int c);
 
-// Sensor formulae:
-static void throttle_position_formula(int data, char *buf); // Page 1
-static void engine_rpm_formula(int data, char *buf);
-static void vehicle_speed_formula(int data, char *buf);
-static void engine_load_formula(int data, char *buf);
-static void timing_advance_formula(int data, char *buf);
-static void intake_pressure_formula(int data, char *buf);
-static void air_flow_rate_formula(int data, char *buf);
-static void fuel_system1_status_formula(int data, char *buf);
-static void fuel_system2_status_formula(int data, char *buf);
-static void short_term_fuel_trim_formula(int data, char *buf); // Page 2
-static void long_term_fuel_trim_formula(int data, char *buf);
-static void intake_air_temp_formula(int data, char *buf);
-static void coolant_temp_formula(int data, char *buf);
-static void fuel_pressure_formula(int data, char *buf);
-static void secondary_air_status_formula(int data, char *buf);
-static void pto_status_formula(int data, char *buf);
-static void o2_sensor_formula(int data, char *buf);
-void obd_requirements_formula(int data, char *buf);
-// added 1/2/2003
-static void engine_run_time_formula(int data, char *buf);
-static void mil_distance_formula(int data, char *buf);
-static void frp_relative_formula(int data, char *buf);
-static void frp_widerange_formula(int data, char *buf);
-static void o2_sensor_wrv_formula(int data, char *buf);
-static void commanded_egr_formula(int data, char *buf);
-static void egr_error_formula(int data, char *buf);
-static void evap_pct_formula(int data, char *buf);
-static void fuel_level_formula(int data, char *buf);
-static void warm_ups_formula(int data, char *buf);
-static void clr_distance_formula(int data, char *buf);
-static void evap_vp_formula(int data, char *buf);
-static void baro_pressure_formula(int data, char *buf);
-static void o2_sensor_wrc_formula(int data, char *buf);
-static void cat_temp_formula(int data, char *buf);
-static void ecu_voltage_formula(int data, char *buf);
-static void abs_load_formula(int data, char *buf);
-static void eq_ratio_formula(int data, char *buf);
-static void relative_tp_formula(int data, char *buf);
-static void amb_air_temp_formula(int data, char *buf);
-static void abs_tp_formula(int data, char *buf);
-static void tac_pct_formula(int data, char *buf);
-static void mil_time_formula(int data, char *buf);
-static void clr_time_formula(int data, char *buf);
+static void add_sample(SENSOR *sensor, unsigned long raw_data);
 
 // variables
 static int device_connected = FALSE;
@@ -103,92 +106,23 @@ static int current_page = 0;
 static float inst_refresh_rate = -1; // instantaneous refresh rate
 static float avg_refresh_rate = -1;  // average refresh rate
 
-volatile int refresh_time; // time between sensor updates
-
-static SENSOR sensors[] =
-{
-   // formula                        // label            //screen_buffer  //pid  //enabled // bytes
-   { throttle_position_formula,     "Absolute Throttle Position:",     "", "11",      1,    1 },
-   { engine_rpm_formula,            "Engine RPM:",                     "", "0C",      1,    2 },
-   { vehicle_speed_formula,         "Vehicle Speed:",                  "", "0D",      1,    1 },
-   { engine_load_formula,           "Calculated Load Value:",          "", "04",      1,    1 },
-   { timing_advance_formula,        "Timing Advance (Cyl. #1):",       "", "0E",      1,    1 },
-   { intake_pressure_formula,       "Intake Manifold Pressure:",       "", "0B",      1,    1 },
-   { air_flow_rate_formula,         "Air Flow Rate (MAF sensor):",     "", "10",      1,    2 },
-   { fuel_system1_status_formula,   "Fuel System 1 Status:",           "", "03",      1,    2 },
-   { fuel_system2_status_formula,   "Fuel System 2 Status:",           "", "03",      1,    2 },
-   // Page 2
-   { short_term_fuel_trim_formula,  "Short Term Fuel Trim (Bank 1):",  "", "06",      1,    2 },
-   { long_term_fuel_trim_formula,   "Long Term Fuel Trim (Bank 1):",   "", "07",      1,    2 },
-   { short_term_fuel_trim_formula,  "Short Term Fuel Trim (Bank 2):",  "", "08",      1,    2 },
-   { long_term_fuel_trim_formula,   "Long Term Fuel Trim (Bank 2):",   "", "09",      1,    2 },
-   { intake_air_temp_formula,       "Intake Air Temperature:",         "", "0F",      1,    1 },
-   { coolant_temp_formula,          "Coolant Temperature:",            "", "05",      1,    1 },
-   { fuel_pressure_formula,         "Fuel Pressure (gauge):",          "", "0A",      1,    1 },
-   { secondary_air_status_formula,  "Secondary air status:",           "", "12",      1,    1 },
-   { pto_status_formula,            "Power Take-Off Status:",          "", "1E",      1,    1 },
-   // Page 3
-   { o2_sensor_formula,             "O2 Sensor 1, Bank 1:",            "", "14",      1,    2 },
-   { o2_sensor_formula,             "O2 Sensor 2, Bank 1:",            "", "15",      1,    2 },
-   { o2_sensor_formula,             "O2 Sensor 3, Bank 1:",            "", "16",      1,    2 },
-   { o2_sensor_formula,             "O2 Sensor 4, Bank 1:",            "", "17",      1,    2 },
-   { o2_sensor_formula,             "O2 Sensor 1, Bank 2:",            "", "18",      1,    2 },
-   { o2_sensor_formula,             "O2 Sensor 2, Bank 2:",            "", "19",      1,    2 },
-   { o2_sensor_formula,             "O2 Sensor 3, Bank 2:",            "", "1A",      1,    2 },
-   { o2_sensor_formula,             "O2 Sensor 4, Bank 2:",            "", "1B",      1,    2 },
-   { obd_requirements_formula,      "OBD conforms to:",                "", "1C",      1,    1 },
-   // Page 4
-   { o2_sensor_wrv_formula,         "O2 Sensor 1, Bank 1 (WR):",       "", "24",      1,    4 },    // o2 sensors (wide range), voltage
-   { o2_sensor_wrv_formula,         "O2 Sensor 2, Bank 1 (WR):",       "", "25",      1,    4 },
-   { o2_sensor_wrv_formula,         "O2 Sensor 3, Bank 1 (WR):",       "", "26",      1,    4 },
-   { o2_sensor_wrv_formula,         "O2 Sensor 4, Bank 1 (WR):",       "", "27",      1,    4 },
-   { o2_sensor_wrv_formula,         "O2 Sensor 1, Bank 2 (WR):",       "", "28",      1,    4 },
-   { o2_sensor_wrv_formula,         "O2 Sensor 2, Bank 2 (WR):",       "", "29",      1,    4 },
-   { o2_sensor_wrv_formula,         "O2 Sensor 3, Bank 2 (WR):",       "", "2A",      1,    4 },
-   { o2_sensor_wrv_formula,         "O2 Sensor 4, Bank 2 (WR):",       "", "2B",      1,    4 },
-   { engine_run_time_formula,       "Time Since Engine Start:",        "", "1F",      1,    2 },
-   // Page 5
-   { frp_relative_formula,          "FRP rel. to manifold vacuum:",    "", "22",      1,    2 },    // fuel rail pressure relative to manifold vacuum
-   { frp_widerange_formula,         "Fuel Pressure (gauge):",          "", "23",      1,    2 },    // fuel rail pressure (gauge), wide range
-   { commanded_egr_formula,         "Commanded EGR:",                  "", "2C",      1,    1 },
-   { egr_error_formula,             "EGR Error:",                      "", "2D",      1,    1 },
-   { evap_pct_formula,              "Commanded Evaporative Purge:",    "", "2E",      1,    1 },
-   { fuel_level_formula,            "Fuel Level Input:",               "", "2F",      1,    1 },
-   { warm_ups_formula,              "Warm-ups since ECU reset:",       "", "30",      1,    1 },
-   { clr_distance_formula,          "Distance since ECU reset:",       "", "31",      1,    2 },
-   { evap_vp_formula,               "Evap System Vapor Pressure:",     "", "32",      1,    2 },
-   // Page 6
-   { o2_sensor_wrc_formula,         "O2 Sensor 1, Bank 1 (WR):",       "", "34",      1,    4 },   // o2 sensors (wide range), current
-   { o2_sensor_wrc_formula,         "O2 Sensor 2, Bank 1 (WR):",       "", "35",      1,    4 },
-   { o2_sensor_wrc_formula,         "O2 Sensor 3, Bank 1 (WR):",       "", "36",      1,    4 },
-   { o2_sensor_wrc_formula,         "O2 Sensor 4, Bank 1 (WR):",       "", "37",      1,    4 },
-   { o2_sensor_wrc_formula,         "O2 Sensor 1, Bank 2 (WR):",       "", "38",      1,    4 },
-   { o2_sensor_wrc_formula,         "O2 Sensor 2, Bank 2 (WR):",       "", "39",      1,    4 },
-   { o2_sensor_wrc_formula,         "O2 Sensor 3, Bank 2 (WR):",       "", "3A",      1,    4 },
-   { o2_sensor_wrc_formula,         "O2 Sensor 4, Bank 2 (WR):",       "", "3B",      1,    4 },
-   { mil_distance_formula,          "Distance since MIL activated:",   "", "21",      1,    2 },
-   // Page 7
-   { baro_pressure_formula,         "Barometric Pressure (absolute):", "", "33",      1,    1 },
-   { cat_temp_formula,              "CAT Temperature, B1S1:",          "", "3C",      1,    2 },
-   { cat_temp_formula,              "CAT Temperature, B2S1:",          "", "3D",      1,    2 },
-   { cat_temp_formula,              "CAT Temperature, B1S2:",          "", "3E",      1,    2 },
-   { cat_temp_formula,              "CAT Temperature, B2S2:",          "", "3F",      1,    2 },
-   { ecu_voltage_formula,           "ECU voltage:",                    "", "42",      1,    2 },
-   { abs_load_formula,              "Absolute Engine Load:",           "", "43",      1,    2 },
-   { eq_ratio_formula,              "Commanded Equivalence Ratio:",    "", "44",      1,    2 },
-   { amb_air_temp_formula,          "Ambient Air Temperature:",        "", "46",      1,    1 },  // same scaling as $0F
-   // Page 8
-   { relative_tp_formula,           "Relative Throttle Position:",     "", "45",      1,    1 },
-   { abs_tp_formula,                "Absolute Throttle Position B:",   "", "47",      1,    1 },
-   { abs_tp_formula,                "Absolute Throttle Position C:",   "", "48",      1,    1 },
-   { abs_tp_formula,                "Accelerator Pedal Position D:",   "", "49",      1,    1 },
-   { abs_tp_formula,                "Accelerator Pedal Position E:",   "", "4A",      1,    1 },
-   { abs_tp_formula,                "Accelerator Pedal Position F:",   "", "4B",      1,    1 },
-   { tac_pct_formula,               "Comm. Throttle Actuator Cntrl:",  "", "4C",      1,    1 }, // commanded TAC
-   { mil_time_formula,              "Engine running while MIL on:",    "", "4D",      1,    2 }, // minutes run by the engine while MIL activated
-   { clr_time_formula,              "Time since DTCs cleared:",        "", "4E",      1,    2 },
-   { NULL,                          "",                                "", "",        0,    0 }
-};
+static unsigned long last_refresh; // clock_us() time of the last sensor update
+
+static DIALOG *sensor_rows[SENSORS_PER_PAGE]; // sensor_proc objects in sensor_dialog, indexed by d1
+static BITMAP *value_buffer = NULL; // value cells are drawn here, then blitted to the screen
+static BATCH batches[ACQ_QUEUE_SIZE]; // requests queued with the session, each is the context of its request
+static int next_batch = 0;     // batches[] entry for the next request
+static int num_of_sensors_timed_out = 0;
+static int ignore_device_not_connected = FALSE;
+static int retry_attempts = NUM_OF_RETRIES;
+static int active_sensor_found = FALSE;
+static int last_row = -1; // last row of the previous response, rows wrap around at the end of a poll cycle
+static int poll_ret = D_O_K; // what sensor_proc() returns after the answers were handled
+static int page_id = 0; // changes every time the page is (re)filled, so answers to old requests can be dropped
+static SENSOR *sensors = NULL; // one for each PID descriptor, in the same order
+static int graph_mode = FALSE; // TRUE if the sensors are plotted by the strip chart, instead of listed
+static SENSOR *chart_sensors[CHART_CHANNELS]; // sensor plotted on each channel of the strip chart, NULL if none
+static const int chart_colors[CHART_CHANNELS] = { C_RED, C_BLUE, C_GREEN, C_PURPLE };
 
 DIALOG sensor_dialog[] =
 {
@@ -229,8 +163,10 @@ DIALOG sensor_dialog[] =
    { d_box_proc,             40,  375, 560, 32, C_BLACK, C_LIGHT_GRAY,  0,    0,      0,   0,   NULL,               NULL, NULL },
    { toggle_proc,            45,  379, 45,  24, C_BLACK, C_WHITE,       0,    D_EXIT, 8,   0,   NULL,               NULL, NULL },
    { sensor_proc,            95,  382, 504, 24, C_BLACK, C_LIGHT_GRAY,  0,    0,      8,   0,   NULL,               NULL, NULL },
-   { toggle_all_proc,        40,  420, 100, 40, C_BLACK, C_DARK_YELLOW, 'a',  D_EXIT, 0,   0,   "&All ON",          NULL, NULL },
-   { options_proc,           150, 420, 100, 40, C_BLACK, C_GREEN,       'o',  D_EXIT, 0,   0,   "&Options",         NULL, NULL },
+   { strip_chart_proc,       40,  87,  560, 320, C_BLACK, C_WHITE,      0,    D_HIDDEN, 0, 0,   NULL,               NULL, NULL },
+   { toggle_all_proc,        40,  420, 70,  40, C_BLACK, C_DARK_YELLOW, 'a',  D_EXIT, 0,   0,   "&All ON",          NULL, NULL },
+   { options_proc,           115, 420, 70,  40, C_BLACK, C_GREEN,       'o',  D_EXIT, 0,   0,   "&Options",         NULL, NULL },
+   { graph_proc,             190, 420, 65,  40, C_BLACK, C_DARK_YELLOW, 'g',  D_EXIT, 0,   0,   "&Graph",           NULL, NULL },
    { d_shadow_box_proc,      260, 420, 230, 40, C_BLACK, C_LIGHT_GRAY,  0,    0,      0,   0,   NULL,               NULL, NULL },
    { d_button_proc,          500, 420, 100, 40, C_BLACK, C_DARK_YELLOW, 'm',  D_EXIT, 0,   0,   "&Main Menu",       NULL, NULL },
    { st_ctext_proc,          300, 422, 38,  20, C_BLACK, C_TRANSP,      0,    0,      0,   0,   "Page",             NULL, NULL },
@@ -241,20 +177,20 @@ DIALOG sensor_dialog[] =
 };
 
 
-void inc_refresh_time(void)
-{
-   refresh_time++;
-}
-END_OF_FUNCTION(inc_refresh_time);
-
-
 int display_sensor_dialog(int reset)
 {
    int i;
    int ret;
    
-   for (i = 0; sensors[i].formula; i++);
-   num_of_sensors = i;
+   num_of_sensors = get_num_of_pid_descriptors();
+   if (!(sensors = (SENSOR *)calloc(num_of_sensors, sizeof(SENSOR))))
+      fatal_error("Could not allocate enough memory for sensors");
+   for (i = 0; i < num_of_sensors; i++)
+   {
+      sensors[i].desc = &pid_descriptors[i];
+      sensors[i].rate = pid_descriptors[i].rate;
+      sensors[i].chart_channel = -1;
+   }
    
    current_page = 0;
    if (reset)
@@ -262,31 +198,41 @@ int display_sensor_dialog(int reset)
    
    load_sensor_states();
    fill_sensors(0);
+   set_graph_mode(FALSE);
+
+   for (i = 0; sensor_dialog[i].proc != sensor_proc; i++);
+   if (!(value_buffer = create_bitmap(sensor_dialog[i].w - SENSOR_LABEL_MARGIN, sensor_dialog[i].h)))
+      fatal_error("Could not allocate enough memory for sensor values");
 
-   LOCK_VARIABLE(refresh_time);
-   LOCK_FUNCTION(inc_refresh_time);
+   session_start();
    
    ret = do_dialog(sensor_dialog, -1);
+   session_stop();
    save_sensor_states();
 
+   destroy_bitmap(value_buffer);
+   value_buffer = NULL;
+   free(sensors);
+   sensors = NULL;
+
    return ret;
 }
 
 
-static void calculate_refresh_rate(int sensor_state)
+static void calculate_refresh_rate(int sensor_state, int num_of_samples)
 {	
 	static int initialization_occured = FALSE;
    static int num_of_sensors_off = 0;
    static int reset_on_all_off_occured = FALSE;
    static int sensors_on_counter = 0;
    static float avg_refresh_rate_accumulator = 0;
+   unsigned long now;
    
  	if (!initialization_occured) // we received our first ">", initialize...
 	{
  		if (sensor_state == SENSOR_ACTIVE) // if we received HEX data
  		{
-      	refresh_time = 0; // reset the time
-     		install_int(inc_refresh_time, REFRESH_RATE_PRECISION); // install handler
+      	last_refresh = clock_us(); // reset the time
          initialization_occured = TRUE;
       }
   	}
@@ -297,19 +243,20 @@ static void calculate_refresh_rate(int sensor_state)
     		inst_refresh_rate = -1;
      		avg_refresh_rate = -1;
      		reset_on_all_off_occured = TRUE;
-     		broadcast_dialog_message(MSG_REFRESH, 0);
    	}
       else  // if num_of_sensors_off < sensors_on_page
       {
          if (sensor_state != SENSOR_OFF)
          {
             reset_on_all_off_occured = FALSE;
-            inst_refresh_rate = 1/(refresh_time*REFRESH_RATE_PRECISION*0.001);
+            // one response may carry several sensors (multi-PID requests)
+            now = clock_us();
+            inst_refresh_rate = num_of_samples/(MAX(now - last_refresh, 1)*0.000001);
 
             if (sensors_on_counter < (sensors_on_page - num_of_disabled_sensors))
             {
-               sensors_on_counter++;
-               avg_refresh_rate_accumulator += inst_refresh_rate;
+               sensors_on_counter += num_of_samples;
+               avg_refresh_rate_accumulator += inst_refresh_rate*num_of_samples;
             }
             else
             {
@@ -319,8 +266,7 @@ static void calculate_refresh_rate(int sensor_state)
             }
 
             if (sensor_state == SENSOR_ACTIVE) // if we got response from ECU
-               refresh_time = 0; // reset time
-            broadcast_dialog_message(MSG_REFRESH, 0);
+               last_refresh = now; // reset time
          }
       }
    }
@@ -352,7 +298,9 @@ int options_proc(int msg, DIALOG *d, int c)
    if (ret == D_CLOSE)
    {
       old_port = comport.number;
+      session_pause();
       display_options();
+      session_resume();
       if (comport.number != old_port)
          reset_hardware = TRUE;
       ret = D_REDRAWME;
@@ -362,6 +310,30 @@ int options_proc(int msg, DIALOG *d, int c)
 }
 
 
+int graph_proc(int msg, DIALOG *d, int c)
+{
+   int ret;
+
+   if (msg == MSG_START)
+   {
+      d->dp = "&Graph";
+      d->key = 'g';
+   }
+
+   ret = d_button_proc(msg, d, c);
+
+   if (ret == D_CLOSE)
+   {
+      set_graph_mode(!graph_mode);
+      d->dp = (graph_mode) ? "&Values" : "&Graph";
+      d->key = (graph_mode) ? 'v' : 'g';
+      ret = D_REDRAW;
+   }
+
+   return ret;
+}
+
+
 int page_updn_handler_proc(int msg, DIALOG *d, int c)
 {
    if ((msg == MSG_XCHAR) && ((c>>8) == KEY_PGUP || (c>>8) == KEY_PGDN))
@@ -380,6 +352,8 @@ int page_updn_handler_proc(int msg, DIALOG *d, int c)
 
 int inst_refresh_rate_proc(int msg, DIALOG *d, int c)
 {
+   char buf[64];
+
 	switch (msg)
    {
       case MSG_START:
@@ -390,10 +364,14 @@ int inst_refresh_rate_proc(int msg, DIALOG *d, int c)
       case MSG_REFRESH:
       case MSG_UPDATE:
          if (inst_refresh_rate >= 0)
-      	  sprintf(d->dp, "Instantaneous: %.2fHz", inst_refresh_rate);
+      	  sprintf(buf, "Instantaneous: %.2fHz", inst_refresh_rate);
          else
-            sprintf(d->dp, "Instantaneous: N/A");
-         d->flags |= D_DIRTY;
+            sprintf(buf, "Instantaneous: N/A");
+         if (strcmp(buf, d->dp) != 0)  // repaint only if the text changed
+         {
+            strcpy(d->dp, buf);
+            d->flags |= D_DIRTY;
+         }
          break;
 
       case MSG_DRAW:
@@ -412,6 +390,8 @@ int inst_refresh_rate_proc(int msg, DIALOG *d, int c)
 
 int avg_refresh_rate_proc(int msg, DIALOG *d, int c)
 {
+   char buf[64];
+
 	switch (msg)
    {
       case MSG_START:
@@ -422,10 +402,14 @@ int avg_refresh_rate_proc(int msg, DIALOG *d, int c)
       case MSG_REFRESH:
       case MSG_UPDATE:
          if (avg_refresh_rate >= 0)
-      	  sprintf(d->dp, "Average: %.2fHz", avg_refresh_rate);
+      	  sprintf(buf, "Average: %.2fHz", avg_refresh_rate);
          else
-            sprintf(d->dp, "Average: N/A");
-         d->flags |= D_DIRTY;
+            sprintf(buf, "Average: N/A");
+         if (strcmp(buf, d->dp) != 0)  // repaint only if the text changed
+         {
+            strcpy(d->dp, buf);
+            d->flags |= D_DIRTY;
+         }
          break;
 
       case MSG_DRAW:
@@ -447,10 +431,12 @@ void load_sensor_states()
    int i;
    char temp_buf[64];
    
-   for (i = 0; sensors[i].formula; i++)
+   for (i = 0; i < num_of_sensors; i++)
    {
       sprintf(temp_buf, "sensor%i", i);
       sensors[i].enabled = get_config_int("sensors", temp_buf, TRUE);
+      sprintf(temp_buf, "sensor%i_rate", i);
+      sensors[i].rate = get_config_int("sensors", temp_buf, sensors[i].rate);
    }
 }
 
@@ -460,10 +446,12 @@ void save_sensor_states()
    int i;
    char temp_buf[64];
    
-   for (i = 0; sensors[i].formula; i++)
+   for (i = 0; i < num_of_sensors; i++)
    {
       sprintf(temp_buf, "sensor%i", i);
       set_config_int("sensors", temp_buf, sensors[i].enabled);
+      sprintf(temp_buf, "sensor%i_rate", i);
+      set_config_int("sensors", temp_buf, sensors[i].rate);
    }
 }
 /* ---- TO HERE ---- */
@@ -477,9 +465,11 @@ void fill_sensors(int page_number)
    {
       if (sensor_dialog[i].proc == sensor_proc)
       {
-         if (sensors[index + page_number * SENSORS_PER_PAGE].formula)
+         sensor_rows[sensor_dialog[i].d1] = &sensor_dialog[i];
+         if (index + page_number * SENSORS_PER_PAGE < num_of_sensors)
          {
             strcpy(sensors[index + page_number * SENSORS_PER_PAGE].screen_buf, "N/A");
+            sensors[index + page_number * SENSORS_PER_PAGE].next_poll = clock_ms();
             sensor_dialog[i].dp3 = &sensors[index + page_number * SENSORS_PER_PAGE];
             index++;
          }
@@ -563,6 +553,8 @@ int page_flipper_proc(int msg, DIALOG *d, int c)
          current_page = last_page;
          
       fill_sensors(current_page);
+      if (graph_mode)
+         select_chart_channels();
       inst_refresh_rate = -1;
       avg_refresh_rate = -1;
       broadcast_dialog_message(MSG_UPDATE, 0);
@@ -785,33 +777,20 @@ int status_proc(int msg, DIALOG *d, int c)
    return d_text_proc(msg, d, c);
 }
 
-
-#define SENSOR_LABEL_MARGIN   245
-#define SENSOR_VALUE_INDENT   8
-
 int sensor_proc(int msg, DIALOG *d, int c)
 {
-   static int current_sensor = 0; // sensor we're working on
-   static int new_page = FALSE;
-   static int receiving_response = FALSE; // flag: receiving or sending
-   static int num_of_sensors_timed_out = 0;
-   static int ignore_device_not_connected = FALSE;
-   static int retry_attempts = NUM_OF_RETRIES;
-   static int active_sensor_found = FALSE;
-   static char vehicle_response[1024];
-   char buf[256];
-   char cmd[8];
-   int response_status = EMPTY; //status of the response: EMPTY, DATA, PROMPT
-   int response_type;
-   int ret = 0;
+   static int current_sensor = 0; // first sensor of the next request
+   static char request[16]; // "01" + up to MAX_PIDS_PER_REQUEST PIDs + response count
+   static unsigned long next_frame = 0; // clock_ms() time when changed values may be painted again
+   BATCH *batch;
+   int next_sensor;
    SENSOR *sensor = (SENSOR *)d->dp3; // create a pointer to SENSOR structure in dp3 (vm)
 
    if ((msg == MSG_IDLE) && reset_hardware && comport.status == READY) // if user hit "Reset Chip" button, and we're doing nothing
    {
       reset_hardware = FALSE;	 
-      receiving_response = FALSE;
          
-      reset_chip();
+      reset_chip();  // the requests in the queue are thrown away
       return D_O_K;
    }
 
@@ -823,8 +802,6 @@ int sensor_proc(int msg, DIALOG *d, int c)
       case MSG_START:
          if (d->d1 == 0)
          {
-            stop_serial_timer();
-            receiving_response = FALSE;
             device_connected = FALSE;
             ignore_device_not_connected = FALSE;
             num_of_disabled_sensors = 0;
@@ -839,20 +816,19 @@ int sensor_proc(int msg, DIALOG *d, int c)
             current_sensor = 0;
             num_of_sensors_timed_out = 0;
             active_sensor_found = FALSE;
-            new_page = TRUE;
+            page_id++;  // requests that are still in the pipeline belong to the old page
             // page was flipped, reset refresh rate variables
             inst_refresh_rate = 0;
             avg_refresh_rate = 0;
-            refresh_time = 0;
+            last_refresh = clock_us();
          }
+         sensor->ecu = -1;
          if ((sensor->enabled && d->flags & D_DISABLED) || (!sensor->enabled && !(d->flags & D_DISABLED)))
             d->d2 = 1;
          d->flags |= D_DIRTY;
          break;
 
       case MSG_END:
-         if (d->d1 == sensors_on_page - 1)
-            stop_serial_timer();
          d->dp3 = NULL;
          break;
    
@@ -872,11 +848,6 @@ int sensor_proc(int msg, DIALOG *d, int c)
                sensor->enabled = FALSE;
                num_of_disabled_sensors++;
                strcpy(sensor->screen_buf, "not monitoring");
-               if (d->d1 == current_sensor)
-               {
-                  receiving_response = FALSE;
-                  stop_serial_timer();
-               }
                if (num_of_disabled_sensors == sensors_on_page) // if all of the sensors are disabled
                   num_of_sensors_timed_out = 0; // reset timeout counter
             }
@@ -891,157 +862,63 @@ int sensor_proc(int msg, DIALOG *d, int c)
             d->d2 = 0;
             broadcast_dialog_message(MSG_TOGGLE, d->d1);
          }
+         if (graph_mode)  // the strip chart is drawn over the sensor rows
+            return D_O_K;
          rectfill(screen, d->x, d->y, d->x+d->w-1, d->y+d->h-1, d->bg);  // clear the element
          if (sensor)
          {
-            gui_textout_ex(screen, sensor->label, d->x + SENSOR_LABEL_MARGIN - gui_strlen(sensor->label), d->y, d->fg, d->bg, FALSE);
+            if (sensor->text_stale)
+            {
+               sensor->text_stale = FALSE;
+               format_pid_value(sensor->desc, sensor->raw_data, sensor->screen_buf);
+            }
+            gui_textout_ex(screen, sensor->desc->label, d->x + SENSOR_LABEL_MARGIN - gui_strlen(sensor->desc->label), d->y, d->fg, d->bg, FALSE);
             gui_textout_ex(screen, sensor->screen_buf, d->x + SENSOR_LABEL_MARGIN + SENSOR_VALUE_INDENT, d->y, ((d->flags & D_DISABLED) ? gui_mg_color : d->fg), d->bg, FALSE);
+            sensor->value_dirty = FALSE;
          }
          return D_O_K;
 
       case MSG_IDLE:
-         if (d->d1 == current_sensor)
+         // the first row does the polling for the whole page
+         if ((d->d1 != 0) || (comport.status != READY))
+            break;
+
+         poll_ret = D_O_K;
+         session_tick();  // sensor_response() is called with the answers
+
+         // keep the session busy, so the bus doesn't sit idle while we paint
+         while ((comport.status == READY) && (session_pending() < PIPELINE_DEPTH))
          {
-            if (comport.status == READY)
+            batch = &batches[next_batch];
+            next_sensor = build_sensor_request(current_sensor, request, batch);
+            if (next_sensor >= sensors_on_page)
+               next_sensor = 0;
+            current_sensor = next_sensor;
+
+            if (batch->size == 0) // none of the remaining sensors are enabled, supported by the vehicle, or due
             {
-               if (d->flags & D_DISABLED)
-                  calculate_refresh_rate(SENSOR_OFF); // calculate instantaneous/average refresh rates
-
-               if (!receiving_response)
-               {
-                  if (d->flags & D_DISABLED) // if the sensor is disabled
-                  {
-                     current_sensor = (current_sensor == sensors_on_page - 1) ? 0 : current_sensor + 1; // go to the next sensor
-                     return D_O_K;
-                  }
-
-                  sprintf(cmd, "01%s", sensor->pid);
-                  send_command(cmd); // send command for that particular sensor
-                  new_page = FALSE;
-                  receiving_response = TRUE; // now we're waiting for response
-                  start_serial_timer(OBD_REQUEST_TIMEOUT); // start the timer
-                  vehicle_response[0] = '\0'; // clear string
-               }
-               else  // if we are receiving response
-               {
-                  response_status = read_comport(buf);  // read comport
-                  
-                  if (d->flags & D_DISABLED) // if the sensor is disabled
-                  {
-                     current_sensor = (current_sensor == sensors_on_page - 1) ? 0 : current_sensor + 1; // go to the next sensor
-                     return D_O_K;
-                  }
-                  
-                  if (response_status == DATA) // if data detected in com port buffer
-                  {
-                     strcat(vehicle_response, buf); // append contents of buf to vehicle_response
-                  }
-                  else if (response_status == PROMPT) // if '>' detected
-                  {
-                     device_connected = TRUE;
-                     num_of_sensors_timed_out = 0;
-                     receiving_response = FALSE; // we're not waiting for response any more
-                     stop_serial_timer();
-
-                     if (new_page)
-                        break;
-                     
-                     strcat(vehicle_response, buf); // append contents of buf to vehicle_response
-                     sprintf(cmd, "01%s", sensor->pid);
-                     response_type = process_response(cmd, vehicle_response);
-
-                     if (response_type == HEX_DATA)  // HEX_DATA received
-                     {
-                        sprintf(cmd, "41%s", sensor->pid);
-                        if (find_valid_response(buf, vehicle_response, cmd, NULL))
-                        {
-                           active_sensor_found = TRUE;
-                           calculate_refresh_rate(SENSOR_ACTIVE); // calculate instantaneous/average refresh rates
-                           buf[4 + sensor->bytes * 2] = 0;  // solves problem where response is padded with zeroes (i.e., '41 05 7C 00 00 00')
-                           sensor->formula((int)strtol(buf + 4, NULL, 16), buf); //plug the value into formula
-                           strcpy(sensor->screen_buf, buf);  // and copy result in screen buffer
-                           /* if current_sensor is the last sensor, set it to 0; otherwise current_sensor++ */
-                           current_sensor = (current_sensor == sensors_on_page - 1) ? 0 : current_sensor + 1;
-                           retry_attempts = NUM_OF_RETRIES;
-
-                           return D_REDRAWME;
-                        }
-                        else
-                           response_type = ERR_NO_DATA;
-                     }
-                     
-                     strcpy(sensor->screen_buf, "N/A");
-
-                     if (active_sensor_found)
-                        calculate_refresh_rate(SENSOR_NA); // calculate instantaneous/average refresh rates
-
-                     if (response_type == ERR_NO_DATA) // if we received "NO DATA", "N/A" will be printed
-                     {
-                        current_sensor = (current_sensor == sensors_on_page - 1) ? 0 : current_sensor + 1; // next time poll next sensor
-                        retry_attempts = NUM_OF_RETRIES;
-                     }
-                     else if (response_type == BUS_ERROR || response_type == UNABLE_TO_CONNECT || response_type == BUS_INIT_ERROR)
-                     {
-                        display_error_message(response_type, FALSE);
-                        retry_attempts = NUM_OF_RETRIES;
-                     }
-                     // for other errors, try to re-send the request, do nothing if successful and alert user if failed
-                     else
-                     {
-                        if (retry_attempts > 0)
-                        {
-                           retry_attempts--;
-                           return D_O_K;
-                        }
-                        else
-                        {
-                           display_error_message(response_type, FALSE);
-                           retry_attempts = NUM_OF_RETRIES; // reset the number of retry attempts
-                        }
-                     }
-
-                     return D_REDRAWME; //tell the parent control to redraw itself
-                  }
-                  else if (serial_time_out) // if timeout occured,
-                  {
-                     receiving_response = FALSE; // we're not waiting for a response any more
-                     strcpy(sensor->screen_buf, "N/A");
-
-                     if (num_of_sensors_timed_out >= SENSORS_TO_TIME_OUT)
-                     {
-                        num_of_sensors_timed_out = 0;
-                        device_connected = FALSE;
-                        if  (!ignore_device_not_connected)
-                        {
-                           ret = alert3("Device is not responding.", "Please check that it is connected", "and the port settings are correct", "&OK", "&Configure Port", "&Ignore", 'o', 'c', 'i');
-                           if (ret == 2)
-                              display_options();   // let the user choose correct settings
-                           else if (ret == 3)
-                              ignore_device_not_connected = TRUE;
-                        }
-                     }
-                     else
-                        num_of_sensors_timed_out++;
-
-                     while (comport.status == NOT_OPEN)
-                     {
-                        if (alert("Port is not ready.", "Please check that you specified the correct port", "and that no other application is using it", "&Configure Port", "&Ignore", 'c', 'i') == 1)
-                           display_options(); // let the user choose correct settings
-                        else
-                           comport.status = USER_IGNORED;
-                     }
-
-                     stop_serial_timer();
-
-                     /* if current_sensor is the last sensor, set it to 0; otherwise current_sensor++ */
-                     current_sensor = (current_sensor == sensors_on_page - 1) ? 0 : current_sensor + 1;
-
-                     return D_REDRAWME;
-                  }
-               }
+               calculate_refresh_rate(SENSOR_OFF, 0);
+               break;
             }
+
+            batch->page_id = page_id;
+            if (!session_request(request, 0, 0, sensor_response, batch))
+               break;
+            next_batch = (next_batch + 1) % ACQ_QUEUE_SIZE;
          }
-         break;
+
+         // values that changed are painted together, no more often than MAX_FRAME_RATE
+         if (DEADLINE_PASSED(next_frame))
+         {
+            next_frame = clock_ms() + 1000/MAX_FRAME_RATE;
+            if (graph_mode)
+               feed_chart();
+            else
+               paint_sensor_values();
+            broadcast_dialog_message(MSG_REFRESH, 0);  // refresh rates
+         }
+
+         return poll_ret;
    } // end of switch (msg)
 
    if (d->flags & D_DISABLED)
@@ -1053,428 +930,458 @@ int sensor_proc(int msg, DIALOG *d, int c)
 }
 
 
-void engine_rpm_formula(int data, char *buf)
-{
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i r/min", (int)((float)data/4));
-   else   // if the system is IMPERIAL
-      sprintf(buf, "%i rpm", (int)((float)data/4));
-}
-
-
-void engine_load_formula(int data, char *buf)
+/* sensor_response:
+ *  Called from session_tick() with the answer to a request of sensor_proc(),
+ *  context is its batch.  Timeouts and errors are counted, and the user is
+ *  alerted if there's too many of them; other requests are retried.
+ */
+void sensor_response(ACQ_TRANSACTION *transaction, void *context)
 {
-   sprintf(buf, "%.1f%%", (float)data*100/255);
-}
+   BATCH *batch = (BATCH *)context;
+   int response_type = transaction->response_type;
+   int program_timing = FALSE;
+   int num_of_samples;
 
+   // samples of a poll cycle are published and logged together, when the next cycle starts
+   if (batch->size > 0 && batch->rows[0] <= last_row)
+   {
+      publisher_flush();
+      log_sensor_values();
+   }
+   last_row = (batch->size > 0) ? batch->rows[batch->size - 1] : -1;
 
-void coolant_temp_formula(int data, char *buf)
-{
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i%c C", data-40, 0xB0);
-   else   // if the system is IMPERIAL
-      sprintf(buf, "%i%c F", (int)(((float)data-40)*9/5 + 32), 0xB0);
-}
+   if (batch->page_id != page_id)  // the page was flipped since the request was made
+      ;
+   else if (response_type == ACQ_TIMED_OUT) // if timeout occured,
+   {
+      set_batch_text(batch, "N/A");
 
+      if (num_of_sensors_timed_out >= SENSORS_TO_TIME_OUT)
+      {
+         num_of_sensors_timed_out = 0;
+         device_connected = FALSE;
+         if  (!ignore_device_not_connected)
+         {
+            poll_ret = alert3("Device is not responding.", "Please check that it is connected", "and the port settings are correct", "&OK", "&Configure Port", "&Ignore", 'o', 'c', 'i');
+            if (poll_ret == 2)
+            {
+               session_pause();
+               display_options();   // let the user choose correct settings
+               session_resume();
+            }
+            else if (poll_ret == 3)
+               ignore_device_not_connected = TRUE;
+         }
+      }
+      else
+         num_of_sensors_timed_out++;
 
-void fuel_system_status_formula(int data, char *buf)
-{
-   if (data == 0)
-   	sprintf(buf, "unused");
-   else if (data == 0x01)
-      sprintf(buf, "open loop");
-   else if (data == 0x02)
-      sprintf(buf, "closed loop");
-   else if (data == 0x04)
-      sprintf(buf, "open loop (driving conditions)");
-   else if (data == 0x08)
-      sprintf(buf, "open loop (system fault)");
-   else if (data == 0x10)
-      sprintf(buf, "closed loop, O2 sensor fault");
+      while (comport.status == NOT_OPEN)
+      {
+         if (alert("Port is not ready.", "Please check that you specified the correct port", "and that no other application is using it", "&Configure Port", "&Ignore", 'c', 'i') == 1)
+         {
+            session_pause();
+            display_options(); // let the user choose correct settings
+            session_resume();
+         }
+         else
+            comport.status = USER_IGNORED;
+      }
+   }
    else
-      sprintf(buf, "unknown: 0x%02X", data);
-}
-
-
-void fuel_system1_status_formula(int data, char *buf)
-{
-   fuel_system_status_formula((data >> 8) & 0xFF, buf);  // Fuel System 1 status: Data A
-}
-
+   {
+      device_connected = TRUE;
+      num_of_sensors_timed_out = 0;
 
-void fuel_system2_status_formula(int data, char *buf)
-{
-   fuel_system_status_formula(data & 0xFF, buf);  // Fuel System 2 status: Data B
-}
+      if (response_type == HEX_DATA)  // HEX_DATA received
+      {
+         if ((num_of_samples = handle_sensor_response(batch, transaction->cmd, transaction->response.data, &transaction->lines)) > 0)
+         {
+            active_sensor_found = TRUE;
+            calculate_refresh_rate(SENSOR_ACTIVE, num_of_samples); // calculate instantaneous/average refresh rates
+            retry_attempts = NUM_OF_RETRIES;
+            program_timing = learn_response_time(transaction->latency);
+         }
+         else
+            response_type = ERR_NO_DATA;
+      }
 
+      if (response_type != HEX_DATA)
+      {
+         set_batch_text(batch, "N/A");
 
-void vehicle_speed_formula(int data, char *buf)
-{
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i km/h", data);
-   else   // if the system is IMPERIAL
-      sprintf(buf, "%i mph", (int)(data/1.609));
-}
+         if (active_sensor_found)
+            calculate_refresh_rate(SENSOR_NA, 1); // calculate instantaneous/average refresh rates
 
+         if (response_type == ERR_NO_DATA) // if we received "NO DATA", "N/A" will be printed
+            retry_attempts = NUM_OF_RETRIES;
+         else if (response_type == BUS_ERROR || response_type == UNABLE_TO_CONNECT || response_type == BUS_INIT_ERROR)
+         {
+            display_error_message(response_type, FALSE);
+            retry_attempts = NUM_OF_RETRIES;
+         }
+         // for other errors, try to re-send the request, do nothing if successful and alert user if failed
+         else if (retry_attempts > 0)
+         {
+            retry_attempts--;
+            batches[next_batch] = *batch;
+            if (session_request(transaction->cmd, 0, 0, sensor_response, &batches[next_batch]))
+               next_batch = (next_batch + 1) % ACQ_QUEUE_SIZE;
+         }
+         else
+         {
+            display_error_message(response_type, FALSE);
+            retry_attempts = NUM_OF_RETRIES; // reset the number of retry attempts
+         }
+      }
+   }
 
-void intake_pressure_formula(int data, char *buf)
-{
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i kPa", data);
-   else
-      sprintf(buf, "%.1f inHg", data/3.386389);
+   if (program_timing)  // we know how fast the ECUs are, tune the interface timeout for them
+   {
+      session_pause();
+      if (program_adapter_timing())
+         save_vehicle_profile();  // remember the response time, if we know the VIN
+      session_resume();
+   }
 }
 
 
-void timing_advance_formula(int data, char *buf)
+/* build_sensor_request:
+ *  Packs the enabled sensors on current page, beginning with first_row, into a
+ *  single mode 01 request.  On CAN, ELM327 takes up to MAX_PIDS_PER_REQUEST PIDs
+ *  per request; ELM320/322/323 and the other protocols get one PID at a time.
+ *  PIDs the vehicle does not support are skipped, and so are the sensors with
+ *  a target rate which are not due yet; this leaves the bus to the sensors
+ *  that are polled as fast as possible.  The number of ECUs that answer is
+ *  appended, if known (see add_response_count()).  Rows in the request are
+ *  stored in batch.  Returns the row after the last one that was looked at.
+ */
+int build_sensor_request(int first_row, char *cmd, BATCH *batch)
 {
-   sprintf(buf, "%.1f%c", ((float)data-128)/2, 0xB0);
-}
+   int max_pids = (is_can_protocol()) ? MAX_PIDS_PER_REQUEST : 1;
+   int num_of_pids = 0;
+   int row, i;
+   SENSOR *sensor;
 
+   strcpy(cmd, "01");
+   batch->size = 0;
 
-void intake_air_temp_formula(int data, char *buf)
-{
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i%c C", data-40, 0xB0);
-   else   // if the system is IMPERIAL
-      sprintf(buf, "%i%c F", (int)(((float)data-40)*9/5 + 32), 0xB0);
-}
+   for (row = first_row; row < sensors_on_page; row++)
+   {
+      sensor = (SENSOR *)sensor_rows[row]->dp3;
+      if (!sensor || !sensor->enabled || !is_pid_supported((int)strtol(sensor->desc->pid, NULL, 16)))
+         continue;
+      if ((sensor->rate > 0) && !DEADLINE_PASSED(sensor->next_poll))  // polled recently enough
+         continue;
+      if (graph_mode && sensor->chart_channel < 0)  // the bus is left to the plotted sensors
+         continue;
+
+      // several sensors may share one PID (i.e., fuel system 1 & 2 status)
+      for (i = 0; i < batch->size; i++)
+         if (strcmp(((SENSOR *)sensor_rows[batch->rows[i]]->dp3)->desc->pid, sensor->desc->pid) == 0)
+            break;
+
+      if (i == batch->size)  // this PID is not in the request yet
+      {
+         if (num_of_pids == max_pids)
+            break;
+         strcat(cmd, sensor->desc->pid);
+         num_of_pids++;
+      }
+      batch->rows[batch->size++] = row;
+      if (sensor->rate > 0)
+         sensor->next_poll = clock_ms() + 1000/sensor->rate;
+   }
 
+   if (batch->size > 0)
+      add_response_count(cmd);
 
-void air_flow_rate_formula(int data, char *buf)
-{
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%.2f g/s", data*0.01);
-   else
-      sprintf(buf, "%.1f lb/min", data*0.0013227736);
+   return row;
 }
 
 
-void throttle_position_formula(int data, char *buf)
+/* decode_pid_data:
+ *  msg is a single mode 01 message answering request: "41" followed by one or
+ *  more PID/data pairs.
+ *  Data bytes are decoded into a sample for all sensors in the batch that asked
+ *  for that PID.  If the ECU is known (headers on), a sensor sticks with the
+ *  first ECU that answered it.  Returns number of sensors updated.
+ */
+int decode_pid_data(BATCH *batch, const char *request, const char *msg, long ecu, int *updated)
 {
-   sprintf(buf, "%.1f%%", (float)data*100/255);
-}
+   PID_DATA pid_data[MAX_PIDS_PER_MESSAGE];
+   int num_of_pids = split_pid_data(msg, request, pid_data, MAX_PIDS_PER_MESSAGE);
+   int num_of_samples = 0;
+   int i, j;
+   SENSOR *sensor;
 
+   for (j = 0; j < num_of_pids; j++)
+   {
+      for (i = 0; i < batch->size; i++)
+      {
+         sensor = (SENSOR *)sensor_rows[batch->rows[i]]->dp3;
+         if (strtol(sensor->desc->pid, NULL, 16) != pid_data[j].pid)
+            continue;
 
-// **** New formulae added 3/11/2003: ****
-
-// Fuel Pressure (guage): PID 0A
-void fuel_pressure_formula(int data, char *buf)
-{
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i kPa", data*3);
-   else   // if the system is IMPERIAL
-      sprintf(buf, "%.1f psi", data*3*0.145037738);
-}
-
+         if (ecu >= 0 && sensor->ecu >= 0 && ecu != sensor->ecu)  // another ECU's copy of the data
+            continue;
 
-// Fuel Trim statuses: PID 06-09
-void short_term_fuel_trim_formula(int data, char *buf)
-{
-   if (data > 0xFF)  // we're only showing bank 1 and 2 FT
-      data >>= 8;
+         // first response wins, ignore duplicate data from other ECUs
+         if (!updated[i] && sensor->enabled)
+         {
+            sensor->ecu = ecu;
+            add_sample(sensor, pid_data[j].data);
+            updated[i] = TRUE;
+            num_of_samples++;
+         }
+      }
+   }
 
-   sprintf(buf, (data == 128) ? "0.0%%" : "%+.1f%%", ((float)data - 128)*100/128);
+   return num_of_samples;
 }
 
 
-void long_term_fuel_trim_formula(int data, char *buf)
+/* handle_sensor_response:
+ *  Splits the response to a (multi-PID) request and distributes the data to the
+ *  sensors in the batch.  Sensors that did not get any data are set to "N/A".
+ *  Returns number of sensors updated.
+ */
+int handle_sensor_response(BATCH *batch, const char *request, char *vehicle_response, const RESPONSE_INDEX *index)
 {
-   if (data > 0xFF)  // we're only showing bank 1 and 2 FT
-      data >>= 8;
-
-   sprintf(buf, (data == 128) ? "0.0%%" : "%+.1f%%", ((float)data - 128)*100/128);
-}
+   MESSAGE_READER reader;
+   const char *message;
+   char buf[256];
+   int updated[SENSORS_PER_PAGE];
+   int num_of_samples = 0;
+   long ecu;
+   int i;
 
+   for (i = 0; i < batch->size; i++)
+      updated[i] = FALSE;
 
-// Commanded secondary air status: PID 12
-void secondary_air_status_formula(int data, char *buf)
-{
-   data = data & 0x0700; // mask bits 0, 1, and 2
-
-   if (data == 0x0100)
-      sprintf(buf, "upstream of 1st cat. conv.");
-   else if (data == 0x0200)
-      sprintf(buf, "downstream of 1st cat. conv.");
-   else if (data == 0x0400)
-      sprintf(buf, "atmosphere / off");
-   else
-      sprintf(buf, "Not supported");
-}
+   start_message_reader(&reader);
+   while ((message = next_message(&reader, buf, sizeof(buf), vehicle_response, index, &ecu)))
+      num_of_samples += decode_pid_data(batch, request, message, ecu, updated);
 
-// Oxygen sensor voltages & short term fuel trims: PID 14-1B
-// Format is bankX_sensor
+   for (i = 0; i < batch->size; i++)
+   {
+      if (!updated[i] && ((SENSOR *)sensor_rows[batch->rows[i]]->dp3)->enabled)
+         set_sensor_text((SENSOR *)sensor_rows[batch->rows[i]]->dp3, "N/A");
+   }
 
-void o2_sensor_formula(int data, char *buf)
-{
-   if ((data & 0xFF) == 0xFF)  // if the sensor is not used in fuel trim calculation,
-      sprintf(buf, "%.3f V", (data >> 8)*0.005);
-   else
-      sprintf(buf, ((data & 0xFF) == 128) ? "%.3f V @ 0.0%% s.t. fuel trim" : "%.3f V @ %+.1f%% s.t. fuel trim", (data >> 8)*0.005, ((float)(data & 0xFF) - 128)*100/128);
+   return num_of_samples;
 }
 
 
-//Power Take-Off Status: PID 1E
-void pto_status_formula(int data, char *buf)
+void set_batch_text(BATCH *batch, const char *text)
 {
- 	if ((data & 0x01) == 0x01)
-		sprintf(buf, "active");
-	else
- 		sprintf(buf, "not active");	
-}
+   SENSOR *sensor;
+   int i;
 
-// OBD requirement to which vehicle is designed: PID 1C
-void obd_requirements_formula(int data, char *buf)
-{
-	switch (data)
-	{
-		case 0x01:
-			sprintf(buf, "OBD-II (California ARB)");
-			break;
-		case 0x02:
-			sprintf(buf, "OBD (Federal EPA)");
-			break;
-		case 0x03:
-			sprintf(buf, "OBD and OBD-II");
-			break;
-		case 0x04:
-			sprintf(buf, "OBD-I");
-			break;
-		case 0x05:
-			sprintf(buf, "Not OBD compliant");
-			break;
-		case 0x06:
-			sprintf(buf, "EOBD (Europe)");
-			break;
-		case 0x07:
-			sprintf(buf, "EOBD and OBD-II");
-			break;
-		case 0x08:
-			sprintf(buf, "EOBD and OBD");
-			break;
-		case 0x09:
-			sprintf(buf, "EOBD, OBD and OBD-II");
-			break;
-		case 0x0A:
-			sprintf(buf, "JOBD (Japan)");
-			break;
-		case 0x0B:
-			sprintf(buf, "JOBD and OBD-II");
-			break;
-		case 0x0C:
-			sprintf(buf, "JOBD and EOBD");
-			break;
-		case 0x0D:
-			sprintf(buf, "JOBD, EOBD, and OBD-II");
-			break;
-		default:
-			sprintf(buf, "Unknown: 0x%02X", data);
+   for (i = 0; i < batch->size; i++)
+   {
+      sensor = (SENSOR *)sensor_rows[batch->rows[i]]->dp3;
+      if (sensor && sensor->enabled)
+         set_sensor_text(sensor, text);
    }
 }
 
-/* Sensors added 1/2/2003: */
 
-void engine_run_time_formula(int data, char *buf)
+// the value is repainted with the next frame, if the text is different
+void set_sensor_text(SENSOR *sensor, const char *text)
 {
-   int sec, min, hrs;
-   
-   hrs = data / 3600;  // get hours
-   min = (data % 3600) / 60;  // get minutes
-   sec = data % 60;  // get seconds
-
-   sprintf(buf, "%02i:%02i:%02i", hrs, min, sec);
-}
-
-
-void mil_distance_formula(int data, char *buf)
-{
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i km", data);
-   else   // if the system is IMPERIAL
-      sprintf(buf, "%i miles", (int)(data/1.609));
-}
-
-
-void frp_relative_formula(int data, char *buf)
-{
-   float kpa, psi;
-   
-   kpa = data*0.079;
-   psi = kpa*0.145037738;
-
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%.3f kPa", kpa);
-   else   // if the system is IMPERIAL
-      sprintf(buf, "%.1f PSI", psi);
+   sensor->text_stale = FALSE;
+   if (strcmp(sensor->screen_buf, text) != 0)
+   {
+      strcpy(sensor->screen_buf, text);
+      sensor->value_dirty = TRUE;
+   }
 }
 
 
-void frp_widerange_formula(int data, char *buf)
+/* add_sample:
+ *  Decodes the data bytes into a number, in metric units, and adds it to the
+ *  history of the sensor.  The text is not formatted until the value is
+ *  painted, so samples that arrive faster than the frame rate cost no
+ *  formatting at all.
+ */
+void add_sample(SENSOR *sensor, unsigned long raw_data)
 {
-   int kpa;
-   float psi;
+   SAMPLE *sample = &sensor->history[sensor->num_of_samples & (SENSOR_HISTORY - 1)];
 
-   kpa = data*10;
-   psi = kpa*0.145037738;
+   sample->value = decode_pid_value(sensor->desc, raw_data);
+   sample->time = clock_ms();
+   sensor->num_of_samples++;
+   publish_sample((int)strtol(sensor->desc->pid, NULL, 16), sensor->desc->bytes, sensor->ecu, sample->time, raw_data, sample->value);
 
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i kPa", kpa);
-   else
-      sprintf(buf, "%.1f PSI", psi);
+   sensor->raw_data = raw_data;
+   sensor->text_stale = TRUE;
+   sensor->value_dirty = TRUE;
 }
 
 
-void o2_sensor_wrv_formula(int data, char *buf)
-{
-   float eq_ratio, o2_voltage; // equivalence ratio and sensor voltage
-   
-   eq_ratio = (float)(data >> 16)*0.0000305;  // data bytes A,B
-   o2_voltage = (float)(data & 0xFFFF)*0.000122; // data bytes C,D
-   
-   sprintf(buf, "%.3f V, Eq. ratio: %.3f", o2_voltage, eq_ratio);
-}
 
-
-//Commanded EGR status: PID 2C
-void commanded_egr_formula(int data, char *buf)
+/* paint_sensor_values:
+ *  Repaints only the value cells whose text changed.  Each cell is drawn into
+ *  value_buffer and blitted to the screen in one go, so the label is left
+ *  alone and the value does not flicker.
+ */
+void paint_sensor_values()
 {
-   sprintf(buf, "%.1f%%", (float)data*100/255);
-}
+   DIALOG *d;
+   SENSOR *sensor;
+   char buf[64];
+   int row;
 
-//EGR error: PID 2D
-void egr_error_formula(int data, char *buf)
-{
-   sprintf(buf, (data == 128) ? "0.0%%" : "%+.1f%%", (float)(data-128)/255*100);
-}
+   for (row = 0; row < sensors_on_page; row++)
+   {
+      d = sensor_rows[row];
+      sensor = (SENSOR *)d->dp3;
+      if (!sensor || !sensor->value_dirty)
+         continue;
+      sensor->value_dirty = FALSE;
 
+      if (sensor->text_stale)
+      {
+         sensor->text_stale = FALSE;
+         format_pid_value(sensor->desc, sensor->raw_data, buf);
+         if (strcmp(buf, sensor->screen_buf) == 0)  // the change doesn't show
+            continue;
+         strcpy(sensor->screen_buf, buf);
+      }
 
-void evap_pct_formula(int data, char *buf)
-{
-   sprintf(buf, "%.1f%%", (float)data/255*100);
+      clear_to_color(value_buffer, d->bg);
+      gui_textout_ex(value_buffer, sensor->screen_buf, SENSOR_VALUE_INDENT, 0, ((d->flags & D_DISABLED) ? gui_mg_color : d->fg), d->bg, FALSE);
+      scare_mouse_area(d->x + SENSOR_LABEL_MARGIN, d->y, value_buffer->w, value_buffer->h);
+      blit(value_buffer, screen, 0, 0, d->x + SENSOR_LABEL_MARGIN, d->y, value_buffer->w, value_buffer->h);
+      unscare_mouse();
+   }
 }
 
 
-void fuel_level_formula(int data, char *buf)
+// adds a row with the values the sensors on the page got in the last poll cycle to the session log
+void log_sensor_values()
 {
-   sprintf(buf, "%.1f%%", (float)data/255*100);
-}
+   int pids[SENSORS_PER_PAGE];
+   float values[SENSORS_PER_PAGE];
+   unsigned long present = 0;
+   int num_of_columns = 0;
+   SENSOR *sensor;
+   int row;
 
+   if (!logger_is_running())
+      return;
 
-void warm_ups_formula(int data, char *buf)
-{
-   sprintf(buf, "%i", data);
-}
+   for (row = 0; row < sensors_on_page; row++)
+   {
+      sensor = (SENSOR *)sensor_rows[row]->dp3;
+      if (!sensor || !sensor->enabled)
+         continue;
 
+      pids[num_of_columns] = (int)strtol(sensor->desc->pid, NULL, 16);
+      if (sensor->num_of_samples != sensor->logged_samples)
+      {
+         values[num_of_columns] = sensor->history[(sensor->num_of_samples - 1) & (SENSOR_HISTORY - 1)].value;
+         present |= 1UL << num_of_columns;
+         sensor->logged_samples = sensor->num_of_samples;
+      }
+      num_of_columns++;
+   }
 
-void clr_distance_formula(int data, char *buf)
-{
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i km", data);
-   else
-      sprintf(buf, "%i miles", (int)(data/1.609));
+   logger_write_row(clock_ms(), pids, values, present, num_of_columns);
 }
 
 
-void evap_vp_formula(int data, char *buf)
+/* set_graph_mode:
+ *  In graph mode, the rows of the page are hidden under the strip chart, and
+ *  only the sensors it plots are polled.  The sensor_proc objects are never
+ *  hidden, since hidden objects don't get MSG_IDLE and the first row does the
+ *  polling; they just don't draw themselves in graph mode.
+ */
+void set_graph_mode(int on)
 {
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%.2f Pa", data*0.25);
-   else
-      sprintf(buf, "%.3f in H2O", data*0.25/249.088908);
-}
+   DIALOG *chart;
+   int i;
 
+   graph_mode = on;
 
-void baro_pressure_formula(int data, char *buf)
-{
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i kPa", data);
+   for (chart = sensor_dialog; chart->proc != strip_chart_proc; chart++);
+   if (graph_mode)
+      chart->flags &= ~D_HIDDEN;
    else
-      sprintf(buf, "%.1f inHg", data*0.2953);
-}
-
-
-void o2_sensor_wrc_formula(int data, char *buf)
-{
-   float eq_ratio, o2_ma; // equivalence ratio and sensor current
-
-   eq_ratio = (float)(data >> 16)*0.0000305;  // data bytes A,B
-   o2_ma = ((float)(data & 0xFFFF) - 0x8000)*0.00390625; // data bytes C,D
-
-   sprintf(buf, "%.3f mA, Eq. ratio: %.3f", o2_ma, eq_ratio);
-}
+      chart->flags |= D_HIDDEN;
 
+   for (i = 0; sensor_dialog[i].proc; i++)
+   {
+      if (&sensor_dialog[i] == chart || sensor_dialog[i].proc == sensor_proc)
+         continue;
+      if (sensor_dialog[i].x >= chart->x && sensor_dialog[i].x < chart->x + chart->w &&
+          sensor_dialog[i].y >= chart->y && sensor_dialog[i].y < chart->y + chart->h)
+      {
+         if (graph_mode)
+            sensor_dialog[i].flags |= D_HIDDEN;
+         else
+            sensor_dialog[i].flags &= ~D_HIDDEN;
+      }
+   }
 
-void cat_temp_formula(int data, char *buf)
-{
-   float c, f;
-   
-   c = data*0.1 - 40; // degrees Celcius
-   f = c*9/5 + 32;  // degrees Fahrenheit
-   
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%.1f%c C", c, 0xB0);
+   if (graph_mode)
+      select_chart_channels();
    else
-      sprintf(buf, "%.1f%c F", f, 0xB0);
-}
-
-
-void ecu_voltage_formula(int data, char *buf)
-{
-   sprintf(buf, "%.3f V", data*0.001);
-}
-
-
-void abs_load_formula(int data, char *buf)
-{
-   sprintf(buf, "%.1f%%", (float)data*100/255);
-}
-
-
-void eq_ratio_formula(int data, char *buf)
-{
-   sprintf(buf, "%.3f", data*0.0000305);
-}
-
-
-void relative_tp_formula(int data, char *buf)
-{
-   sprintf(buf, "%.1f%%", (float)data*100/255);
+   {
+      for (i = 0; i < num_of_sensors; i++)
+         sensors[i].chart_channel = -1;
+   }
 }
 
 
-void amb_air_temp_formula(int data, char *buf)
+// plots the first CHART_CHANNELS enabled numeric sensors on the page
+void select_chart_channels()
 {
-   int c, f;
-   
-   c = data-40; // degrees Celcius
-   f = (float)c*9/5 + 32;  // degrees Fahrenheit
-   
-   if (system_of_measurements == METRIC)
-      sprintf(buf, "%i%c C", c, 0xB0);
-   else
-      sprintf(buf, "%i%c F", f, 0xB0);
-}
-
+   SENSOR *sensor;
+   int channel = 0;
+   int row, i;
 
-void abs_tp_formula(int data, char *buf)
-{
-   sprintf(buf, "%.1f%%", (float)data*100/255);
-}
+   chart_clear();
+   for (i = 0; i < num_of_sensors; i++)
+      sensors[i].chart_channel = -1;
 
+   for (row = 0; row < sensors_on_page && channel < CHART_CHANNELS; row++)
+   {
+      sensor = (SENSOR *)sensor_rows[row]->dp3;
+      if (!sensor || !sensor->enabled || sensor->desc->type != PID_NUMBER)
+         continue;
+
+      sensor->chart_channel = channel;
+      sensor->charted_samples = sensor->num_of_samples;
+      chart_sensors[channel] = sensor;
+      chart_set_channel(channel, sensor->desc->label, sensor->desc->field.precision, chart_colors[channel]);
+      channel++;
+   }
 
-void tac_pct_formula(int data, char *buf)
-{
-   sprintf(buf, "%.1f%%", (float)data*100/255);
+   for (; channel < CHART_CHANNELS; channel++)
+      chart_sensors[channel] = NULL;
 }
 
 
-void mil_time_formula(int data, char *buf)
+// hands the samples the plotted sensors got since the last frame to the strip chart
+void feed_chart()
 {
-   sprintf(buf, "%i hrs %i min", data/60, data%60);
-}
+   SENSOR *sensor;
+   SAMPLE *sample;
+   int channel;
 
+   for (channel = 0; channel < CHART_CHANNELS; channel++)
+   {
+      if (!(sensor = chart_sensors[channel]))
+         continue;
 
-void clr_time_formula(int data, char *buf)
-{
-   sprintf(buf, "%i hrs %i min", data/60, data%60);
+      if (sensor->num_of_samples - sensor->charted_samples > SENSOR_HISTORY)  // the oldest ones were overwritten
+         sensor->charted_samples = sensor->num_of_samples - SENSOR_HISTORY;
+      for (; sensor->charted_samples < sensor->num_of_samples; sensor->charted_samples++)
+      {
+         sample = &sensor->history[sensor->charted_samples & (SENSOR_HISTORY - 1)];
+         chart_add_sample(channel, sample->time, sample->value);
+      }
+   }
 }
@@ -3,6 +3,4 @@
 
 int display_sensor_dialog(int reset);
 
-extern void obd_requirements_formula(int data, char *buf);
-
 #endif
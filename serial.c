@@ -8,37 +8,62 @@
    #include <dzcomm.h>
 #endif
 #include "serial.h"
+#include "error_handlers.h"
+#include "clock.h"
+#include "recorder.h"
+#include "replay.h"
+
+#define READ_CHUNK_SIZE   64  // max number of characters read_comport returns at once
+#define RX_BUFFER_SIZE    256 // initial size of RX_BUFFER, it grows as needed
 
 #ifdef ALLEGRO_WINDOWS
    static HANDLE com_port;
+   static OVERLAPPED rx_overlapped;     // the port is opened for overlapped I/O
+   static OVERLAPPED tx_overlapped;
+   static OVERLAPPED event_overlapped;  // used to wait for '>' (EV_RXFLAG)
+   static void wait_for_prompt_char(DWORD timeout);
 #else
    static comm_port *com_port;
 #endif
 
+static int read_chunk(char *response, int size);
+static void read_port(char *response, int size);
+static void transmit(const char *tx, int len);
+static void demux_can_frames(char *response);
+static void set_port_baud_rate(int baud_rate);
+static long get_baud_rate_bps(int baud_rate);
+static int switch_baud_rate(int baud_rate);
 
-//timer interrupt handler for sensor data
-static void serial_time_out_handler()
-{
-   serial_time_out = TRUE;
-   serial_timer_running = FALSE;
-}
-END_OF_STATIC_FUNCTION(serial_time_out_handler)
 
+static unsigned long serial_deadline;  // clock_ms() time when the serial timer runs out
+static int serial_timer_started = FALSE;
 
+
+// the serial timer is a deadline, nothing has to be installed to start it
 void start_serial_timer(int delay)
 {
-   stop_serial_timer();
-   install_int_ex(serial_time_out_handler, MSEC_TO_TIMER(delay));  // install the timer
-   serial_time_out = FALSE;
-   serial_timer_running = TRUE;
+   serial_deadline = clock_ms() + delay;
+   serial_timer_started = TRUE;
 }
 
 
 void stop_serial_timer()
 {
-   remove_int(serial_time_out_handler);
-   serial_time_out = FALSE;
-   serial_timer_running = FALSE;
+   serial_timer_started = FALSE;
+}
+
+
+// TRUE if the serial timer was started and ran out
+int serial_time_out()
+{
+   return (serial_timer_started && DEADLINE_PASSED(serial_deadline));
+}
+
+
+// TRUE if the serial timer was started and did not run out yet
+int serial_timer_running()
+{
+   return (serial_timer_started && !DEADLINE_PASSED(serial_deadline));
 }
 
 
@@ -47,10 +72,7 @@ void serial_module_init()
 #ifndef ALLEGRO_WINDOWS
    dzcomm_init();
 #endif
-   serial_timer_running = FALSE;
-   /* all variables and code used inside interrupt handlers must be locked */
-   LOCK_VARIABLE(serial_time_out);
-   LOCK_FUNCTION(serial_time_out_handler);
+   serial_timer_started = FALSE;
    _add_exit_func(serial_module_shutdown, "serial_module_shutdown");
 }
 
@@ -78,9 +100,15 @@ int open_comport()
    if (comport.status == READY)    // if the comport is open,
       close_comport();    // close it
 
+   if (replay_is_open())  // the recorded session takes the place of the interface
+   {
+      comport.status = READY;
+      return 0;
+   }
+
 #ifdef ALLEGRO_WINDOWS
    sprintf(temp_str, "COM%i", comport.number + 1);
-   com_port = CreateFile(temp_str, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
+   com_port = CreateFile(temp_str, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
    if (com_port == INVALID_HANDLE_VALUE)
    {
       comport.status = NOT_OPEN; //port was not open
@@ -102,7 +130,9 @@ int open_comport()
    dcb.fDsrSensitivity = FALSE;
    dcb.fErrorChar = FALSE;
    dcb.fAbortOnError = FALSE;
+   dcb.EvtChar = '>';  // the driver signals EV_RXFLAG when the prompt arrives
    SetCommState(com_port, &dcb);
+   SetCommMask(com_port, EV_RXFLAG);
    
    timeouts.ReadIntervalTimeout = MAXWORD;
    timeouts.ReadTotalTimeoutMultiplier = 0;
@@ -110,6 +140,13 @@ int open_comport()
    timeouts.WriteTotalTimeoutMultiplier = 0;
    timeouts.WriteTotalTimeoutConstant = 0;
    SetCommTimeouts(com_port, &timeouts);
+
+   memset(&rx_overlapped, 0, sizeof(OVERLAPPED));
+   memset(&tx_overlapped, 0, sizeof(OVERLAPPED));
+   memset(&event_overlapped, 0, sizeof(OVERLAPPED));
+   rx_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+   tx_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+   event_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 #else
    com_port = comm_port_init(comport.number);
    comm_port_set_baud_rate(com_port, comport.baud_rate);
@@ -124,7 +161,8 @@ int open_comport()
    }
 #endif
 
-   serial_time_out = FALSE;
+   stop_serial_timer();
+   comport.link_baud_rate = 0;
    comport.status = READY;
    
    return 0; // everything is okay
@@ -133,11 +171,16 @@ int open_comport()
 
 void close_comport()
 {
-   if (comport.status == READY)    // if the comport is open, close it
+   if (comport.status == READY && !replay_is_open())    // if the comport is open, close it
    {
+      if (comport.link_baud_rate)
+         send_command("atz");  // put the interface back on the baud rate it will be opened with next time
 #ifdef ALLEGRO_WINDOWS
       PurgeComm(com_port, PURGE_TXCLEAR|PURGE_RXCLEAR);
       CloseHandle(com_port);
+      CloseHandle(rx_overlapped.hEvent);
+      CloseHandle(tx_overlapped.hEvent);
+      CloseHandle(event_overlapped.hEvent);
 #else
       comm_port_flush_output(com_port);
       comm_port_flush_input(com_port);
@@ -148,50 +191,120 @@ void close_comport()
 }
 
 
+// throws away whatever is left of earlier responses, then sends the command
 void send_command(const char *command)
 {
-   char tx_buf[32];
-   
-   sprintf(tx_buf, "%s\r", command);  // Append CR to the command
+   char tx_buf[MAX_REQUEST_LENGTH];
+   int len = build_request(tx_buf, sizeof(tx_buf), command);
 
-#ifdef LOG_COMMS
-   write_comm_log("TX", tx_buf);
-#endif
+   if (len == 0)
+      return;
+
+   discard_input();
+   transmit(tx_buf, len);
+}
+
+
+/* build_request:
+ *  Puts the command, followed by the CR, into tx, so it can be sent with
+ *  send_request() as many times as needed.  Returns the length of the request,
+ *  0 if it does not fit into size characters (with the NUL).
+ */
+int build_request(char *tx, int size, const char *command)
+{
+   int len = strlen(command);
+
+   if (len + 2 > size)
+      return 0;
+
+   memcpy(tx, command, len);
+   tx[len++] = '\r';
+   tx[len] = 0;
+
+   return len;
+}
+
+
+/* send_request:
+ *  Sends a request built by build_request().  Unlike send_command(), nothing
+ *  that was received is thrown away, so it can follow the prompt right away:
+ *  the tail of a late response is still in the buffer when it is read.
+ */
+void send_request(const char *tx, int len)
+{
+   transmit(tx, len);
+}
+
+
+// throws away what was received and not read yet, and what was not sent yet
+void discard_input()
+{
+   if (replay_is_open())
+      return;
 
 #ifdef ALLEGRO_WINDOWS
-   DWORD bytes_written;
-   
    PurgeComm(com_port, PURGE_TXCLEAR|PURGE_RXCLEAR);
-   WriteFile(com_port, tx_buf, strlen(tx_buf), &bytes_written, 0);
 #else
    comm_port_flush_output(com_port);
    comm_port_flush_input(com_port);
-   comm_port_string_send(com_port, tx_buf);
 #endif
 }
 
 
-int read_comport(char *response)
+// writes a request with its CR in one go
+void transmit(const char *tx, int len)
 {
-   char *prompt_pos = NULL;
+   record_frame(RECORD_TX, tx, len);
+
+#ifdef LOG_COMMS
+   write_comm_log("TX", tx);
+#endif
+
+   if (replay_is_open())
+   {
+      replay_send(tx);
+      return;
+   }
 
 #ifdef ALLEGRO_WINDOWS
-   DWORD bytes_read = 0;
-   DWORD errors;
-   COMSTAT stat;
-   
-   response[0] = '\0';
-   ClearCommError(com_port, &errors, &stat);
-   if (stat.cbInQue > 0)
-      ReadFile(com_port, response, stat.cbInQue, &bytes_read, 0);
-   response[bytes_read] = '\0';
+   DWORD bytes_written;
+
+   if (!WriteFile(com_port, tx, len, &bytes_written, &tx_overlapped) && (GetLastError() == ERROR_IO_PENDING))
+      GetOverlappedResult(com_port, &tx_overlapped, &bytes_written, TRUE);
 #else
-   int i = 0;
-   
-   while((response[i] = comm_port_test(com_port)) != -1) // while the serial buffer is not empty, read comport
-      i++;
-   response[i] = '\0'; // terminate string, erase -1
+   comm_port_string_send(com_port, tx);
 #endif
+
+   // ATZ also resets the negotiated baud rate, the answer comes at the default one
+   if (comport.link_baud_rate && len == 4 && strncmp(tx, "atz\r", 4) == 0)
+   {
+      set_port_baud_rate(comport.baud_rate);
+      comport.link_baud_rate = 0;
+   }
+}
+
+
+int read_comport(char *response)
+{
+   return read_chunk(response, READ_CHUNK_SIZE + 1);
+}
+
+
+/* read_chunk:
+ *  Reads whatever is waiting in the serial buffer, but no more than size-1
+ *  characters, into response.  Returns PROMPT if '>' was received (response is
+ *  cut off at the prompt), DATA if something else was received, or EMPTY.
+ */
+int read_chunk(char *response, int size)
+{
+   char *prompt_pos = NULL;
+
+   if (replay_is_open())
+      replay_receive(response, size);
+   else
+      read_port(response, size);
+
+   record_frame(RECORD_RX, response, strlen(response));
    
    prompt_pos = strchr(response, '>');
    if (prompt_pos != NULL)
@@ -214,6 +327,122 @@ int read_comport(char *response)
 }
 
 
+// reads whatever is waiting in the serial buffer, but no more than size-1 characters
+void read_port(char *response, int size)
+{
+#ifdef ALLEGRO_WINDOWS
+   DWORD bytes_read = 0;
+   DWORD errors;
+   COMSTAT stat;
+   
+   response[0] = '\0';
+   ClearCommError(com_port, &errors, &stat);
+   if (stat.cbInQue > 0)
+   {
+      if (!ReadFile(com_port, response, MIN(stat.cbInQue, size - 1), &bytes_read, &rx_overlapped) && (GetLastError() == ERROR_IO_PENDING))
+         GetOverlappedResult(com_port, &rx_overlapped, &bytes_read, TRUE);
+   }
+   response[bytes_read] = '\0';
+#else
+   int i = 0;
+   
+   while((i < size - 1) && ((response[i] = comm_port_test(com_port)) != -1)) // while the serial buffer is not empty, read comport
+      i++;
+   response[i] = '\0'; // terminate string, erase -1
+#endif
+}
+
+
+void rx_buffer_clear(RX_BUFFER *rx)
+{
+   rx->len = 0;
+   if (rx->data)
+      rx->data[0] = 0;
+}
+
+
+/* read_response:
+ *  Appends whatever is waiting in the serial buffer to rx, growing it if it
+ *  has to.  Only the new characters are looked at, so filling rx a chunk at a
+ *  time costs no more than reading it in one go.  Returns PROMPT if '>' was
+ *  received, DATA if something else was received, or EMPTY.  rx->data may be
+ *  passed to process_response() once the prompt arrives.
+ */
+int read_response(RX_BUFFER *rx)
+{
+   int status;
+
+   if (rx->size - rx->len < READ_CHUNK_SIZE + 1)
+   {
+      rx->size = (rx->size) ? rx->size*2 : RX_BUFFER_SIZE;
+      if ((rx->data = realloc(rx->data, rx->size)) == NULL)
+         fatal_error("Could not allocate enough memory for serial buffer");
+   }
+
+   status = read_chunk(rx->data + rx->len, rx->size - rx->len);
+   rx->len += strlen(rx->data + rx->len);
+
+   return status;
+}
+
+
+/* read_until_prompt:
+ *  Reads everything received from the interface into rx, until either '>'
+ *  arrives or timeout milliseconds pass.  Under Windows, the thread sleeps
+ *  until the driver sees the prompt instead of polling the port.  Returns
+ *  PROMPT, or EMPTY if the prompt didn't arrive.
+ */
+int read_until_prompt(RX_BUFFER *rx, int timeout)
+{
+   unsigned long deadline = clock_ms() + timeout;
+   long remaining;
+   int status;
+
+   for (;;)
+   {
+      if ((status = read_response(rx)) == PROMPT)
+         break;
+      if ((remaining = (long)(deadline - clock_ms())) <= 0)  // read the clock once, so the wait can't wrap around
+         break;
+#ifdef ALLEGRO_WINDOWS
+      if (status == EMPTY)
+         wait_for_prompt_char(remaining);
+#endif
+   }
+
+   return (status == PROMPT) ? PROMPT : EMPTY;
+}
+
+
+#ifdef ALLEGRO_WINDOWS
+// blocks until either the driver receives '>', or timeout milliseconds pass
+void wait_for_prompt_char(DWORD timeout)
+{
+   DWORD event_mask;
+   DWORD bytes;
+
+   if (replay_is_open())  // there's no port to wait on
+   {
+      Sleep(1);
+      return;
+   }
+
+   ResetEvent(event_overlapped.hEvent);
+   if (WaitCommEvent(com_port, &event_mask, &event_overlapped))
+      return;  // '>' was already received
+   if (GetLastError() != ERROR_IO_PENDING)
+   {
+      Sleep(1);  // shouldn't happen, but don't spin if it does
+      return;
+   }
+
+   if (WaitForSingleObject(event_overlapped.hEvent, timeout) != WAIT_OBJECT_0)
+      SetCommMask(com_port, EV_RXFLAG);  // cancel the wait
+   GetOverlappedResult(com_port, &event_overlapped, &bytes, TRUE);
+}
+#endif
+
+
 int find_valid_response(char *buf, char *response, const char *filter, char **stop)
 {
    char *in_ptr = response;
@@ -223,6 +452,15 @@ int find_valid_response(char *buf, char *response, const char *filter, char **st
 
    while (*in_ptr)
    {
+      if (obd_device.headers_on)  // skip the CAN ID
+      {
+         for (out_ptr = in_ptr; isxdigit(*out_ptr); out_ptr++)
+            ;
+         if (*out_ptr == ECU_DELIMITER)
+            in_ptr = out_ptr + 1;
+         out_ptr = buf;
+      }
+
       if (strncmp(in_ptr, filter, strlen(filter)) == 0)
       {
          while (*in_ptr && *in_ptr != SPECIAL_DELIMITER) // copy valid response into buf
@@ -256,13 +494,143 @@ int find_valid_response(char *buf, char *response, const char *filter, char **st
 }
 
 // DO NOT TRANSLATE ANY STRINGS IN THIS FUNCTION!
+/* index_response:
+ *  Splits a response that went through process_response() into lines in a
+ *  single pass, so the parsers can go straight to the lines they want instead
+ *  of rescanning the whole response for every filter.  Returns number of lines.
+ */
+int index_response(const char *response, RESPONSE_INDEX *index)
+{
+   const char *line_start = response;
+   const char *data;
+   RESPONSE_LINE *line;
+   char byte[3];
+   int data_start;
+   int i;
+
+   byte[2] = 0;
+   index->num_of_lines = 0;
+
+   while (*line_start && index->num_of_lines < MAX_RESPONSE_LINES)
+   {
+      line = &index->line[index->num_of_lines++];
+      line->offset = line_start - response;
+      for (line->len = 0; line_start[line->len] && line_start[line->len] != SPECIAL_DELIMITER; line->len++)
+         ;
+      data = line_start;
+      line_start += line->len;
+      if (*line_start == SPECIAL_DELIMITER)
+         line_start++;
+
+      // "7E8#4100BE3EB811", see demux_can_frames()
+      line->ecu = -1;
+      for (i = 0; i < line->len && i <= 8 && isxdigit(data[i]); i++)
+         ;
+      if (i > 0 && i < line->len && data[i] == ECU_DELIMITER)
+      {
+         line->ecu = strtol(data, NULL, 16);
+         line->offset += i + 1;
+         line->len -= i + 1;
+         data += i + 1;
+      }
+
+      line->frame = -1;
+      data_start = 0;
+      if (line->len >= 2 && data[1] == ':' && isxdigit(data[0]))  // "N:" frame of a multi-frame message
+      {
+         byte[0] = data[0];
+         byte[1] = 0;
+         line->frame = strtol(byte, NULL, 16);
+         data_start = (line->frame == 0) ? 2 : -1;  // only the first frame begins with the service byte
+      }
+      else if (line->len == 3)  // length of a multi-frame message
+         data_start = -1;
+
+      line->service = -1;
+      if (data_start >= 0 && line->len >= data_start + 2)
+      {
+         byte[0] = data[data_start];
+         byte[1] = data[data_start + 1];
+         line->service = strtol(byte, NULL, 16);
+      }
+   }
+
+   return index->num_of_lines;
+}
+
+
+// copies the line into buf (size bytes long), returns buf
+char *get_response_line(char *buf, int size, const char *response, const RESPONSE_LINE *line)
+{
+   int len = MIN(line->len, size - 1);
+
+   strncpy(buf, response + line->offset, len);
+   buf[len] = 0;
+
+   return buf;
+}
+
+
+void start_message_reader(MESSAGE_READER *reader)
+{
+   reader->line = 0;
+   reader->message_len = 0;
+   reader->message[0] = 0;
+}
+
+
+/* next_message:
+ *  Returns the next complete message of an indexed response, or NULL if there
+ *  are no more.  A single line is copied into buf.  ISO 15765 multi-frame
+ *  messages ("00A", "0:41...", "1:...") are reassembled in the reader, unless
+ *  headers are on and demux_can_frames() already did it.  *ecu is set to the
+ *  CAN ID of the ECU that sent the message, -1 if it's not known.
+ */
+const char *next_message(MESSAGE_READER *reader, char *buf, int size, const char *response, const RESPONSE_INDEX *index, long *ecu)
+{
+   const RESPONSE_LINE *line;
+   char msg[256];
+
+   while (reader->line < index->num_of_lines)
+   {
+      line = &index->line[reader->line++];
+      get_response_line(msg, sizeof(msg), response, line);
+
+      if (line->len == 3)  // length of a multi-frame message
+      {
+         reader->message_len = MIN((int)strtol(msg, NULL, 16)*2, sizeof(reader->message) - 1);
+         reader->message[0] = 0;
+      }
+      else if (line->frame >= 0)  // consecutive frame
+      {
+         if (strlen(reader->message) < reader->message_len)
+         {
+            strncat(reader->message, msg + 2, reader->message_len - strlen(reader->message));
+            if (strlen(reader->message) >= reader->message_len)
+            {
+               *ecu = -1;
+               return reader->message;
+            }
+         }
+      }
+      else
+      {
+         *ecu = line->ecu;
+         return get_response_line(buf, size, response, line);
+      }
+   }
+
+   return NULL;
+}
+
+
 int process_response(const char *cmd_sent, char *msg_received)
 {
    int i = 0;
    char *msg = msg_received;
    int echo_on = TRUE; //echo status
    int is_hex_num = TRUE;
-   char temp_buf[80];
+   static RX_BUFFER at_response;
 
    if (cmd_sent)
    {
@@ -279,19 +647,14 @@ int process_response(const char *cmd_sent, char *msg_received)
       if (echo_on == TRUE)  //if echo is on
       {
          send_command("ate0"); // turn off the echo
-         start_serial_timer(AT_TIMEOUT);
+         rx_buffer_clear(&at_response);
          // wait for chip response or timeout
-         while ((read_comport(temp_buf) != PROMPT) && !serial_time_out)
-            ;
-         stop_serial_timer();
-         if (!serial_time_out)
+         if (read_until_prompt(&at_response, AT_TIMEOUT) == PROMPT)
          {
             send_command("atl0"); // turn off linefeeds
-            start_serial_timer(AT_TIMEOUT);
+            rx_buffer_clear(&at_response);
             // wait for chip response or timeout
-            while ((read_comport(temp_buf) != PROMPT) && !serial_time_out)
-               ;
-            stop_serial_timer();
+            read_until_prompt(&at_response, AT_TIMEOUT);
          }
       }
       else //if echo is off
@@ -334,7 +697,11 @@ int process_response(const char *cmd_sent, char *msg_received)
    msg_received[i] = '\0'; // terminate the string
 
    if (is_hex_num)
+   {
+      if (obd_device.headers_on)
+         demux_can_frames(msg_received);
       return HEX_DATA;
+   }
 
    if (strcmp(msg_received, "NODATA") == 0)
       return ERR_NO_DATA;
@@ -412,6 +779,111 @@ int display_error_message(int error, int retry)
 }
 
 
+// parses response to ATDPN ("A6" if protocol was detected automatically, "6" otherwise)
+int parse_protocol_number(const char *response)
+{
+   int protocol;
+
+   if (response[0] == 'A')
+      response++;
+
+   protocol = response[0];
+   if (protocol >= '0' && protocol <= '9')
+      return protocol - '0';
+   if (protocol >= 'A' && protocol <= 'C')
+      return protocol - 'A' + 10;
+
+   return 0;
+}
+
+
+// TRUE if we're talking to an ELM327 which is connected to an ISO 15765-4 (CAN) bus
+int is_can_protocol()
+{
+   return (obd_device.interface_type == INTERFACE_ELM327) && (obd_device.protocol >= 6) && (obd_device.protocol <= 9);
+}
+
+
+
+/* parse_pid_map:
+ *  Extracts the "PIDs supported" bitmap from the response to 0100, 0120, or 0140
+ *  (range 0, 1, or 2) into obd_device.pid_map.  If several ECUs responded, their
+ *  bitmaps are combined.  Returns FALSE if no bitmap was found in the response.
+ */
+int parse_pid_map(char *response, int range)
+{
+   char filter[8];
+   char msg[64];
+   char *start = response;
+   int found = FALSE;
+
+   sprintf(filter, "41%02X", range*0x20);
+   obd_device.pid_map[range] = 0;
+
+   while (find_valid_response(msg, start, filter, &start))
+   {
+      if (strlen(msg) >= 12)
+      {
+         msg[12] = 0;
+         obd_device.pid_map[range] |= strtoul(msg + 4, NULL, 16);
+         found = TRUE;
+      }
+   }
+
+   return found;
+}
+
+
+// TRUE if the vehicle supports the PID, or if we don't know which PIDs it supports
+int is_pid_supported(int pid)
+{
+   if (!obd_device.pid_map_valid || pid <= 0 || pid > PID_MAP_RANGES*0x20)
+      return TRUE;
+
+   return (obd_device.pid_map[(pid - 1)/0x20] >> (0x1F - (pid - 1) % 0x20)) & 1;
+}
+
+
+/* ---- DO NOT TRANSLATE FROM HERE ---- */
+// returns the protocol that was detected the last time we connected, 0 if none
+int load_protocol()
+{
+   return get_config_int("vehicles", "last_protocol", 0);
+}
+
+
+void save_protocol()
+{
+   if (obd_device.protocol > 0)
+      set_config_int("vehicles", "last_protocol", obd_device.protocol);
+}
+/* ---- TO HERE ---- */
+
+
+/* try_protocol:
+ *  Tells the ELM327 to try the protocol first (ATTPn), and to fall back to
+ *  automatic search if the vehicle does not answer on it.  Returns FALSE if
+ *  the interface did not accept the command.
+ */
+int try_protocol(int protocol)
+{
+   static RX_BUFFER response;
+   char cmd[8];
+
+   sprintf(cmd, "attp%X", protocol);
+   send_command(cmd);
+   rx_buffer_clear(&response);
+
+   return (read_until_prompt(&response, AT_TIMEOUT) == PROMPT) && strstr(response.data, "OK");
+}
+
+
+// TRUE for ISO 9141-2 and ISO 14230-4, which the ECU won't initialize until its previous session timed out
+int protocol_needs_init(int protocol)
+{
+   return (protocol >= 3) && (protocol <= 5);
+}
+
 const char *get_protocol_string(int interface_type, int protocol_id)
 {
    switch (interface_type)
@@ -450,3 +922,397 @@ const char *get_protocol_string(int interface_type, int protocol_id)
    
    return "unknown";
 }
+
+
+/* parse_elm_version:
+ *  Returns firmware version from the ATZ response (i.e., "ELM327 v1.5") times
+ *  ten, or 0 if it's not an ELM327.
+ */
+int parse_elm_version(const char *response)
+{
+   const char *id = strstr(response, "ELM327");
+   int major, minor;
+
+   if (id == NULL)
+      return 0;
+
+   for (id += 6; *id && !isdigit(*id); id++)  // skip " v"
+      ;
+   if (sscanf(id, "%d.%d", &major, &minor) != 2)
+      return 0;
+
+   return major*10 + minor;
+}
+
+
+// counts the lines of a processed response that begin with prefix (i.e., how many ECUs answered)
+int count_responses(const char *response, const char *prefix)
+{
+   static RESPONSE_INDEX index;
+   int count = 0;
+   int i;
+
+   index_response(response, &index);
+   for (i = 0; i < index.num_of_lines; i++)
+      if ((index.line[i].len >= strlen(prefix)) && (strncmp(response + index.line[i].offset, prefix, strlen(prefix)) == 0))
+         count++;
+
+   return count;
+}
+
+
+// forgets everything learned about response times, called when the interface is reset
+void reset_response_timing()
+{
+   obd_device.num_of_timed_responses = 0;
+   obd_device.max_response_time = 0;
+   obd_device.adapter_timeout = 0;
+}
+
+
+/* add_response_count:
+ *  Appends the number of expected responses to an OBD request, so that
+ *  ELM327 v1.3 and up return as soon as every ECU has answered, instead of
+ *  waiting for its timeout in case more answers arrive.
+ */
+void add_response_count(char *cmd)
+{
+   if ((obd_device.interface_type == INTERFACE_ELM327) && (obd_device.elm_version >= 13) &&
+       (obd_device.num_of_ecus > 0) && (obd_device.num_of_ecus <= 0xF))
+      sprintf(cmd + strlen(cmd), "%X", obd_device.num_of_ecus);
+}
+
+
+/* learn_response_time:
+ *  Records how many milliseconds a request took.  Only requests with a
+ *  response count are timed, because without it the time is mostly the
+ *  ELM327 waiting for its timeout.  Returns TRUE when enough responses were
+ *  timed and program_adapter_timing() should be called.
+ */
+int learn_response_time(int latency)
+{
+   if (obd_device.adapter_timeout > 0 || obd_device.elm_version < 13 || obd_device.num_of_ecus == 0)
+      return FALSE;
+
+   obd_device.max_response_time = MAX(obd_device.max_response_time, latency);
+   obd_device.num_of_timed_responses++;
+
+   return (obd_device.num_of_timed_responses >= TIMING_SAMPLES);
+}
+
+
+/* program_adapter_timing:
+ *  Sets the ELM327 timeout (AT ST) to twice the slowest response seen, and
+ *  turns on aggressive adaptive timing (AT AT2) for fast ECUs, normal (AT AT1)
+ *  for the others.  Must not be called while the acquisition engine is
+ *  running.  Returns FALSE if the interface did not accept the settings.
+ */
+int program_adapter_timing()
+{
+   static RX_BUFFER response;
+   char cmd[16];
+   int timeout = MID(1, (obd_device.max_response_time*2 + 20 + 3)/4, 0xFF);  // in 4 ms units, 20 ms margin
+
+   sprintf(cmd, "atst%02X", timeout);
+   send_command(cmd);
+   rx_buffer_clear(&response);
+   if (read_until_prompt(&response, AT_TIMEOUT) != PROMPT || !strstr(response.data, "OK"))
+   {
+      obd_device.num_of_ecus = 0;  // don't try again
+      return FALSE;
+   }
+   obd_device.adapter_timeout = timeout*4;
+
+   send_command((obd_device.max_response_time < 50) ? "atat2" : "atat1");
+   rx_buffer_clear(&response);
+   read_until_prompt(&response, AT_TIMEOUT);
+
+   return TRUE;
+}
+
+
+// how long to wait for the prompt after an OBD request, in milliseconds
+int get_request_timeout()
+{
+   if (obd_device.adapter_timeout > 0)
+      return MIN(obd_device.adapter_timeout + 1000, OBD_REQUEST_TIMEOUT);  // already in milliseconds, allow for multi-frame responses and a slow link
+
+   return OBD_REQUEST_TIMEOUT;
+}
+
+
+/* set_can_headers:
+ *  Turns CAN headers on or off (ATH1/ATH0).  With headers on, responses of
+ *  several ECUs can be told apart, see demux_can_frames().  Returns FALSE if
+ *  the interface did not accept the command.
+ */
+int set_can_headers(int on)
+{
+   static RX_BUFFER response;
+
+   send_command((on) ? "ath1" : "ath0");
+   rx_buffer_clear(&response);
+   if (read_until_prompt(&response, AT_TIMEOUT) != PROMPT || !strstr(response.data, "OK"))
+      return FALSE;
+
+   obd_device.headers_on = on;
+
+   return TRUE;
+}
+
+
+// DO NOT TRANSLATE ANY STRINGS IN THIS FUNCTION!
+/* demux_can_frames:
+ *  With headers on, every line of a CAN response is an ISO 15765 frame: CAN ID
+ *  (3 hex digits, 8 for 29-bit IDs), PCI byte, and data.  The frames are
+ *  reassembled into messages in a single pass, keyed on the CAN ID, so the
+ *  First/Consecutive frames of different ECUs may be interleaved in any
+ *  order.  The response is rewritten with one line per complete message,
+ *  "ID#data" (i.e., "7E8#4100BE3EB811"), in the order the messages were
+ *  completed.  index_response() strips the ID into RESPONSE_LINE.ecu.
+ *  Incomplete messages are dropped; lines that are not frames are kept.
+ */
+void demux_can_frames(char *response)
+{
+   struct
+   {
+      long ecu;       // CAN ID, -1 if the slot is free
+      int len;        // length of the message, in hex digits
+      int received;   // hex digits received so far
+      int next_frame; // sequence number of the next Consecutive frame
+      char *data;
+   } slot[MAX_CAN_ECUS];
+   int header_len = (obd_device.protocol == 7 || obd_device.protocol == 9) ? 8 : 3;
+   char *out, *out_ptr;
+   char *line = response;
+   char *next;
+   char byte[3];
+   long ecu;
+   int line_len, pci, len, n;
+   int i;
+
+   if (!(out = (char *)malloc(strlen(response) + 1)))
+      fatal_error("Could not allocate enough memory for CAN response");
+   out_ptr = out;
+   for (i = 0; i < MAX_CAN_ECUS; i++)
+      slot[i].ecu = -1;
+   byte[2] = 0;
+
+   for (; *line; line = next)
+   {
+      for (line_len = 0; line[line_len] && line[line_len] != SPECIAL_DELIMITER; line_len++)
+         ;
+      next = (line[line_len]) ? line + line_len + 1 : line + line_len;
+
+      if (line_len < header_len + 2 || memchr(line, ':', line_len))
+      {
+         strncpy(out_ptr, line, line_len);  // not a frame (i.e., response to an AT command)
+         out_ptr += line_len;
+         *out_ptr++ = SPECIAL_DELIMITER;
+         continue;
+      }
+
+      strncpy(byte, line + header_len, 2);
+      pci = strtol(byte, NULL, 16);
+      line[header_len] = 0;  // the PCI byte was copied already
+      ecu = strtol(line, NULL, 16);
+
+      for (i = 0; i < MAX_CAN_ECUS; i++)  // find the message this ECU is sending
+         if (slot[i].ecu == ecu)
+            break;
+
+      switch (pci >> 4)
+      {
+         case 0:  // Single frame
+            len = MIN((pci & 0x0F)*2, line_len - header_len - 2);
+            out_ptr += sprintf(out_ptr, "%s%c", line, ECU_DELIMITER);
+            strncpy(out_ptr, line + header_len + 2, len);
+            out_ptr += len;
+            *out_ptr++ = SPECIAL_DELIMITER;
+            break;
+
+         case 1:  // First frame, 12-bit length follows
+            if (i < MAX_CAN_ECUS)  // previous message of this ECU was not finished
+               free(slot[i].data);
+            else
+               for (i = 0; i < MAX_CAN_ECUS && slot[i].ecu >= 0; i++)
+                  ;
+            if (i == MAX_CAN_ECUS || line_len < header_len + 4)
+            {
+               if (i < MAX_CAN_ECUS)
+                  slot[i].ecu = -1;
+               break;  // more than MAX_CAN_ECUS talking at once, or a broken frame
+            }
+            strncpy(byte, line + header_len + 2, 2);
+            slot[i].ecu = ecu;
+            slot[i].len = (((pci & 0x0F) << 8) + strtol(byte, NULL, 16))*2;
+            if (!(slot[i].data = (char *)malloc(slot[i].len + 1)))
+               fatal_error("Could not allocate enough memory for CAN response");
+            slot[i].received = MIN(line_len - header_len - 4, slot[i].len);
+            strncpy(slot[i].data, line + header_len + 4, slot[i].received);
+            slot[i].next_frame = 1;
+            break;
+
+         case 2:  // Consecutive frame
+            if (i == MAX_CAN_ECUS)
+               break;  // First frame was lost
+            if ((pci & 0x0F) != (slot[i].next_frame & 0x0F))  // a frame was lost, the message is useless
+            {
+               free(slot[i].data);
+               slot[i].ecu = -1;
+               break;
+            }
+            n = MIN(line_len - header_len - 2, slot[i].len - slot[i].received);  // last frame is padded
+            strncpy(slot[i].data + slot[i].received, line + header_len + 2, n);
+            slot[i].received += n;
+            slot[i].next_frame++;
+            if (slot[i].received == slot[i].len)
+            {
+               out_ptr += sprintf(out_ptr, "%s%c", line, ECU_DELIMITER);
+               strncpy(out_ptr, slot[i].data, slot[i].len);
+               out_ptr += slot[i].len;
+               *out_ptr++ = SPECIAL_DELIMITER;
+               free(slot[i].data);
+               slot[i].ecu = -1;
+            }
+            break;
+      }
+   }
+
+   for (i = 0; i < MAX_CAN_ECUS; i++)
+      if (slot[i].ecu >= 0)
+         free(slot[i].data);
+
+   if (out_ptr > out)
+      out_ptr--;  // remove the last delimiter
+   *out_ptr = 0;
+   strcpy(response, out);
+   free(out);
+}
+
+
+// DO NOT TRANSLATE ANY STRINGS IN THIS FUNCTION!
+/* negotiate_baud_rate:
+ *  Moves an ELM327 (v1.2 and up) to a faster baud rate with AT BRD.  The rate
+ *  that worked last time is tried first, the others from the fastest down.
+ *  The best rate is remembered in scantool.cfg ([comm] best_baud_rate, which
+ *  equals baud_rate if the interface can't go any faster), so the search is
+ *  only done once.  AT WS keeps the negotiated rate, ATZ does not.  Returns
+ *  TRUE if the baud rate was changed.
+ */
+int negotiate_baud_rate()
+{
+   static const int fast_baud_rates[] = {
+#ifdef ALLEGRO_WINDOWS
+      BAUD_RATE_500000, BAUD_RATE_230400,
+#endif
+      BAUD_RATE_115200, BAUD_RATE_57600, -1 };
+   int best = get_config_int("comm", "best_baud_rate", -1);
+   int i;
+
+   if (replay_is_open() || comport.link_baud_rate || obd_device.interface_type != INTERFACE_ELM327 ||
+       obd_device.elm_version < 12 || best == comport.baud_rate)
+      return FALSE;
+
+   if (best >= 0 && switch_baud_rate(best))
+      return TRUE;
+
+   for (i = 0; fast_baud_rates[i] >= 0; i++)
+   {
+      if (fast_baud_rates[i] == best || get_baud_rate_bps(fast_baud_rates[i]) <= get_baud_rate_bps(comport.baud_rate))
+         continue;
+      if (switch_baud_rate(fast_baud_rates[i]))
+      {
+         set_config_int("comm", "best_baud_rate", fast_baud_rates[i]);
+         return TRUE;
+      }
+   }
+
+   set_config_int("comm", "best_baud_rate", comport.baud_rate);  // don't try again
+
+   return FALSE;
+}
+
+
+/* switch_baud_rate:
+ *  AT BRD handshake: the interface answers "OK" at the old rate and switches.
+ *  We switch too, and wait for its ID string.  If it arrives intact, a CR
+ *  confirms the new rate.  Otherwise, both sides go back to the old rate.
+ */
+int switch_baud_rate(int baud_rate)
+{
+   static RX_BUFFER response;
+   int old_baud_rate = (comport.link_baud_rate) ? comport.link_baud_rate : comport.baud_rate;
+   unsigned long deadline;
+   char cmd[16];
+
+   sprintf(cmd, "atbrd%02lX", (4000000 + get_baud_rate_bps(baud_rate)/2) / get_baud_rate_bps(baud_rate));
+   send_command(cmd);
+   rx_buffer_clear(&response);
+   deadline = clock_ms() + AT_TIMEOUT;
+   while (!response.data || !strstr(response.data, "OK"))
+   {
+      if (read_response(&response) == PROMPT || DEADLINE_PASSED(deadline))  // "?", firmware does not support it
+         return FALSE;
+   }
+
+   set_port_baud_rate(baud_rate);
+   rx_buffer_clear(&response);
+   deadline = clock_ms() + BRD_TIMEOUT;
+   while (!DEADLINE_PASSED(deadline))
+   {
+      read_response(&response);
+      if (response.data && strstr(response.data, "ELM327") && strchr(strstr(response.data, "ELM327"), '\r'))
+      {
+         send_command("");  // CR, the new baud rate works for us
+         rx_buffer_clear(&response);
+         if (read_until_prompt(&response, AT_TIMEOUT) == PROMPT && strstr(response.data, "OK"))
+         {
+            comport.link_baud_rate = baud_rate;
+            return TRUE;
+         }
+         break;
+      }
+   }
+
+   // the interface goes back to the old rate by itself, when it doesn't get the CR
+   set_port_baud_rate(old_baud_rate);
+   rx_buffer_clear(&response);
+   read_until_prompt(&response, BRD_TIMEOUT);
+
+   return FALSE;
+}
+
+
+void set_port_baud_rate(int baud_rate)
+{
+#ifdef ALLEGRO_WINDOWS
+   DCB dcb;
+
+   FlushFileBuffers(com_port);  // let the last command go out at the old rate
+   GetCommState(com_port, &dcb);
+   dcb.BaudRate = baud_rate;
+   SetCommState(com_port, &dcb);
+#else
+   rest(10);  // let the last command go out at the old rate
+   comm_port_set_baud_rate(com_port, baud_rate);
+#endif
+}
+
+
+// dzcomm baud rates are enumerated
+long get_baud_rate_bps(int baud_rate)
+{
+#ifdef ALLEGRO_WINDOWS
+   return baud_rate;
+#else
+   switch (baud_rate)
+   {
+      case BAUD_RATE_9600:   return 9600;
+      case BAUD_RATE_38400:  return 38400;
+      case BAUD_RATE_57600:  return 57600;
+      case BAUD_RATE_115200: return 115200;
+   }
+   return 9600;
+#endif
+}
@@ -12,6 +12,10 @@
    #define COM8   7
    #define BAUD_RATE_9600    9600
    #define BAUD_RATE_38400   38400
+   #define BAUD_RATE_57600   57600
+   #define BAUD_RATE_115200  115200
+   #define BAUD_RATE_230400  230400
+   #define BAUD_RATE_500000  500000
 #else
    #define DZCOMM_SECONDARY_INCLUDE
    #include <dzcomm.h>
@@ -25,6 +29,8 @@
    #define COM8   _com8
    #define BAUD_RATE_9600    _9600
    #define BAUD_RATE_38400   _38400
+   #define BAUD_RATE_57600   _57600
+   #define BAUD_RATE_115200  _115200
 #endif
 
 //read_comport returned data type
@@ -33,6 +39,7 @@
 #define PROMPT   2
 
 #define SPECIAL_DELIMITER   '\t'
+#define ECU_DELIMITER       '#'  // separates the CAN ID of the ECU from its message, when headers are on
 
 //comport status
 #define READY          0
@@ -60,11 +67,50 @@
 #define INTERFACE_ELM323   15
 #define INTERFACE_ELM327   16
 
+#define PID_MAP_RANGES     3  // number of "PIDs supported" requests: 0100, 0120, 0140
+#define MAX_RESPONSE_LINES 128 // 8 ECUs, up to 16 frames each
+#define MAX_CAN_ECUS       8   // per ISO 15765-4, CAN IDs 7E8 to 7EF
+
 // timeouts
 #define OBD_REQUEST_TIMEOUT   9900
 #define ATZ_TIMEOUT           1500
 #define AT_TIMEOUT            130
 #define ECU_TIMEOUT           5000
+#define BRD_TIMEOUT           250  // how long the interface takes to come back after AT BRD, at the new baud rate
+#define TIMING_SAMPLES        16   // number of timed responses before the ELM327 timeout is programmed
+#define MAX_REQUEST_LENGTH    40   // size of a request built by build_request(), with the CR and the NUL
+
+// response accumulator, used with read_response() and read_until_prompt()
+typedef struct
+{
+   char *data;   // NUL-terminated, allocated on first use
+   int len;      // number of characters in data
+   int size;     // number of bytes allocated
+} RX_BUFFER;
+
+// one line of a processed response, as found by index_response()
+typedef struct
+{
+   int offset;    // position of the line in the response
+   int len;       // number of characters in the line
+   int frame;     // N of an ISO 15765 "N:" frame, -1 if the line is not a numbered frame
+   int service;   // first data byte (i.e., 0x43 in response to 03), -1 if there's none
+   long ecu;      // CAN ID of the ECU that sent the message (i.e., 0x7E8), -1 if headers are off
+} RESPONSE_LINE;
+
+typedef struct
+{
+   RESPONSE_LINE line[MAX_RESPONSE_LINES];
+   int num_of_lines;
+} RESPONSE_INDEX;
+
+// state of next_message(), which reassembles ISO 15765 multi-frame messages
+typedef struct
+{
+   int line;          // next line of the index to look at
+   int message_len;   // length of the multi-frame message being reassembled, in hex digits
+   char message[256];
+} MESSAGE_READER;
 
 // function prototypes
 void serial_module_init();
@@ -72,22 +118,63 @@ void serial_module_shutdown();
 int open_comport();
 void close_comport();
 void send_command(const char *command);
+int build_request(char *tx, int size, const char *command);
+void send_request(const char *tx, int len);
+void discard_input();
 int read_comport(char *response);
+void rx_buffer_clear(RX_BUFFER *rx);
+int read_response(RX_BUFFER *rx);
+int read_until_prompt(RX_BUFFER *rx, int timeout);
 void start_serial_timer(int delay);
 void stop_serial_timer();
+int serial_time_out();
+int serial_timer_running();
 int process_response(const char *cmd_sent, char *msg_received);
 int find_valid_response(char *buf, char *response, const char *filter, char **stop);
+int index_response(const char *response, RESPONSE_INDEX *index);
+char *get_response_line(char *buf, int size, const char *response, const RESPONSE_LINE *line);
+void start_message_reader(MESSAGE_READER *reader);
+const char *next_message(MESSAGE_READER *reader, char *buf, int size, const char *response, const RESPONSE_INDEX *index, long *ecu);
 const char *get_protocol_string(int interface_type, int protocol_id);
 int display_error_message(int error, int retry);
+int parse_protocol_number(const char *response);
+int is_can_protocol();
+int parse_pid_map(char *response, int range);
+int is_pid_supported(int pid);
+int load_protocol();
+void save_protocol();
+int try_protocol(int protocol);
+int protocol_needs_init(int protocol);
+int parse_elm_version(const char *response);
+int count_responses(const char *response, const char *prefix);
+void reset_response_timing();
+void add_response_count(char *cmd);
+int learn_response_time(int latency);
+int program_adapter_timing();
+int get_request_timeout();
+int set_can_headers(int on);
+int negotiate_baud_rate();
 
 // variables
-volatile int serial_time_out;
-volatile int serial_timer_running;
-
 struct COMPORT {
    int number;
    int baud_rate;
+   int link_baud_rate;  // baud rate negotiated with AT BRD, 0 if the interface is at baud_rate
    int status;    // READY, NOT_OPEN, USER_IGNORED
 } comport;
 
+struct OBD_DEVICE
+{
+   int interface_type;  // INTERFACE_ELM320 - INTERFACE_ELM327, 0 if not identified yet
+   int protocol;        // ELM327 protocol number as reported by ATDPN, 0 if unknown
+   unsigned long pid_map[PID_MAP_RANGES]; // PIDs supported by the vehicle ($01-$20, $21-$40, $41-$60), MSB = first PID of the range
+   int pid_map_valid;   // FALSE if supported PIDs were not discovered; all PIDs are polled
+   int elm_version;     // ELM327 firmware version * 10 (i.e., 15 for v1.5), 0 if unknown
+   int num_of_ecus;     // number of ECUs that answered 0100, 0 if unknown
+   int num_of_timed_responses;  // responses timed by learn_response_time()
+   int max_response_time;       // slowest of them, in milliseconds
+   int adapter_timeout;         // milliseconds programmed with AT ST, 0 if the ELM327 default is used
+   int headers_on;      // TRUE if CAN headers are on (ATH1), responses are demultiplexed by ECU
+} obd_device;
+
 #endif
@@ -0,0 +1,515 @@
+#include <string.h>
+#include "globals.h"
+#include "serial.h"
+#include "clock.h"
+#include "vehicle_info.h"
+#include "acquisition.h"
+#include "session.h"
+
+/* The session sits on top of the acquisition engine, and is what the screens
+ * talk to the interface through.  Requests are queued with a callback, which
+ * is called from session_tick() with the answer; a screen calls
+ * session_tick() from its MSG_IDLE, so nothing ever waits for the interface
+ * while the GUI is frozen.  The queue holds more requests than the ring, the
+ * rest are handed to the engine as the ring drains.
+ *
+ * Connecting (reset, protocol detection, and the supported PIDs) is done by
+ * the session too, as a chain of requests whose callbacks queue the next
+ * step.  While it's in progress, the requests of the screens are held back.
+ * Once the vehicle is found, the session stays connected until the port is
+ * changed, so a screen that opens later doesn't have to reset the interface
+ * again; see session_state().
+ *
+ * session_start() and session_stop() nest, the engine runs while there's at
+ * least one user.  session_pause() and session_resume() hand the port back
+ * for a moment to the functions that use it directly (i.e.,
+ * program_adapter_timing()).  The requests that were in the ring when the
+ * engine was stopped are dropped without their callbacks being called.
+ */
+
+typedef struct
+{
+   char cmd[32];
+   int timeout;
+   int flags;
+   SESSION_CALLBACK callback;
+   void *context;
+} SESSION_REQUEST;
+
+static SESSION_REQUEST queue[SESSION_QUEUE_SIZE];  // waiting for a slot in the ring
+static long queue_head = 0;
+static long queue_tail = 0;
+static SESSION_REQUEST in_flight[ACQ_QUEUE_SIZE];  // in the ring, indexed by tag
+static long flight_head = 0;
+static long flight_tail = 0;
+static int generation = 0;  // changes every time the engine is stopped, and the ring emptied
+
+static int users = 0;
+static int state = SESSION_IDLE;
+static int connect_error = 0;  // see session_error()
+static int connected_port = -1;
+static const char *status = "";
+static char interface_id[32];
+
+// connect state
+static int reconnecting = FALSE;  // TRUE if the protocol that worked last time is tried first
+static int full_search = FALSE;   // TRUE if that failed, and the protocol has to be searched for
+static int waiting_for_ecu = FALSE;
+static unsigned long ecu_deadline;  // clock_ms() time when the ECU has timed out the previous session
+static int pid_range = 0;         // which "PIDs supported" range is being requested
+
+static void fill_request(SESSION_REQUEST *req, const char *cmd, int timeout, int flags, SESSION_CALLBACK callback, void *context);
+static int submit(const SESSION_REQUEST *req);
+static void feed_engine();
+static void flush();
+static void connect_request(const char *cmd, int timeout, SESSION_CALLBACK callback);
+static void start_reset();
+static void wait_for_ecu();
+static void request_0100(const char *text);
+static void detect_pids();
+static void request_next_pid_range();
+static void connected();
+static void failed(int code);
+static void reset_done(ACQ_TRANSACTION *t, void *context);
+static void protocol_done(ACQ_TRANSACTION *t, void *context);
+static void pid_map_done(ACQ_TRANSACTION *t, void *context);
+static void protocol_number_done(ACQ_TRANSACTION *t, void *context);
+static void headers_done(ACQ_TRANSACTION *t, void *context);
+static void vin_done(ACQ_TRANSACTION *t, void *context);
+static void pid_range_done(ACQ_TRANSACTION *t, void *context);
+
+
+void session_start()
+{
+   if (users++ == 0)
+   {
+      queue_head = queue_tail = 0;
+      flight_head = flight_tail = 0;
+      acq_start();
+   }
+}
+
+
+void session_stop()
+{
+   if (users == 0 || --users > 0)
+      return;
+
+   acq_stop();
+   generation++;
+   queue_head = queue_tail = 0;
+   flight_head = flight_tail = 0;
+   if (state == SESSION_CONNECTING)
+      state = SESSION_IDLE;
+   waiting_for_ecu = FALSE;
+}
+
+
+// stops the engine, so the COM port may be used directly, the queue is kept
+void session_pause()
+{
+   if (users == 0)
+      return;
+
+   acq_stop();
+   generation++;
+   flight_tail = flight_head;
+}
+
+
+void session_resume()
+{
+   if (users == 0)
+      return;
+
+   acq_start();
+   feed_engine();
+}
+
+
+void fill_request(SESSION_REQUEST *req, const char *cmd, int timeout, int flags, SESSION_CALLBACK callback, void *context)
+{
+   strncpy(req->cmd, cmd, sizeof(req->cmd) - 1);
+   req->cmd[sizeof(req->cmd) - 1] = 0;
+   req->timeout = timeout;
+   req->flags = flags;
+   req->callback = callback;
+   req->context = context;
+}
+
+
+int submit(const SESSION_REQUEST *req)
+{
+   int slot = flight_head & (ACQ_QUEUE_SIZE - 1);
+
+   if (!acq_submit(req->cmd, slot, req->timeout, req->flags))
+      return FALSE;
+
+   in_flight[slot] = *req;
+   flight_head++;
+
+   return TRUE;
+}
+
+
+// moves queued requests into the ring, while there's room; the screens wait while we connect
+void feed_engine()
+{
+   while (state != SESSION_CONNECTING && queue_tail != queue_head)
+   {
+      if (!submit(&queue[queue_tail % SESSION_QUEUE_SIZE]))
+         break;
+      queue_tail++;
+   }
+}
+
+
+/* session_request:
+ *  Queues cmd for the interface; callback is called with the answer and
+ *  context from session_tick().  The timeout and flags are as for
+ *  acq_submit().  Returns FALSE if the queue is full, or the session was not
+ *  started.
+ */
+int session_request(const char *cmd, int timeout, int flags, SESSION_CALLBACK callback, void *context)
+{
+   if (users == 0 || queue_head - queue_tail >= SESSION_QUEUE_SIZE)
+      return FALSE;
+
+   fill_request(&queue[queue_head % SESSION_QUEUE_SIZE], cmd, timeout, flags, callback, context);
+   queue_head++;
+   feed_engine();  // don't wait for the next tick, the engine may be idle
+
+   return TRUE;
+}
+
+
+// number of requests whose callbacks were not called yet
+int session_pending()
+{
+   return (queue_head - queue_tail) + (flight_head - flight_tail);
+}
+
+
+/* session_tick:
+ *  Calls the callbacks of the requests that were answered since, and keeps
+ *  the engine fed.  Screens call it from their MSG_IDLE.  A callback may
+ *  queue more requests, or even start session_connect().
+ */
+void session_tick()
+{
+   ACQ_TRANSACTION *t;
+   SESSION_REQUEST req;
+   int gen;
+
+   if (users == 0)
+      return;
+
+   while ((t = acq_get_response()) != NULL)
+   {
+      req = in_flight[t->tag];
+      flight_tail++;
+      gen = generation;
+      if (req.callback)
+         req.callback(t, req.context);
+      if (gen != generation)  // the callback stopped the engine, t is gone
+         continue;
+      acq_release();
+   }
+
+   if (waiting_for_ecu && DEADLINE_PASSED(ecu_deadline))
+   {
+      waiting_for_ecu = FALSE;
+      if (obd_device.interface_type == INTERFACE_ELM327)
+         request_0100("Detecting OBD protocol...");
+      else
+         connected();
+   }
+
+   feed_engine();
+}
+
+
+// throws away all requests, and restarts the engine
+void flush()
+{
+   acq_stop();
+   generation++;
+   queue_head = queue_tail = 0;
+   flight_head = flight_tail = 0;
+   waiting_for_ecu = FALSE;
+   acq_start();
+}
+
+
+/* session_connect:
+ *  Resets the interface and connects to the vehicle, without waiting for it;
+ *  session_state() is SESSION_CONNECTING until it's done.  Unless full_search
+ *  is TRUE, the protocol that worked the last time is tried first.  All the
+ *  queued requests are thrown away.
+ */
+void session_connect(int full)
+{
+   if (users == 0)
+      return;
+
+   flush();
+   full_search = full;
+   start_reset();
+}
+
+
+// the steps of session_connect() don't wait in the queue
+void connect_request(const char *cmd, int timeout, SESSION_CALLBACK callback)
+{
+   SESSION_REQUEST req;
+
+   fill_request(&req, cmd, timeout, 0, callback, NULL);
+   submit(&req);
+}
+
+
+void start_reset()
+{
+   state = SESSION_CONNECTING;
+   connect_error = 0;
+   waiting_for_ecu = FALSE;
+   interface_id[0] = 0;
+   reconnecting = (!full_search && load_protocol() > 0);
+   status = "Resetting hardware interface...";
+   // warm start is quicker, but only an ELM327 knows it
+   connect_request((reconnecting && obd_device.interface_type == INTERFACE_ELM327) ? "atws" : "atz", ATZ_TIMEOUT, reset_done);
+}
+
+
+void reset_done(ACQ_TRANSACTION *t, void *context)
+{
+   char cmd[8];
+   int device = t->response_type;
+
+   if (device == ACQ_TIMED_OUT)
+   {
+      failed(ACQ_TIMED_OUT);
+      return;
+   }
+
+   obd_device.elm_version = parse_elm_version(t->response.data);  // i.e., "ELM327v1.5", the version follows the ID
+   obd_device.interface_type = (device >= INTERFACE_ID) ? device : 0;
+   obd_device.protocol = 0;
+   obd_device.pid_map_valid = FALSE;
+   obd_device.num_of_ecus = 0;
+   obd_device.headers_on = FALSE;
+   reset_response_timing();  // ATZ restored the default timeout
+   clear_vehicle_info();
+   if (device < INTERFACE_ID)  // whatever answered, it's not an interface we know
+   {
+      failed(ACQ_TIMED_OUT);
+      return;
+   }
+   strncpy(interface_id, t->response.data, sizeof(interface_id) - 1);
+   interface_id[sizeof(interface_id) - 1] = 0;
+
+   if (device == INTERFACE_ELM327)
+   {
+      session_pause();
+      negotiate_baud_rate();  // the serial link shouldn't be slower than the vehicle bus
+      session_resume();
+
+      if (reconnecting)
+      {
+         sprintf(cmd, "attp%X", load_protocol());
+         connect_request(cmd, AT_TIMEOUT, protocol_done);
+         return;
+      }
+   }
+
+   reconnecting = FALSE;
+   wait_for_ecu();
+}
+
+
+void protocol_done(ACQ_TRANSACTION *t, void *context)
+{
+   if (t->response_type == ACQ_TIMED_OUT || !strstr(t->response.data, "OK"))
+      reconnecting = FALSE;
+
+   if (reconnecting && !protocol_needs_init(load_protocol()))  // no need to wait for the ECU, or to search
+      request_0100("Connecting to the vehicle...");
+   else
+      wait_for_ecu();
+}
+
+
+// ELM320 and ELM322 have nothing to search for, the others wait for the ECU to time out its previous session
+void wait_for_ecu()
+{
+   if (obd_device.interface_type == INTERFACE_ELM323 || obd_device.interface_type == INTERFACE_ELM327)
+   {
+      ecu_deadline = clock_ms() + ECU_TIMEOUT;
+      waiting_for_ecu = TRUE;
+      status = "Waiting for ECU timeout...";
+   }
+   else
+      connected();
+}
+
+
+void request_0100(const char *text)
+{
+   status = text;
+   connect_request("0100", OBD_REQUEST_TIMEOUT, pid_map_done);
+}
+
+
+void pid_map_done(ACQ_TRANSACTION *t, void *context)
+{
+   if (t->response_type == HEX_DATA)
+   {
+      parse_pid_map(t->response.data, 0);
+      obd_device.num_of_ecus = count_responses(t->response.data, "4100");
+      connect_request("atdpn", AT_TIMEOUT, protocol_number_done);  // find out which protocol was detected
+   }
+   else if (reconnecting)  // vehicle was changed, or it did not like the quick reconnect
+   {
+      full_search = TRUE;
+      start_reset();
+   }
+   else
+      failed(t->response_type);
+}
+
+
+// protocol is not essential, nobody is bothered if it can't be read
+void protocol_number_done(ACQ_TRANSACTION *t, void *context)
+{
+   if (t->response_type == HEX_DATA)
+   {
+      obd_device.protocol = parse_protocol_number(t->response.data);
+      save_protocol();  // try it first the next time we connect
+   }
+
+   // optionally tell the ECUs apart by their CAN IDs
+   if (is_can_protocol() && get_config_int("comm", "can_headers", FALSE))
+      connect_request("ath1", AT_TIMEOUT, headers_done);
+   else
+      detect_pids();
+}
+
+
+void headers_done(ACQ_TRANSACTION *t, void *context)
+{
+   if (t->response_type != ACQ_TIMED_OUT && strstr(t->response.data, "OK"))
+      obd_device.headers_on = TRUE;
+
+   detect_pids();
+}
+
+
+// the VIN tells whether we've seen the vehicle before, mode 09 is not essential though
+void detect_pids()
+{
+   status = "Reading VIN...";
+   connect_request("0902", OBD_REQUEST_TIMEOUT, vin_done);
+}
+
+
+void vin_done(ACQ_TRANSACTION *t, void *context)
+{
+   if (t->response_type == HEX_DATA)
+      parse_vehicle_info(INFO_TYPE_VIN, t->response.data);
+
+   load_vehicle_profile();  // if we know the VIN, its supported PIDs and response time are restored
+   if (obd_device.pid_map_valid)  // we've seen this vehicle before, no need to ask for the other PIDs
+   {
+      connected();
+      return;
+   }
+
+   pid_range = 0;
+   request_next_pid_range();
+}
+
+
+void request_next_pid_range()
+{
+   char cmd[8];
+
+   // the last PID of each range tells whether the next range is supported
+   if ((pid_range < PID_MAP_RANGES - 1) && (obd_device.pid_map[pid_range] & 1))
+   {
+      pid_range++;
+      sprintf(cmd, "01%02X", pid_range*0x20);
+      status = "Detecting supported PIDs...";
+      connect_request(cmd, OBD_REQUEST_TIMEOUT, pid_range_done);
+      return;
+   }
+
+   for (pid_range++; pid_range < PID_MAP_RANGES; pid_range++)
+      obd_device.pid_map[pid_range] = 0;
+   obd_device.pid_map_valid = TRUE;
+   save_vehicle_profile();  // does nothing if the VIN is not known
+   connected();
+}
+
+
+void pid_range_done(ACQ_TRANSACTION *t, void *context)
+{
+   if (t->response_type == ACQ_TIMED_OUT)  // don't cache an incomplete list, all PIDs will be polled
+   {
+      connected();
+      return;
+   }
+
+   if (t->response_type != HEX_DATA || !parse_pid_map(t->response.data, pid_range))
+      obd_device.pid_map[pid_range] = 0;
+   request_next_pid_range();
+}
+
+
+void connected()
+{
+   state = SESSION_READY;
+   status = "";
+   connected_port = comport.number;
+}
+
+
+void failed(int code)
+{
+   state = SESSION_FAILED;
+   status = "";
+   connect_error = code;
+}
+
+
+/* session_state:
+ *  Returns one of the SESSION_* states.  A session that was connected goes
+ *  back to SESSION_IDLE when the port is closed or changed.
+ */
+int session_state()
+{
+   if (state == SESSION_READY && (comport.status != READY || comport.number != connected_port))
+      state = SESSION_IDLE;
+
+   return state;
+}
+
+
+// why session_connect() failed: ACQ_TIMED_OUT if no interface was found, otherwise what process_response() made of 0100
+int session_error()
+{
+   return connect_error;
+}
+
+
+// what session_connect() is doing, for progress messages
+const char *session_status()
+{
+   return status;
+}
+
+
+// processed response to ATZ (i.e., "ELM327v1.5"), "" if the interface was not identified
+const char *session_interface_id()
+{
+   return interface_id;
+}
@@ -0,0 +1,28 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#define SESSION_QUEUE_SIZE   16  // requests waiting for a slot in the acquisition ring
+
+// session states
+#define SESSION_IDLE         0   // not connected yet, or the port was changed since
+#define SESSION_CONNECTING   1   // session_connect() is in progress
+#define SESSION_READY        2   // interface was reset, and the vehicle found (if the interface can look for it)
+#define SESSION_FAILED       3   // session_connect() did not succeed, see session_error()
+
+// called from session_tick() with the answered request, the transaction is only valid until it returns
+typedef void (*SESSION_CALLBACK)(ACQ_TRANSACTION *t, void *context);
+
+void session_start();
+void session_stop();
+void session_pause();
+void session_resume();
+int session_request(const char *cmd, int timeout, int flags, SESSION_CALLBACK callback, void *context);
+int session_pending();
+void session_tick();
+void session_connect(int full_search);
+int session_state();
+int session_error();
+const char *session_status();
+const char *session_interface_id();
+
+#endif
@@ -0,0 +1,297 @@
+#include "globals.h"
+#include "error_handlers.h"
+#include "clock.h"
+#include "strip_chart.h"
+
+#define MAX_CHART_WIDTH      640  // number of columns kept, must not be less than the width of the chart
+#define CHART_LEGEND_HEIGHT  40
+
+/* The strip chart plots up to CHART_CHANNELS channels against time, one pixel
+ * column for every CHART_COLUMN_TIME milliseconds.  Samples are not kept:
+ * each one only widens the min/max range of the column it falls into, so the
+ * cost of plotting depends on the width of the chart, not on how fast the
+ * samples arrive.  When time moves on, the plot is scrolled left inside the
+ * chart bitmap, and only the new columns (and the one that was still filling
+ * up) are drawn.  The whole chart is redrawn only when a channel's vertical
+ * range has to grow, or when the dialog is redrawn.
+ */
+
+typedef struct
+{
+   float min;  // min > max if there are no samples in the column
+   float max;
+} CHART_COLUMN;
+
+typedef struct
+{
+   const char *label;  // NULL if the channel is not used
+   int precision;      // number of decimals shown in the legend
+   int color;
+   float low, high;    // vertical range
+   int has_range;      // FALSE until the first sample
+   CHART_COLUMN columns[MAX_CHART_WIDTH];  // indexed by column number % MAX_CHART_WIDTH
+} CHART_CHANNEL;
+
+static CHART_CHANNEL channels[CHART_CHANNELS];
+static unsigned long start_time = 0;  // clock_ms() time of the start of column 0
+static long newest_column = 0;        // column the current time falls into
+static long painted_column = -1;      // newest column painted into chart_bitmap
+static long changed_column = 0;       // oldest column that got a sample since it was painted
+static int full_redraw = TRUE;        // TRUE if the whole chart has to be redrawn
+static BITMAP *chart_bitmap = NULL;
+
+static void advance_to(long column);
+static void expand_range(CHART_CHANNEL *channel, float value);
+static void draw_chart(DIALOG *d);
+static void draw_column(DIALOG *d, int x, long column);
+static void scroll_chart(DIALOG *d);
+
+
+// removes all channels and samples
+void chart_clear()
+{
+   int i;
+
+   for (i = 0; i < CHART_CHANNELS; i++)
+      channels[i].label = NULL;
+
+   start_time = clock_ms();
+   newest_column = 0;
+   painted_column = -1;
+   changed_column = 0;
+   full_redraw = TRUE;
+}
+
+
+/* chart_set_channel:
+ *  label is shown in the legend, in color, along with the vertical range (with
+ *  precision decimals).  The channel starts out empty.
+ */
+void chart_set_channel(int channel, const char *label, int precision, int color)
+{
+   int i;
+
+   channels[channel].label = label;
+   channels[channel].precision = precision;
+   channels[channel].color = color;
+   channels[channel].has_range = FALSE;
+   for (i = 0; i < MAX_CHART_WIDTH; i++)
+   {
+      channels[channel].columns[i].min = 1;
+      channels[channel].columns[i].max = 0;
+   }
+   full_redraw = TRUE;
+}
+
+
+// time is the clock_ms() time when the sample was taken
+void chart_add_sample(int channel, unsigned long time, float value)
+{
+   CHART_CHANNEL *ch = &channels[channel];
+   CHART_COLUMN *column;
+   long n;
+
+   if (!ch->label || (long)(time - start_time) < 0)  // unused channel, or sample from before the chart was cleared
+      return;
+
+   n = (time - start_time) / CHART_COLUMN_TIME;
+   advance_to(n);
+   if (n <= newest_column - MAX_CHART_WIDTH)  // scrolled off already
+      return;
+
+   column = &ch->columns[n % MAX_CHART_WIDTH];
+   if (column->min > column->max)
+      column->min = column->max = value;
+   else if (value < column->min)
+      column->min = value;
+   else if (value > column->max)
+      column->max = value;
+
+   if (!ch->has_range || value < ch->low || value > ch->high)
+      expand_range(ch, value);
+
+   if (n < changed_column)
+      changed_column = n;
+}
+
+
+// starts new (empty) columns, up to and including column
+void advance_to(long column)
+{
+   long n;
+   int i;
+
+   if (column <= newest_column)
+      return;
+
+   for (n = MAX(newest_column + 1, column - MAX_CHART_WIDTH + 1); n <= column; n++)
+   {
+      for (i = 0; i < CHART_CHANNELS; i++)
+      {
+         channels[i].columns[n % MAX_CHART_WIDTH].min = 1;
+         channels[i].columns[n % MAX_CHART_WIDTH].max = 0;
+      }
+   }
+
+   newest_column = column;
+}
+
+
+// grows the vertical range of the channel to include value, with a margin so it doesn't grow on every sample
+void expand_range(CHART_CHANNEL *channel, float value)
+{
+   float margin;
+
+   if (channel->has_range)
+   {
+      channel->low = MIN(channel->low, value);
+      channel->high = MAX(channel->high, value);
+   }
+   else
+   {
+      channel->low = channel->high = value;
+      channel->has_range = TRUE;
+   }
+
+   margin = (channel->high - channel->low) * 0.1;
+   if (margin <= 0)
+      margin = MAX(ABS(value) * 0.1, 1);
+
+   channel->low -= margin;
+   channel->high += margin;
+   full_redraw = TRUE;
+}
+
+
+int strip_chart_proc(int msg, DIALOG *d, int c)
+{
+   switch (msg)
+   {
+      case MSG_START:
+         if (!(chart_bitmap = create_bitmap(d->w, d->h)))
+            fatal_error("Could not allocate enough memory for strip chart");
+         full_redraw = TRUE;
+         break;
+
+      case MSG_END:
+         destroy_bitmap(chart_bitmap);
+         chart_bitmap = NULL;
+         break;
+
+      case MSG_DRAW:
+         full_redraw = TRUE;
+         // fall through
+
+      case MSG_IDLE:
+         advance_to((clock_ms() - start_time) / CHART_COLUMN_TIME);
+         if (full_redraw || newest_column - painted_column >= d->w - 2)
+            draw_chart(d);
+         else if (newest_column > painted_column || changed_column <= painted_column)
+            scroll_chart(d);
+         else
+            break;
+
+         scare_mouse_area(d->x, d->y, d->w, d->h);
+         blit(chart_bitmap, screen, 0, 0, d->x, d->y, d->w, d->h);
+         unscare_mouse();
+         break;
+   }
+
+   return D_O_K;
+}
+
+
+// draws the frame, the legend, and all columns
+void draw_chart(DIALOG *d)
+{
+   char buf[96];
+   CHART_CHANNEL *ch;
+   int x, i;
+
+   clear_to_color(chart_bitmap, d->bg);
+   rect(chart_bitmap, 0, 0, d->w - 1, d->h - 1, d->fg);
+   hline(chart_bitmap, 1, CHART_LEGEND_HEIGHT - 1, d->w - 2, d->fg);
+
+   for (i = 0; i < CHART_CHANNELS; i++)
+   {
+      ch = &channels[i];
+      if (!ch->label)
+         continue;
+      if (ch->has_range)
+         sprintf(buf, "%s %.*f .. %.*f", ch->label, ch->precision, ch->low, ch->precision, ch->high);
+      else
+         sprintf(buf, "%s N/A", ch->label);
+      gui_textout_ex(chart_bitmap, buf, 6 + (i % 2) * (d->w / 2), 2 + (i / 2) * (CHART_LEGEND_HEIGHT / 2), ch->color, d->bg, FALSE);
+   }
+
+   for (x = 1; x < d->w - 1; x++)
+      draw_column(d, x, newest_column - (d->w - 2 - x));
+
+   painted_column = newest_column;
+   changed_column = newest_column + 1;
+   full_redraw = FALSE;
+}
+
+
+/* draw_column:
+ *  Draws the column at x of the plot area.  Each channel gets a vertical line
+ *  from its min to its max in that column, stretched to meet the line of the
+ *  previous column, so the trace has no gaps.
+ */
+void draw_column(DIALOG *d, int x, long column)
+{
+   const int top = CHART_LEGEND_HEIGHT;
+   const int height = d->h - 1 - top;  // rows in the plot area
+   CHART_COLUMN *cur, *prev;
+   CHART_CHANNEL *ch;
+   float low, high;
+   int i;
+
+   vline(chart_bitmap, x, top, top + height - 1, d->bg);
+   if (column < 0 || column <= newest_column - MAX_CHART_WIDTH)
+      return;
+
+   for (i = 0; i < CHART_CHANNELS; i++)
+   {
+      ch = &channels[i];
+      cur = &ch->columns[column % MAX_CHART_WIDTH];
+      if (!ch->label || cur->min > cur->max)
+         continue;
+
+      low = cur->min;
+      high = cur->max;
+      if (column > 0 && column - 1 > newest_column - MAX_CHART_WIDTH)
+      {
+         prev = &ch->columns[(column - 1) % MAX_CHART_WIDTH];
+         if (prev->min <= prev->max)
+         {
+            low = MIN(low, prev->max);
+            high = MAX(high, prev->min);
+         }
+      }
+
+      vline(chart_bitmap, x,
+         top + height - 1 - (int)((high - ch->low) * (height - 1) / (ch->high - ch->low)),
+         top + height - 1 - (int)((low - ch->low) * (height - 1) / (ch->high - ch->low)),
+         ch->color);
+   }
+}
+
+
+// scrolls the plot area left to newest_column, and draws the columns that are new or got samples since they were painted
+void scroll_chart(DIALOG *d)
+{
+   const int width = d->w - 2;  // columns in the plot area
+   long shift = newest_column - painted_column;
+   long first = MIN(painted_column, changed_column);
+   long column;
+
+   if (shift > 0)
+      blit(chart_bitmap, chart_bitmap, 1 + shift, CHART_LEGEND_HEIGHT, 1, CHART_LEGEND_HEIGHT, width - shift, d->h - 1 - CHART_LEGEND_HEIGHT);
+
+   for (column = MAX(first, newest_column - width + 1); column <= newest_column; column++)
+      draw_column(d, 1 + width - 1 - (newest_column - column), column);
+
+   painted_column = newest_column;
+   changed_column = newest_column + 1;
+}
@@ -0,0 +1,12 @@
+#ifndef STRIP_CHART_H
+#define STRIP_CHART_H
+
+#define CHART_CHANNELS      4
+#define CHART_COLUMN_TIME   50  // milliseconds covered by one pixel column
+
+void chart_clear();
+void chart_set_channel(int channel, const char *label, int precision, int color);
+void chart_add_sample(int channel, unsigned long time, float value);
+int strip_chart_proc(int msg, DIALOG *d, int c);
+
+#endif
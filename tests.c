@@ -0,0 +1,842 @@
+#include <string.h>
+#include "globals.h"
+#include "serial.h"
+#include "custom_gui.h"
+#include "error_handlers.h"
+#include "acquisition.h"
+#include "session.h"
+#include "vehicle_info.h"
+#include "tests.h"
+
+#define MSG_READY           MSG_USER      // results changed, repaint
+#define MSG_REFRESH_TESTS   MSG_USER + 1  // read the tests again
+
+#define PIPELINE_DEPTH      2     // number of requests queued with the session
+#define MID_MAP_RANGES      8     // "MIDs supported" $00, $20, ... $E0
+#define MAX_TEST_RESULTS    512
+#define MAX_TEST_REQUESTS   (0x100 + 4)
+
+// request tags, the low byte is the PID or MID
+#define TAG_READINESS       0x100
+#define TAG_SUPPORTED       0x200
+#define TAG_RESULTS         0x300
+
+// monitors, in the order of monitors[]
+#define MON_MISFIRE           0
+#define MON_FUEL_SYSTEM       1
+#define MON_COMPONENTS        2
+#define MON_CATALYST          3
+#define MON_HEATED_CATALYST   4
+#define MON_EVAP              5
+#define MON_SECONDARY_AIR     6
+#define MON_O2_SENSOR         7
+#define MON_O2_HEATER         8
+#define MON_EGR               9
+#define MON_NOX               10
+#define MON_BOOST             11
+#define MON_PM_FILTER         12
+
+/* Monitor readiness comes from PID $01 (since the DTCs were cleared) and PID
+ * $41 (this drive cycle).  Test results are read with mode 06, which is only
+ * defined for test IDs by monitor (OBDMIDs) on CAN, so results are not read on
+ * the other protocols.  The supported-MID bitmap is cached in scantool.cfg,
+ * like the supported PIDs, so the first read goes straight to the tests.
+ *
+ * A non-continuous monitor that completed in this drive cycle won't run again
+ * until the next one, so its results can't change: a refresh re-requests only
+ * the MIDs of continuous monitors (misfire, fuel system), of monitors that did
+ * not complete yet, and the ones we can't tell.  All requests are queued with
+ * the session, as on the Sensor Data page.
+ */
+
+typedef struct
+{
+   const char *name;
+   int continuous;  // TRUE for misfire, fuel system and components, which are in byte B of PID $01
+   int spark_bit;   // bit in bytes B or C/D for spark ignition engines, -1 if not defined
+   int diesel_bit;  // same, for compression ignition engines
+} MONITOR;
+
+typedef struct
+{
+   int first_mid;
+   int last_mid;
+   const char *name;
+   int monitor;
+} MID_RANGE;
+
+typedef struct
+{
+   int uasid;
+   const char *unit;  // NULL ends the table
+   float scale;       // value = raw*scale + offset
+   float offset;
+   int precision;
+} UNIT_AND_SCALING;
+
+typedef struct
+{
+   int mid;
+   int tid;
+   int uasid;       // unit and scaling ID
+   unsigned int value;
+   unsigned int min;
+   unsigned int max;
+   long ecu;        // CAN ID of the ECU, -1 if headers are off
+} TEST_RESULT;
+
+typedef struct
+{
+   char cmd[16];
+   int tag;
+} TEST_REQUEST;
+
+static const MONITOR monitors[] =
+{
+   { "Misfire",                  TRUE,  0,  0  },
+   { "Fuel system",              TRUE,  1,  1  },
+   { "Comprehensive components", TRUE,  2,  2  },
+   { "Catalyst",                 FALSE, 0,  0  },  // NMHC catalyst on diesels
+   { "Heated catalyst",          FALSE, 1,  -1 },
+   { "Evaporative system",       FALSE, 2,  -1 },
+   { "Secondary air system",     FALSE, 3,  -1 },
+   { "Oxygen sensor",            FALSE, 5,  5  },  // exhaust gas sensor on diesels
+   { "Oxygen sensor heater",     FALSE, 6,  -1 },
+   { "EGR/VVT system",           FALSE, 7,  7  },
+   { "NOx/SCR aftertreatment",   FALSE, -1, 1  },
+   { "Boost pressure",           FALSE, -1, 3  },
+   { "PM filter",                FALSE, -1, 6  }
+};
+
+static const MID_RANGE mid_ranges[] =
+{
+   { 0x01, 0x10, "O2 sensor",         MON_O2_SENSOR },
+   { 0x21, 0x24, "Catalyst",          MON_CATALYST },
+   { 0x31, 0x38, "EGR/VVT",           MON_EGR },
+   { 0x39, 0x3D, "EVAP",              MON_EVAP },
+   { 0x41, 0x50, "O2 sensor heater",  MON_O2_HEATER },
+   { 0x61, 0x64, "Heated catalyst",   MON_HEATED_CATALYST },
+   { 0x71, 0x74, "Secondary air",     MON_SECONDARY_AIR },
+   { 0x81, 0x84, "Fuel system",       MON_FUEL_SYSTEM },
+   { 0x85, 0x86, "Boost pressure",    MON_BOOST },
+   { 0x90, 0x91, "NOx adsorber",      MON_NOX },
+   { 0x98, 0x99, "NOx catalyst",      MON_NOX },
+   { 0xA1, 0xA1, "Misfire (general)", MON_MISFIRE },
+   { 0xA2, 0xAD, "Misfire cylinder",  MON_MISFIRE },
+   { 0xB0, 0xB1, "PM filter",         MON_PM_FILTER },
+   { 0,    0,    NULL,                0 }
+};
+
+// the common unit and scaling IDs, signed if UASID & 0x80 (with the same scale, but no offset); values with other IDs are shown raw
+static const UNIT_AND_SCALING unit_and_scaling[] =
+{
+   { 0x01, "",       1,           0,    0 },
+   { 0x02, "",       1,           0,    0 },
+   { 0x07, " rpm",   0.25,        0,    0 },
+   { 0x08, " km/h",  0.01,        0,    2 },
+   { 0x09, " km/h",  1,           0,    0 },
+   { 0x0A, " mV",    0.122,       0,    1 },
+   { 0x0B, " V",     0.001,       0,    3 },
+   { 0x0C, " V",     0.01,        0,    2 },
+   { 0x0D, " mA",    0.00390625,  0,    3 },
+   { 0x0E, " A",     0.001,       0,    3 },
+   { 0x0F, " A",     0.01,        0,    2 },
+   { 0x10, " ms",    1,           0,    0 },
+   { 0x11, " ms",    100,         0,    0 },
+   { 0x12, " s",     1,           0,    0 },
+   { 0x13, " mOhm",  1,           0,    0 },
+   { 0x14, " Ohm",   1,           0,    0 },
+   { 0x15, " kOhm",  1,           0,    0 },
+   { 0x16, "\xB0 C", 0.1,         -40,  1 },
+   { 0x17, " kPa",   0.01,        0,    2 },
+   { 0x18, " kPa",   0.0117,      0,    2 },
+   { 0x19, " kPa",   0.079,       0,    1 },
+   { 0x1A, " kPa",   1,           0,    0 },
+   { 0x1B, " kPa",   10,          0,    0 },
+   { 0x1C, "\xB0",   0.01,        0,    2 },
+   { 0x1D, "\xB0",   0.5,         0,    1 },
+   { 0x1E, "",       0.0000305,   0,    3 },
+   { 0x1F, "",       0.05,        0,    2 },
+   { 0x22, " Hz",    1,           0,    0 },
+   { 0x24, "",       1,           0,    0 },
+   { 0x25, " km",    1,           0,    0 },
+   { 0x27, " g/s",   0.01,        0,    2 },
+   { 0x28, " g/s",   1,           0,    0 },
+   { 0x2F, "%",      0.01,        0,    2 },
+   { 0x34, " min",   1,           0,    0 },
+   { 0x35, " ms",    10,          0,    0 },
+   { 0,    NULL,     0,           0,    0 }
+};
+
+static TEST_RESULT *results = NULL;
+static int num_of_results = 0;
+static unsigned long mid_map[MID_MAP_RANGES];  // MIDs supported by the vehicle, MSB = first MID of the range
+static int mid_map_valid = FALSE;
+static unsigned char mid_read[0x100];  // TRUE if the results of the MID were read since the screen was opened
+
+static unsigned long readiness;        // PID $01 data, bytes A-D
+static unsigned long cycle_readiness;  // PID $41 data (this drive cycle)
+static int readiness_valid = FALSE;
+static int cycle_readiness_valid = FALSE;
+
+static TEST_REQUEST requests[MAX_TEST_REQUESTS];
+static int next_request = 0;
+static int num_of_requests = 0;
+static int awaiting_readiness = 0;  // readiness requests that were not answered yet
+static int awaiting_map = 0;        // "MIDs supported" requests that were not answered yet
+static int map_received = FALSE;    // TRUE if a "MIDs supported" bitmap arrived
+static int map_incomplete = FALSE;  // TRUE if a "MIDs supported" request timed out, or failed
+static int mids_queued = FALSE;     // TRUE if the MID requests of this refresh were queued
+static int reading = FALSE;         // TRUE while a refresh is in progress
+static int num_of_mid_requests = 0;
+static int num_of_mids_read = 0;
+static int num_of_mids_skipped = 0;
+
+static char readiness_text[1024];
+static char status_text[96];
+
+static void start_refresh();
+static void queue_request(const char *cmd, int tag);
+static void queue_mid_requests();
+static void handle_test_response(ACQ_TRANSACTION *transaction, void *context);
+static void parse_readiness(const char *msg, int pid);
+static void parse_mid_map(const char *msg);
+static void parse_test_results(const char *msg, long ecu);
+static void store_test_result(const TEST_RESULT *result);
+static const MID_RANGE *find_mid_range(int mid);
+static int is_mid_supported(int mid);
+static int mid_can_change(int mid);
+static int monitor_bit(unsigned long data, const MONITOR *monitor);
+static int monitor_supported(unsigned long data, const MONITOR *monitor);
+static int monitor_complete(unsigned long data, const MONITOR *monitor);
+static void format_readiness();
+static void format_test_value(int uasid, unsigned int raw, char *buf);
+static int load_mid_map();
+static void save_mid_map();
+
+static int readiness_proc(int msg, DIALOG *d, int c);
+static int test_list_proc(int msg, DIALOG *d, int c);
+static char *test_list_getter(int index, int *list_size);
+static int test_status_proc(int msg, DIALOG *d, int c);
+static int refresh_proc(int msg, DIALOG *d, int c);
+static int test_reader_proc(int msg, DIALOG *d, int c);
+
+static DIALOG tests_dialog[] =
+{
+   /* (proc)            (x)  (y)  (w)  (h)  (fg)     (bg)           (key) (flags) (d1) (d2) (dp)                             (dp2) (dp3) */
+   { d_clear_proc,      0,   0,   0,   0,   0,       C_WHITE,       0,    0,      0,   0,   NULL,                            NULL, NULL },
+   { d_box_proc,        25,  25,  590, 24,  C_BLACK, C_DARK_GRAY,   0,    0,      0,   0,   NULL,                            NULL, NULL },
+   { caption_proc,      320, 28,  290, 19,  C_WHITE, C_TRANSP,      0,    0,      0,   0,   "Monitor Readiness",             NULL, NULL },
+   { readiness_proc,    25,  49,  590, 116, C_BLACK, C_LIGHT_GRAY,  0,    0,      0,   0,   readiness_text,                  NULL, NULL },
+   { d_box_proc,        25,  173, 590, 24,  C_BLACK, C_DARK_GRAY,   0,    0,      0,   0,   NULL,                            NULL, NULL },
+   { caption_proc,      320, 176, 290, 19,  C_WHITE, C_TRANSP,      0,    0,      0,   0,   "On-Board Monitor Test Results", NULL, NULL },
+   { test_list_proc,    25,  197, 590, 200, C_BLACK, C_LIGHT_GRAY,  0,    0,      0,   0,   test_list_getter,                NULL, NULL },
+   { test_status_proc,  25,  422, 340, 20,  C_BLACK, C_WHITE,       0,    0,      0,   0,   status_text,                     NULL, NULL },
+   { refresh_proc,      380, 408, 110, 48,  C_BLACK, C_DARK_YELLOW, 'r',  D_EXIT, 0,   0,   "&Refresh",                      NULL, NULL },
+   { d_button_proc,     505, 408, 110, 48,  C_BLACK, C_GREEN,       'm',  D_EXIT, 0,   0,   "Main &Menu",                    NULL, NULL },
+   { test_reader_proc,  0,   0,   0,   0,   0,       0,             0,    0,      0,   0,   NULL,                            NULL, NULL },
+   { NULL,              0,   0,   0,   0,   0,       0,             0,    0,      0,   0,   NULL,                            NULL, NULL }
+};
+
+
+int display_tests()
+{
+   int ret;
+
+   if (comport.status == READY && session_state() != SESSION_READY)  // we don't know the vehicle yet
+      reset_chip();
+
+   if (!(results = (TEST_RESULT *)calloc(MAX_TEST_RESULTS, sizeof(TEST_RESULT))))
+      fatal_error("Could not allocate enough memory for test results");
+   num_of_results = 0;
+   mid_map_valid = FALSE;
+   memset(mid_read, 0, sizeof(mid_read));
+
+   session_start();
+   ret = do_dialog(tests_dialog, -1);
+   session_stop();
+
+   free(results);
+   results = NULL;
+
+   return ret;
+}
+
+
+void start_refresh()
+{
+   next_request = num_of_requests = 0;
+   awaiting_readiness = awaiting_map = 0;
+   readiness_valid = cycle_readiness_valid = FALSE;
+   num_of_mid_requests = num_of_mids_read = num_of_mids_skipped = 0;
+   mids_queued = FALSE;
+   reading = FALSE;
+
+   if (comport.status != READY)
+   {
+      sprintf(status_text, "COM%i is not ready", comport.number + 1);
+      format_readiness();
+      return;
+   }
+
+   queue_request("0101", TAG_READINESS | 0x01);
+   awaiting_readiness++;
+   if (is_pid_supported(0x41))
+   {
+      queue_request("0141", TAG_READINESS | 0x41);
+      awaiting_readiness++;
+   }
+
+   if (is_can_protocol() && !mid_map_valid && !load_mid_map())
+   {
+      // up to 6 "MIDs supported" fit in one request, the ranges that are not supported are not answered
+      queue_request("06002040" "6080A0", TAG_SUPPORTED);
+      queue_request("06C0E0", TAG_SUPPORTED);
+      awaiting_map = 2;
+      map_received = map_incomplete = FALSE;
+      memset(mid_map, 0, sizeof(mid_map));
+   }
+
+   reading = TRUE;
+   strcpy(status_text, "Reading monitor readiness...");
+}
+
+
+void queue_request(const char *cmd, int tag)
+{
+   if (num_of_requests < MAX_TEST_REQUESTS)
+   {
+      strcpy(requests[num_of_requests].cmd, cmd);
+      requests[num_of_requests].tag = tag;
+      num_of_requests++;
+   }
+}
+
+
+// queues the supported MIDs that were never read, or whose results may have changed
+void queue_mid_requests()
+{
+   char cmd[8];
+   int mid;
+
+   mids_queued = TRUE;
+   if (!is_can_protocol())
+      return;
+
+   for (mid = 1; mid < 0x100; mid++)
+   {
+      if (mid % 0x20 == 0 || !is_mid_supported(mid))
+         continue;
+      if (mid_read[mid] && !mid_can_change(mid))
+      {
+         num_of_mids_skipped++;
+         continue;
+      }
+      sprintf(cmd, "06%02X", mid);
+      queue_request(cmd, TAG_RESULTS | mid);
+      num_of_mid_requests++;
+   }
+}
+
+
+// context is the TEST_REQUEST
+void handle_test_response(ACQ_TRANSACTION *transaction, void *context)
+{
+   int tag = ((TEST_REQUEST *)context)->tag;
+   MESSAGE_READER reader;
+   const char *message;
+   char buf[256];
+   long ecu;
+
+   if (transaction->response_type == HEX_DATA)
+   {
+      start_message_reader(&reader);
+      while ((message = next_message(&reader, buf, sizeof(buf), transaction->response.data, &transaction->lines, &ecu)))
+      {
+         switch (tag & 0xF00)
+         {
+            case TAG_READINESS:
+               parse_readiness(message, tag & 0xFF);
+               break;
+            case TAG_SUPPORTED:
+               parse_mid_map(message);
+               break;
+            case TAG_RESULTS:
+               parse_test_results(message, ecu);
+               break;
+         }
+      }
+   }
+
+   switch (tag & 0xF00)
+   {
+      case TAG_READINESS:
+         awaiting_readiness--;
+         format_readiness();
+         break;
+
+      case TAG_SUPPORTED:
+         // NO DATA is fine, the ranges that are not supported are not answered
+         if (transaction->response_type != HEX_DATA && transaction->response_type != ERR_NO_DATA)
+            map_incomplete = TRUE;
+         if (--awaiting_map == 0 && map_received && !map_incomplete)  // don't cache an incomplete map
+         {
+            mid_map_valid = TRUE;
+            save_mid_map();
+         }
+         break;
+
+      case TAG_RESULTS:
+         mid_read[tag & 0xFF] = TRUE;
+         num_of_mids_read++;
+         break;
+   }
+
+   // which tests can change depends on readiness, so the MIDs are queued once all of it is in
+   if (!mids_queued && awaiting_readiness == 0 && awaiting_map == 0)
+      queue_mid_requests();
+
+   if (mids_queued && num_of_mid_requests > 0)
+      sprintf(status_text, "Reading test results... %i of %i", num_of_mids_read, num_of_mid_requests);
+   broadcast_dialog_message(MSG_READY, 0);
+}
+
+
+// msg is a mode 01 message with PID $01 or $41, several ECUs are combined
+void parse_readiness(const char *msg, int pid)
+{
+   char prefix[8];
+   char data[12];
+   unsigned long value;
+   unsigned long dtc_count;
+
+   sprintf(prefix, "41%02X", pid);
+   if (strncmp(msg, prefix, 4) != 0 || strlen(msg) < 12)
+      return;
+
+   strncpy(data, msg + 4, 8);
+   data[8] = 0;
+   value = strtoul(data, NULL, 16);
+
+   // a monitor is supported if any ECU supports it, and incomplete if any ECU did not complete it
+   if (pid == 0x01)
+   {
+      if (readiness_valid)  // except for the number of DTCs (bits 0-6 of byte A), which add up
+      {
+         dtc_count = MIN(((readiness >> 24) & 0x7F) + ((value >> 24) & 0x7F), 0x7F);
+         readiness = ((readiness | value) & ~0x7F000000UL) | (dtc_count << 24);
+      }
+      else
+         readiness = value;
+      readiness_valid = TRUE;
+   }
+   else
+   {
+      cycle_readiness = (cycle_readiness_valid) ? (cycle_readiness | value) : value;
+      cycle_readiness_valid = TRUE;
+   }
+}
+
+
+// msg is "46" followed by MID/bitmap pairs
+void parse_mid_map(const char *msg)
+{
+   char buf[12];
+   int len = strlen(msg);
+   int pos, mid;
+
+   if (strncmp(msg, "46", 2) != 0)
+      return;
+
+   for (pos = 2; pos + 10 <= len; pos += 10)
+   {
+      strncpy(buf, msg + pos, 2);
+      buf[2] = 0;
+      mid = strtol(buf, NULL, 16);
+      if (mid % 0x20 != 0)  // not a "MIDs supported" record
+         break;
+      strncpy(buf, msg + pos + 2, 8);
+      buf[8] = 0;
+      mid_map[mid / 0x20] |= strtoul(buf, NULL, 16);
+      map_received = TRUE;
+   }
+}
+
+
+// msg is "46" followed by 9-byte records: MID, TID, UASID, value, min, and max (2 bytes each)
+void parse_test_results(const char *msg, long ecu)
+{
+   TEST_RESULT result;
+   char buf[20];
+   int len = strlen(msg);
+   int pos;
+
+   if (strncmp(msg, "46", 2) != 0)
+      return;
+
+   for (pos = 2; pos + 18 <= len; pos += 18)
+   {
+      strncpy(buf, msg + pos, 18);
+      buf[18] = 0;
+      result.max = strtoul(buf + 14, NULL, 16);
+      buf[14] = 0;
+      result.min = strtoul(buf + 10, NULL, 16);
+      buf[10] = 0;
+      result.value = strtoul(buf + 6, NULL, 16);
+      buf[6] = 0;
+      result.uasid = strtol(buf + 4, NULL, 16);
+      buf[4] = 0;
+      result.tid = strtol(buf + 2, NULL, 16);
+      buf[2] = 0;
+      result.mid = strtol(buf, NULL, 16);
+      result.ecu = ecu;
+      store_test_result(&result);
+   }
+}
+
+
+// replaces the earlier result of the same test, results are kept in MID/TID order
+void store_test_result(const TEST_RESULT *result)
+{
+   int i;
+
+   for (i = 0; i < num_of_results; i++)
+   {
+      if (results[i].mid == result->mid && results[i].tid == result->tid && results[i].ecu == result->ecu)
+      {
+         results[i] = *result;
+         return;
+      }
+      if (results[i].mid > result->mid || (results[i].mid == result->mid && results[i].tid > result->tid))
+         break;
+   }
+
+   if (num_of_results >= MAX_TEST_RESULTS)
+      return;
+
+   memmove(&results[i + 1], &results[i], (num_of_results - i) * sizeof(TEST_RESULT));
+   results[i] = *result;
+   num_of_results++;
+}
+
+
+const MID_RANGE *find_mid_range(int mid)
+{
+   const MID_RANGE *range;
+
+   for (range = mid_ranges; range->name; range++)
+      if (mid >= range->first_mid && mid <= range->last_mid)
+         return range;
+
+   return NULL;
+}
+
+
+int is_mid_supported(int mid)
+{
+   return (mid_map[(mid - 1) / 0x20] >> (0x1F - (mid - 1) % 0x20)) & 1;
+}
+
+
+/* mid_can_change:
+ *  FALSE if the monitor the MID belongs to is not continuous, and completed in
+ *  this drive cycle, so it won't run (and change its results) again.  If the
+ *  vehicle does not report readiness for this drive cycle, we can't tell.
+ */
+int mid_can_change(int mid)
+{
+   const MID_RANGE *range = find_mid_range(mid);
+   const MONITOR *monitor;
+
+   if (!range || !cycle_readiness_valid)
+      return TRUE;
+
+   monitor = &monitors[range->monitor];
+   if (monitor->continuous || !monitor_supported(cycle_readiness, monitor))
+      return TRUE;
+
+   return !monitor_complete(cycle_readiness, monitor);
+}
+
+
+// returns the bit of the monitor for the engine type in data (PID $01 or $41), -1 if the monitor is not defined for it
+int monitor_bit(unsigned long data, const MONITOR *monitor)
+{
+   return ((data >> 16) & 0x08) ? monitor->diesel_bit : monitor->spark_bit;
+}
+
+
+int monitor_supported(unsigned long data, const MONITOR *monitor)
+{
+   int bit = monitor_bit(data, monitor);
+
+   if (bit < 0)
+      return FALSE;
+   if (monitor->continuous)
+      return (data >> (16 + bit)) & 1;  // byte B, bits 0-2
+
+   return (data >> (8 + bit)) & 1;      // byte C
+}
+
+
+int monitor_complete(unsigned long data, const MONITOR *monitor)
+{
+   int bit = monitor_bit(data, monitor);
+
+   if (monitor->continuous)
+      return !((data >> (20 + bit)) & 1);  // byte B, bits 4-6 are set if the monitor is not complete
+
+   return !((data >> bit) & 1);            // byte D
+}
+
+
+void format_readiness()
+{
+   const MONITOR *monitor;
+   int i;
+
+   if (!readiness_valid)
+   {
+      strcpy(readiness_text, (reading) ? "" : "Monitor readiness is not available.");
+      return;
+   }
+
+   sprintf(readiness_text, "MIL is %s, %lu DTC(s) stored\n\n", (readiness & 0x80000000UL) ? "ON" : "OFF", (readiness >> 24) & 0x7F);
+   for (i = 0; i < sizeof(monitors)/sizeof(monitors[0]); i++)
+   {
+      monitor = &monitors[i];
+      if (!monitor_supported(readiness, monitor))
+         continue;
+
+      sprintf(readiness_text + strlen(readiness_text), "%s: %s", monitor->name, monitor_complete(readiness, monitor) ? "complete" : "not complete");
+      if (cycle_readiness_valid && monitor_supported(cycle_readiness, monitor))
+         sprintf(readiness_text + strlen(readiness_text), " (this drive cycle: %s)", monitor_complete(cycle_readiness, monitor) ? "complete" : "not complete");
+      strcat(readiness_text, "\n");
+   }
+}
+
+
+void format_test_value(int uasid, unsigned int raw, char *buf)
+{
+   const UNIT_AND_SCALING *scaling;
+   float value;
+
+   for (scaling = unit_and_scaling; scaling->unit; scaling++)
+      if (scaling->uasid == (uasid & 0x7F))
+         break;
+
+   if (!scaling->unit)
+   {
+      sprintf(buf, "0x%04X", raw);
+      return;
+   }
+
+   if (uasid & 0x80)  // signed IDs are centred on zero, i.e., 0x96 is 0.1 C per bit without the -40 of 0x16
+      value = (float)(short)raw*scaling->scale;
+   else
+      value = (float)raw*scaling->scale + scaling->offset;
+   sprintf(buf, "%.*f%s", scaling->precision, value, scaling->unit);
+}
+
+
+/* ---- DO NOT TRANSLATE FROM HERE ---- */
+// looks up the supported MIDs in the profile of the vehicle (see load_vehicle_profile()), FALSE if its VIN is not known
+int load_mid_map()
+{
+   char section[32];
+   char value[12];
+   const char *cached;
+   int i;
+
+   if (!get_vehicle_info()->vin[0])
+      return FALSE;
+
+   sprintf(section, "vehicle_%s", get_vehicle_info()->vin);
+   cached = get_config_string(section, "mids", "");
+   if (strlen(cached) != MID_MAP_RANGES*8)
+      return FALSE;
+
+   for (i = 0; i < MID_MAP_RANGES; i++)
+   {
+      strncpy(value, cached + i*8, 8);
+      value[8] = 0;
+      mid_map[i] = strtoul(value, NULL, 16);
+   }
+   mid_map_valid = TRUE;
+
+   return TRUE;
+}
+
+
+// does nothing if the VIN is not known
+void save_mid_map()
+{
+   char section[32];
+   char value[MID_MAP_RANGES*8 + 1];
+   int i;
+
+   if (!get_vehicle_info()->vin[0])
+      return;
+
+   sprintf(section, "vehicle_%s", get_vehicle_info()->vin);
+   value[0] = 0;
+   for (i = 0; i < MID_MAP_RANGES; i++)
+      sprintf(value + strlen(value), "%08lX", mid_map[i]);
+   set_config_string(section, "mids", value);
+}
+/* ---- TO HERE ---- */
+
+
+int readiness_proc(int msg, DIALOG *d, int c)
+{
+   if (msg == MSG_READY)
+   {
+      d->d2 = 0;  // scroll to the top
+      return D_REDRAWME;
+   }
+
+   return d_textbox_proc(msg, d, c);
+}
+
+
+int test_list_proc(int msg, DIALOG *d, int c)
+{
+   if (msg == MSG_READY)
+   {
+      if (d->d1 >= num_of_results)
+         d->d1 = d->d2 = 0;
+      return D_REDRAWME;
+   }
+
+   return d_list_proc(msg, d, c);
+}
+
+
+char *test_list_getter(int index, int *list_size)
+{
+   static char buf[160];
+   const TEST_RESULT *result;
+   const MID_RANGE *range;
+   char value[24];
+   char min[24];
+   char max[24];
+
+   if (index < 0)
+   {
+      *list_size = num_of_results;
+      return NULL;
+   }
+
+   result = &results[index];
+   if ((range = find_mid_range(result->mid)) == NULL)
+      sprintf(buf, "MID $%02X", result->mid);
+   else if (range->first_mid == range->last_mid)
+      strcpy(buf, range->name);
+   else
+      sprintf(buf, "%s %i", range->name, result->mid - range->first_mid + 1);
+
+   format_test_value(result->uasid, result->value, value);
+   format_test_value(result->uasid, result->min, min);
+   format_test_value(result->uasid, result->max, max);
+   sprintf(buf + strlen(buf), ", TID $%02X: %s (%s .. %s) %s", result->tid, value, min, max,
+      ((result->uasid & 0x80) ? ((short)result->value >= (short)result->min && (short)result->value <= (short)result->max)
+                              : (result->value >= result->min && result->value <= result->max)) ? "PASS" : "FAIL");
+   if (result->ecu >= 0)
+      sprintf(buf + strlen(buf), "  ECU %lX", result->ecu);
+
+   return buf;
+}
+
+
+int test_status_proc(int msg, DIALOG *d, int c)
+{
+   switch (msg)
+   {
+      case MSG_READY:
+         return D_REDRAWME;
+
+      case MSG_DRAW:
+         rectfill(screen, d->x, d->y, d->x+d->w-1, d->y+d->h-1, d->bg);  // clear the element
+         break;
+   }
+
+   return d_text_proc(msg, d, c);
+}
+
+
+int refresh_proc(int msg, DIALOG *d, int c)
+{
+   int ret;
+
+   if (msg == MSG_READY)
+   {
+      if (reading && !(d->flags & D_DISABLED))
+      {
+         d->flags |= D_DISABLED;
+         return D_REDRAWME;
+      }
+      if (!reading && (d->flags & D_DISABLED))
+      {
+         d->flags &= ~D_DISABLED;
+         return D_REDRAWME;
+      }
+      return D_O_K;
+   }
+
+   ret = d_button_proc(msg, d, c);
+
+   if (ret == D_CLOSE)
+   {
+      broadcast_dialog_message(MSG_REFRESH_TESTS, 0);
+      ret = D_REDRAWME;
+   }
+
+   return ret;
+}
+
+
+// keeps the session busy with the queued requests, d->d1 is TRUE if the dialog has to be updated
+int test_reader_proc(int msg, DIALOG *d, int c)
+{
+   switch (msg)
+   {
+      case MSG_START:
+      case MSG_REFRESH_TESTS:
+         start_refresh();
+         d->d1 = TRUE;  // the dialog is not active yet on MSG_START, so don't broadcast from here
+         break;
+
+      case MSG_IDLE:
+         if (d->d1)
+         {
+            d->d1 = FALSE;
+            broadcast_dialog_message(MSG_READY, 0);
+         }
+         if (!reading)
+            break;
+
+         session_tick();  // handle_test_response() is called with the answers
+
+         while (next_request < num_of_requests && session_pending() < PIPELINE_DEPTH)
+         {
+            if (!session_request(requests[next_request].cmd, 0, 0, handle_test_response, &requests[next_request]))
+               break;
+            next_request++;
+         }
+
+         if (next_request == num_of_requests && session_pending() == 0 && mids_queued)  // all answered
+         {
+            reading = FALSE;
+            if (!is_can_protocol())
+               strcpy(status_text, "Test results are only read from CAN vehicles");
+            else if (num_of_mids_skipped > 0)
+               sprintf(status_text, "%i MIDs read, %i unchanged since the last read", num_of_mids_read, num_of_mids_skipped);
+            else
+               sprintf(status_text, "%i MIDs read", num_of_mids_read);
+            broadcast_dialog_message(MSG_READY, 0);
+         }
+         break;
+   }
+
+   return D_O_K;
+}
@@ -0,0 +1,6 @@
+#ifndef TESTS_H
+#define TESTS_H
+
+int display_tests();
+
+#endif
@@ -6,6 +6,11 @@
 #include "options.h"
 #include "custom_gui.h"
 #include "error_handlers.h"
+#include "code_defs.h"
+#include "acquisition.h"
+#include "session.h"
+#include "vehicle_info.h"
+#include "freeze_frame.h"
 #include "trouble_code_reader.h"
 
 #define MSG_READ_CODES    MSG_USER
@@ -17,14 +22,14 @@
 #define READ_CODES     2
 #define READ_PENDING   3
 #define CLEAR_CODES    4
-
-#define FIELD_DELIMITER     '\t'
-#define RECORD_DELIMITER    0xA
+#define READ_FREEZE_FRAME  5
 
 #define SIM_CODES_STRING   "43012507360455\n43114301960234\n43044302990357\n43C001C101C106"
 
 #define NUM_OF_RETRIES   3
 
+#define TEXT_BLOCK_SIZE  4096  // minimum size of a block in the text arena
+
 #define CLEAR_CODES_WARNING \
 "This will reset the MIL and clear all emission-related diagnostic information, including:\n\n\
    - Diagnostic trouble codes\n\
@@ -40,15 +45,22 @@
 Other manufacturer-specific \"clearing/resetting\" actions may occur. The loss of data may cause \
 the vehicle to run poorly for a short period of time while the ECU recalibrates itself."
 
-typedef struct TROUBLE_CODE
+typedef struct
 {
    char code[7];
-   char *description;
-   char *solution;
+   char *description;  // points into the text arena or the code definitions, NULL if none
+   char *solution;     // points into the code definitions, NULL if none
    int pending;
-   struct TROUBLE_CODE *next;
+   long ecu;           // CAN ID of the first ECU that reported the code, -1 if unknown
 } TROUBLE_CODE;
 
+typedef struct TEXT_BLOCK
+{
+   struct TEXT_BLOCK *next;
+   int size;
+   int used;
+} TEXT_BLOCK;  // the text follows the header
+
 static char mfr_code_description[] = "Manufacturer-specific code.  Please refer to your vehicle's service manual for more information";
 static char mfr_pending_code_description[] = "[Pending]\nManufacturer-specific code.  Please refer to your vehicle's service manual for more information";
 static char code_no_description[] = "";
@@ -60,11 +72,23 @@ static int simulate = FALSE;
 static int mil_is_on; // MIL is ON or OFF
 
 static TROUBLE_CODE *trouble_codes = NULL;
+static int num_of_codes = 0;
+static int trouble_codes_size = 0;   // number of codes the array can hold
+static int num_of_duplicate_codes = 0;  // codes reported by more than one ECU, counted once in the array
+static TEXT_BLOCK *text_arena = NULL;   // first block of the arena
+static TEXT_BLOCK *text_block = NULL;   // block currently being filled
+
+static int current_request = CRQ_NONE;    // request being answered: NUM_OF_CODES, READ_CODES, CLEAR_CODES, etc.
+static int verifying_connection = FALSE;  // TRUE if 0100 was sent, because the vehicle didn't answer the request
+static int port_not_ready = FALSE;        // TRUE if a request could not be sent, see tr_code_proc()
+static char freeze_frame_request[16];     // next mode 02 request, when reading the freeze frame
 
 static void add_trouble_code(const TROUBLE_CODE *);
 static TROUBLE_CODE *get_trouble_code(int index);
 static int get_number_of_codes();
 static void clear_trouble_codes();
+static char *arena_alloc(int size);
+static int compare_codes(const void *a, const void *b);
 
 // procedure definitions:
 static int tr_code_proc(int msg, DIALOG *d, int c);
@@ -87,9 +111,12 @@ static void trouble_codes_simulator(int show);
 static int handle_num_of_codes(char *);
 static int handle_read_codes(char *, int);
 static void populate_trouble_codes_list();
-static void swap_codes(TROUBLE_CODE *, TROUBLE_CODE *);
 static void handle_errors(int error, int operation);
-static PACKFILE *file_handle(char code_letter);
+static void queue_codes_request(const char *cmd, int count_responses);
+static void verify_connection();
+static void learn_timing(int latency);
+static void codes_timed_out();
+static void codes_response(ACQ_TRANSACTION *t, void *context);
 
 static DIALOG read_codes_dialog[] =
 {
@@ -147,7 +174,12 @@ int display_trouble_codes()
    if (comport.status == USER_IGNORED)
       comport.status = NOT_OPEN;
 
+   if (comport.status == READY && session_state() != SESSION_READY)  // we don't know the vehicle yet
+      reset_chip();
+
+   session_start();
    ret = do_dialog(read_codes_dialog, -1);
+   session_stop();
    
    if (get_number_of_codes() > 0)    // if the structure is not empty,
       clear_trouble_codes();
@@ -496,21 +528,228 @@ int clear_codes_proc(int msg, DIALOG *d, int c)
 }
 
 
-// heart of the trouble_code_reader module:
-int tr_code_proc(int msg, DIALOG *d, int c)
+// queues a request with the session, codes_response() gets the answer
+void queue_codes_request(const char *cmd, int count_responses)
 {
-   static char vehicle_response[1024];        // character buffer for car response
-   static int first_read_occured = FALSE;
-   static int receiving_response = FALSE;    // flag, "are we receiving response?"
-   static int verifying_connection = FALSE;  // flag, "are we verifying connection?"
-   static int current_request = CRQ_NONE;    // NUM_OF_CODES, READ_CODES, CLEAR_CODES
-   int response_status = EMPTY;              // EMPTY, DATA, PROMPT
-   int response_type;                        // BUS_BUSY, BUS_ERROR, DATA_ERROR, etc.
+   char request[16];
+
+   strcpy(request, cmd);
+   if (count_responses)  // only single-frame answers are counted by the interface
+      add_response_count(request);
+   session_request(request, 0, 0, codes_response, NULL);
+}
+
+
+// the vehicle did not answer a request, find out whether it's still there
+void verify_connection()
+{
+   verifying_connection = TRUE;
+   queue_codes_request("0100", FALSE);
+}
+
+
+// times the requests that had a response count, and tunes the interface timeout for the ECUs (see sensor_response())
+void learn_timing(int latency)
+{
+   if (learn_response_time(latency))
+   {
+      session_pause();
+      if (program_adapter_timing())
+         save_vehicle_profile();  // remember the response time, if we know the VIN
+      session_resume();
+   }
+}
+
+
+void codes_timed_out()
+{
+   if (current_request == READ_FREEZE_FRAME)  // the codes were read already, keep them
+   {
+      freeze_frame_done(TRUE);
+      broadcast_dialog_message(MSG_READY, 0);
+      return;
+   }
+   num_of_codes_reported = 0;
+   mil_is_on = FALSE;
+   clear_trouble_codes();
+   broadcast_dialog_message(MSG_READY, 0);
+
+   session_pause();
+   if(alert("Device is not responding.", "Please check that it is connected", "and the port settings are correct", "OK",  "&Configure Port", 27, 'c') == 2)
+      display_options();   // let the user choose correct settings
+
+   while (comport.status == NOT_OPEN)
+   {
+      if (alert("Port is not ready.", "Please check that you specified the correct port", "and that no other application is using it", "&Configure Port", "&Ignore", 'c', 'i') == 1)
+         display_options(); // let the user choose correct settings
+      else
+         comport.status = USER_IGNORED;
+   }
+   session_resume();
+}
+
+
+/* codes_response:
+ *  Called from session_tick() with the answer to the last request, and queues
+ *  the next one: 0101 (number of codes) is followed by 03 (stored codes), 07
+ *  (pending codes), and the freeze frame.  If the vehicle doesn't answer, the
+ *  connection is checked with 0100.
+ */
+void codes_response(ACQ_TRANSACTION *t, void *context)
+{
+   int response_type = t->response_type;   // BUS_BUSY, BUS_ERROR, DATA_ERROR, etc.
    int pending_codes_cnt = 0;
-   char comport_buffer[256];                  // temporary storage for comport data
+   int num_of_codes_read;
    char buf1[64];
    char buf2[64];
 
+   if (current_request == CRQ_NONE)  // we're done, or the dialog was reset since the request was queued
+      return;
+
+   if (response_type == ACQ_TIMED_OUT)  // if request timed out,
+   {
+      codes_timed_out();
+      return;
+   }
+
+   if (verifying_connection)     // *** if we are verifying connection ***
+   {  // NOTE: we only get here if we got "NO DATA" somewhere else
+      verifying_connection = FALSE; // we're not verifying connection anymore
+
+      if (response_type == HEX_DATA) // if everything seems to be fine now,
+      {
+         if (current_request == CLEAR_CODES)
+            alert("There may have been a temporary loss of connection.", "Please try clearing codes again.", NULL, "OK", NULL, 0, 0);
+         else if (current_request == NUM_OF_CODES)
+            alert("There may have been a temporary loss of connection.", "Please try reading codes again.", NULL, "OK", NULL, 0, 0);
+         else if (current_request == READ_CODES)
+         {
+            current_request = READ_PENDING;
+            queue_codes_request("07", FALSE);   // request "pending" codes
+            return;
+         }
+      }
+      else if (response_type == ERR_NO_DATA)
+      {
+         if (current_request == CLEAR_CODES) // if we were clearing codes,
+            alert("Communication problem: vehicle did not confirm successful", "deletion of trouble codes.  Please check connection to the vehicle,", "make sure the ignition is ON, and try clearing the codes again.", "OK", NULL, 0, 0);
+         else // if we were reading codes or requesting number or DTCs
+            alert("There may have been a loss of connection.", "Please check connection to the vehicle,", "and make sure the ignition is ON", "OK", NULL, 0, 0);
+      }
+      else
+         display_error_message(response_type, FALSE);
+
+      broadcast_dialog_message(MSG_READY, 0); // tell everyone we're done
+   }
+
+   else if (current_request == NUM_OF_CODES) // *** if we are getting number of codes ***
+   {
+      if (response_type == ERR_NO_DATA)   // if we received "NO DATA"
+         verify_connection();
+      else if (response_type != HEX_DATA) // if we got an error,
+         handle_errors(response_type, NUM_OF_CODES);  // handle it
+      else    // if process response returned HEX_DATA (i.e. there are no errors)
+      {  // extract # of codes from the response
+         num_of_codes_reported = handle_num_of_codes(t->response.data);
+         learn_timing(t->latency);
+
+         current_request = READ_CODES;  // we're reading stored codes now
+         queue_codes_request("03", FALSE);   // request "stored" codes
+      }
+   }
+   else if (current_request == READ_CODES) // if we are reading codes,
+   {
+      if (response_type == ERR_NO_DATA) // vehicle didn't respond, check connection
+      {
+         if (num_of_codes_reported > 0)
+            verify_connection();
+         else
+         {
+            current_request = READ_PENDING;
+            queue_codes_request("07", FALSE);
+         }
+      }
+      else if (response_type == HEX_DATA)
+      {
+         handle_read_codes(t->response.data, FALSE);
+         current_request = READ_PENDING;
+         queue_codes_request("07", FALSE);
+      }
+      else  // if we got an error
+         handle_errors(response_type, READ_CODES);
+   }
+   else if(current_request == READ_PENDING) // if we are reading pending codes,
+   {
+      if (response_type == ERR_NO_DATA)
+      {
+         if (get_number_of_codes() == 0 && num_of_codes_reported == 0)
+            alert("No Diagnostic Trouble Codes (DTCs) detected", NULL, NULL, "OK", NULL, 0, 0);
+      }
+      else if(response_type != HEX_DATA) // if we got an error,
+      {
+         handle_errors(response_type, READ_PENDING);
+         return;
+      }
+      else  // if there were *no* errors,
+         pending_codes_cnt = handle_read_codes(t->response.data, TRUE);
+
+      // if number of DTCs reported by 0101 request does not equal either number or total DTCs or just stored DTCs
+      num_of_codes_read = get_number_of_codes() + num_of_duplicate_codes;
+      if ((num_of_codes_read != num_of_codes_reported) && (num_of_codes_read - pending_codes_cnt != num_of_codes_reported))
+      {
+         sprintf(buf1, "Vehicle reported %i Diagnostic Trouble Codes (DTCs).", num_of_codes_reported);
+         sprintf(buf2, "However, %i non-pending DTC(s) have been successfully read.", num_of_codes_read - pending_codes_cnt);
+         alert(buf1, buf2, "Try reading codes again.", "OK", NULL, 0, 0);
+      }
+
+      populate_trouble_codes_list();
+
+      // the freeze frame is only stored along with a confirmed code, read it while we're at it
+      freeze_frame_clear();
+      if (num_of_codes_reported == 0)  // no confirmed code, no freeze frame
+         freeze_frame_done(FALSE);
+      if (freeze_frame_next_request(freeze_frame_request))
+      {
+         current_request = READ_FREEZE_FRAME;
+         queue_codes_request(freeze_frame_request, TRUE);
+      }
+      else
+         broadcast_dialog_message(MSG_READY, 0); // tell everyone we're done
+   }
+   else if (current_request == READ_FREEZE_FRAME)
+   {
+      freeze_frame_handle_response(t->cmd, t->response.data, response_type);
+      if (response_type == HEX_DATA)
+         learn_timing(t->latency);
+
+      if (freeze_frame_next_request(freeze_frame_request))
+         queue_codes_request(freeze_frame_request, TRUE);
+      else
+         broadcast_dialog_message(MSG_READY, 0); // tell everyone we're done
+   }
+   else if(current_request == CLEAR_CODES)
+   {
+      if (response_type == ERR_NO_DATA)// vehicle didn't respond, check connection
+         verify_connection();
+      else if(response_type != HEX_DATA) // if we got an error,
+         handle_errors(response_type, CLEAR_CODES);
+      else // if everything's fine (received confirmation)
+      {
+         clear_trouble_codes();
+         freeze_frame_clear();
+         num_of_codes_reported = 0;
+         mil_is_on = FALSE;
+         broadcast_dialog_message(MSG_READY, 0);
+      }
+   }
+}
+
+
+// heart of the trouble_code_reader module, the requests go through the session (see codes_response()):
+int tr_code_proc(int msg, DIALOG *d, int c)
+{
+   static int first_read_occured = FALSE;
+
    switch (msg)
    {
       case MSG_IDLE:
@@ -521,180 +760,13 @@ int tr_code_proc(int msg, DIALOG *d, int c)
             first_read_occured = TRUE;
             return D_O_K;
          }
-         
-         if (simulate)
-            break;
-         
-         if (comport.status == READY)
-         {
-            if (!receiving_response)
-            {
-               if (verifying_connection)
-               {
-                  send_command("0100"); // send request that requires a response
-                  receiving_response = TRUE; // now we're waiting for response
-                  vehicle_response[0] = 0; //get buffer ready for the response
-                  start_serial_timer(OBD_REQUEST_TIMEOUT); // start the timer
-               }
-               else if (current_request == READ_PENDING)
-               {
-                  send_command("07");   // request "pending" codes
-                  receiving_response = TRUE;     // and receiving response
-                  vehicle_response[0] = '\0';    // clear the buffer
-                  start_serial_timer(OBD_REQUEST_TIMEOUT); // start the timer...
-               }
-            }
-            else
-            {
-               response_status = read_comport(comport_buffer);
 
-               if (response_status == DATA) // if data detected in com port buffer
-               {
-                  // append contents of comport_buffer to vehicle_response:
-                  strcat(vehicle_response, comport_buffer);
-                  start_serial_timer(OBD_REQUEST_TIMEOUT);  // we got data, reset the timer
-               }
-               else if (response_status == PROMPT) // if ">" is detected
-               {
-                  receiving_response = FALSE; // we're not waiting for response any more
-                  stop_serial_timer();        // stop the timer
-                  // append contents of comport_buffer to vehicle_response:
-                  strcat(vehicle_response, comport_buffer);
-
-                  if (verifying_connection)     // *** if we are verifying connection ***
-                  {  // NOTE: we only get here if we got "NO DATA" somewhere else
-                     response_type = process_response("0100", vehicle_response);
-                     verifying_connection = FALSE; // we're not verifying connection anymore
-
-                     if (response_type == HEX_DATA) // if everything seems to be fine now,
-                     {
-                        if (current_request == CLEAR_CODES)
-                           alert("There may have been a temporary loss of connection.", "Please try clearing codes again.", NULL, "OK", NULL, 0, 0);
-                        else if (current_request == NUM_OF_CODES)
-                           alert("There may have been a temporary loss of connection.", "Please try reading codes again.", NULL, "OK", NULL, 0, 0);
-                        else if (current_request == READ_CODES)
-                        {
-                           current_request = READ_PENDING;
-                           break;
-                        }
-                     }
-                     else if (response_type == ERR_NO_DATA)
-                     {
-                        if (current_request == CLEAR_CODES) // if we were clearing codes,
-                           alert("Communication problem: vehicle did not confirm successful", "deletion of trouble codes.  Please check connection to the vehicle,", "make sure the ignition is ON, and try clearing the codes again.", "OK", NULL, 0, 0);
-                        else // if we were reading codes or requesting number or DTCs
-                           alert("There may have been a loss of connection.", "Please check connection to the vehicle,", "and make sure the ignition is ON", "OK", NULL, 0, 0);
-                     }
-                     else
-                        display_error_message(response_type, FALSE);
-                        
-                     broadcast_dialog_message(MSG_READY, 0); // tell everyone we're done
-                  }
-
-                  else if (current_request == NUM_OF_CODES) // *** if we are getting number of codes ***
-                  {
-                     response_type = process_response("0101", vehicle_response);
-
-                     if (response_type == ERR_NO_DATA)   // if we received "NO DATA"
-                        verifying_connection = TRUE;  // verify connection
-                     else if (response_type != HEX_DATA) // if we got an error,
-                        handle_errors(response_type, NUM_OF_CODES);  // handle it
-                     else    // if process response returned HEX_DATA (i.e. there are no errors)
-                     {  // extract # of codes from vehicle_response
-                        num_of_codes_reported = handle_num_of_codes(vehicle_response);
-                     
-                        send_command("03");   // request "stored" codes
-                        current_request = READ_CODES;  // we're reading stored codes now
-                        receiving_response = TRUE;     // and receiving response
-                        vehicle_response[0] = '\0';    // clear the buffer
-                        start_serial_timer(OBD_REQUEST_TIMEOUT); // start the timer...
-                     }
-                  }
-                  else if (current_request == READ_CODES) // if we are reading codes,
-                  {
-                     response_type = process_response("03", vehicle_response);
-
-                     if (response_type == ERR_NO_DATA) // vehicle didn't respond, check connection
-                     {
-                        if (num_of_codes_reported > 0)
-                           verifying_connection = TRUE;
-                        else
-                           current_request = READ_PENDING;
-                     }
-                     else if (response_type == HEX_DATA)
-                     {
-                        handle_read_codes(vehicle_response, FALSE);
-                        current_request = READ_PENDING;
-                     }
-                     else  // if we got an error
-                        handle_errors(response_type, READ_CODES);
-                  }
-                  else if(current_request == READ_PENDING) // if we are reading pending codes,
-                  {
-                     response_type = process_response("07", vehicle_response);
-
-                     if (response_type == ERR_NO_DATA)
-                     {
-                        if (get_number_of_codes() == 0 && num_of_codes_reported == 0)
-                           alert("No Diagnostic Trouble Codes (DTCs) detected", NULL, NULL, "OK", NULL, 0, 0);
-                     }
-                     else if(response_type != HEX_DATA) // if we got an error,
-                     {
-                        handle_errors(response_type, READ_PENDING);
-                        break;
-                     }
-                     else  // if there were *no* errors,
-                        pending_codes_cnt = handle_read_codes(vehicle_response, TRUE);
-
-                     // if number of DTCs reported by 0101 request does not equal either number or total DTCs or just stored DTCs
-                     if ((get_number_of_codes() != num_of_codes_reported) && (get_number_of_codes() - pending_codes_cnt != num_of_codes_reported))
-                     {
-                        sprintf(buf1, "Vehicle reported %i Diagnostic Trouble Codes (DTCs).", num_of_codes_reported);
-                        sprintf(buf2, "However, %i non-pending DTC(s) have been successfully read.", get_number_of_codes() - pending_codes_cnt);
-                        alert(buf1, buf2, "Try reading codes again.", "OK", NULL, 0, 0);
-                     }
-
-                     populate_trouble_codes_list();
-                     broadcast_dialog_message(MSG_READY, 0); // tell everyone we're done
-                  }
-                  else if(current_request == CLEAR_CODES)
-                  {
-                     response_type = process_response("04", vehicle_response);
-
-                     if (response_type == ERR_NO_DATA)// vehicle didn't respond, check connection
-                        verifying_connection = TRUE;
-                     else if(response_type != HEX_DATA) // if we got an error,
-                        handle_errors(response_type, CLEAR_CODES);
-                     else // if everything's fine (received confirmation)
-                     {
-                        clear_trouble_codes();
-                        num_of_codes_reported = 0;
-                        mil_is_on = FALSE;
-                        broadcast_dialog_message(MSG_READY, 0);
-                     }
-                  }
-               }
-               else if (serial_time_out)     // if request timed out,
-               {
-                  stop_serial_timer();
-                  receiving_response = FALSE;
-                  num_of_codes_reported = 0;
-                  mil_is_on = FALSE;
-                  clear_trouble_codes();
-                  broadcast_dialog_message(MSG_READY, 0);
-
-                  if(alert("Device is not responding.", "Please check that it is connected", "and the port settings are correct", "OK",  "&Configure Port", 27, 'c') == 2)
-                     display_options();   // let the user choose correct settings
-
-                  while (comport.status == NOT_OPEN)
-                  {
-                     if (alert("Port is not ready.", "Please check that you specified the correct port", "and that no other application is using it", "&Configure Port", "&Ignore", 'c', 'i') == 1)
-                        display_options(); // let the user choose correct settings
-                     else
-                        comport.status = USER_IGNORED;
-                  }
-               }
-            }
+         session_tick();  // codes_response() is called with the answers
+
+         if (port_not_ready)  // the request could not be sent, fail it like one that timed out
+         {
+            port_not_ready = FALSE;
+            codes_timed_out();
          }
          break;  // end case MSG_IDLE
 
@@ -703,44 +775,30 @@ int tr_code_proc(int msg, DIALOG *d, int c)
          num_of_codes_reported = 0;
          mil_is_on = FALSE;
          // fall through
-         
+
       case MSG_READY:
-         receiving_response = FALSE;
          verifying_connection = FALSE;
+         port_not_ready = FALSE;
          current_request = CRQ_NONE;
          break;
 
       case MSG_READ_CODES:
+         clear_trouble_codes();
+         num_of_codes_reported = 0;
+         mil_is_on = FALSE;
+         current_request = NUM_OF_CODES;
          if (comport.status == READY)
-         {
-            send_command("0101"); // request number of trouble codes
-            start_serial_timer(OBD_REQUEST_TIMEOUT); // start the timer
-            current_request = NUM_OF_CODES;
-            receiving_response = TRUE; // now we're waiting for response
-            vehicle_response[0] = 0;
-            clear_trouble_codes();
-            num_of_codes_reported = 0;
-            mil_is_on = FALSE;
-         }
+            queue_codes_request("0101", TRUE); // request number of trouble codes
          else
-            serial_time_out = TRUE;
+            port_not_ready = TRUE;
          break;
 
       case MSG_CLEAR_CODES:
+         current_request = CLEAR_CODES;
          if (comport.status == READY)
-         {
-            send_command("04"); // "clear codes" request
-            current_request = CLEAR_CODES;
-            receiving_response = TRUE; // now we're waiting for response
-            vehicle_response[0] = 0;
-            start_serial_timer(OBD_REQUEST_TIMEOUT); // start the timer
-         }
+            queue_codes_request("04", FALSE); // "clear codes" request
          else
-            serial_time_out = TRUE;
-         break;
-
-      case MSG_END:
-         stop_serial_timer();
+            port_not_ready = TRUE;
          break;
    }
 
@@ -751,7 +809,6 @@ int tr_code_proc(int msg, DIALOG *d, int c)
 int code_list_proc(int msg, DIALOG *d, int c)
 {
    static int curr_num_of_codes = 0;
-   int num_of_codes = get_number_of_codes();
    int ret;
    
    if (msg == MSG_READY)
@@ -780,13 +837,21 @@ int code_list_proc(int msg, DIALOG *d, int c)
 
 char* code_list_getter(int index, int *list_size)
 {
+   static char buf[32];
+   TROUBLE_CODE *dtc;
+
    if (index < 0)
    {
       *list_size = get_number_of_codes();
       return NULL;
    }
 
-   return get_trouble_code(index)->code;
+   dtc = get_trouble_code(index);
+   if (dtc->ecu < 0)
+      return dtc->code;
+
+   sprintf(buf, "%-6s  ECU %lX", dtc->code, dtc->ecu);
+   return buf;
 }
 
 
@@ -821,14 +886,18 @@ int is_mfr_code(const char *code)
 
 int handle_num_of_codes(char *vehicle_response)
 {
+   static RESPONSE_INDEX index;
+   const RESPONSE_LINE *line;
    int temp;
-   char *response = vehicle_response;
    char buf[16];
    int ret = 0;
 
-   while (*response)
+   index_response(vehicle_response, &index);
+
+   for (line = index.line; line < index.line + index.num_of_lines; line++)
    {
-      if (find_valid_response(buf, response, "4101", &response))
+      get_response_line(buf, sizeof(buf), vehicle_response, line);
+      if (line->service == 0x41 && strncmp(buf, "4101", 4) == 0 && line->len >= 6)
       {
          buf[6] = 0;
          temp = (int)strtol(buf + 4, NULL, 16); // convert hex ascii string to integer
@@ -836,15 +905,13 @@ int handle_num_of_codes(char *vehicle_response)
             mil_is_on = TRUE; // get MIL status from temp
          ret = ret + (temp & 0x7F);
       }
-      else
-         break;
    }
 
    return ret;
 }
 
 
-int parse_dtcs(const char *response, int pending)
+int parse_dtcs(const char *response, int pending, long ecu)
 {
    char code_letter[] = "PCBU";
    int dtc_count = 0;
@@ -877,6 +944,7 @@ int parse_dtcs(const char *response, int pending)
          temp_trouble_code.pending = FALSE;
       temp_trouble_code.description = NULL; // clear the corresponding description...
       temp_trouble_code.solution = NULL;  // ..and solution
+      temp_trouble_code.ecu = ecu;
       add_trouble_code(&temp_trouble_code);
       dtc_count++;
    }
@@ -886,6 +954,9 @@ int parse_dtcs(const char *response, int pending)
 
 
 /* NOTE:
+ *  With CAN headers on (see demux_can_frames()), every line is a complete
+ *  message from a known ECU, and none of the following applies.
+ *
  *  ELM327 multi-message CAN responses are parsed using the following assumptions:
  *   - max 8 ECUs (per ISO15765-4 standard)
  *   - max 51 DTCs per ECU - there is no way to tell which ECU a response belongs to when the message counter wraps (0-F)
@@ -898,10 +969,12 @@ int parse_dtcs(const char *response, int pending)
 
 int handle_read_codes(char *vehicle_response, int pending)
 {
+   static RESPONSE_INDEX index;
+   const RESPONSE_LINE *line;
    int dtc_count = 0;
-   char *start = vehicle_response;
-   char filter[3];
+   int service = (pending) ? 0x47 : 0x43;
    char msg[48];
+   char *ecu_msg;
    int can_resp_cnt = 0;
    int can_msg_cnt = 0;
    int can_resp_len[8];
@@ -909,23 +982,37 @@ int handle_read_codes(char *vehicle_response, int pending)
    int buf_len, max_len, trim;
    int i, j;
    
-   // First, look for non-CAN and single-message CAN responses
-   strcpy(filter, (pending) ? "47" : "43");
-   while (find_valid_response(msg, start, filter, &start))
+   index_response(vehicle_response, &index);
+
+   // First, look for messages reassembled per ECU, non-CAN, and single-message CAN responses
+   for (line = index.line; line < index.line + index.num_of_lines; line++)
    {
-      if (strlen(msg) == 4)  // skip '4X 00' CAN responses
+      if (line->ecu >= 0)
+      {
+         if (line->service == service && line->len > 4)  // skip '4X 00'
+         {
+            if (!(ecu_msg = (char *)malloc(line->len + 1)))
+               fatal_error("Could not allocate enough memory for trouble codes");
+            get_response_line(ecu_msg, line->len + 1, vehicle_response, line);
+            dtc_count += parse_dtcs(ecu_msg + 4, pending, line->ecu);  // skip '4X NN'
+            free(ecu_msg);
+         }
+         continue;
+      }
+      if (line->frame >= 0 || line->service != service || line->len == 4)  // skip frames and '4X 00' CAN responses
          continue;
+      get_response_line(msg, sizeof(msg), vehicle_response, line);
       // if even number of bytes (CAN), skip first 2 bytes, otherwise, skip 1 byte
       i = (((strlen(msg)/2) & 0x01) == 0) ? 4 : 2;
-      dtc_count += parse_dtcs(msg + i, pending);
+      dtc_count += parse_dtcs(msg + i, pending, -1);
    }
 
    // Look for CAN multi-message responses
-   start = vehicle_response;
-   while (find_valid_response(msg, start, "", &start))  // step through all responses
+   for (line = index.line; line < index.line + index.num_of_lines && can_resp_cnt < 8; line++)
    {
-      if (strlen(msg) == 3)  // we're looking for 3-byte response length messages
+      if (line->len == 3)  // we're looking for 3-byte response length messages
       {
+         get_response_line(msg, sizeof(msg), vehicle_response, line);
          can_resp_len[can_resp_cnt] = strtol(msg, NULL, 16);  // get total length for the response
          can_resp_buf[can_resp_cnt] = calloc((can_resp_len[can_resp_cnt]-2)*2 + 1, sizeof(char));
          i = ceil((float)(can_resp_len[can_resp_cnt] + 1) / 7);  // calculate number of messages necessary to transmit specified number of bytes
@@ -937,10 +1024,11 @@ int handle_read_codes(char *vehicle_response, int pending)
    for (i = 0; i < can_msg_cnt; i++)
    {
       j = 0;
-      start = vehicle_response;
-      sprintf(filter, "%X:", i);
-      while (find_valid_response(msg, start, filter, &start))
+      for (line = index.line; line < index.line + index.num_of_lines; line++)
       {
+         if (line->frame != i)
+            continue;
+         get_response_line(msg, sizeof(msg), vehicle_response, line);
          for (; j < can_resp_cnt; j++)  // find next response that is not full
          {
             buf_len = strlen(can_resp_buf[j]);
@@ -961,7 +1049,7 @@ int handle_read_codes(char *vehicle_response, int pending)
    
    for (i = 0; i < can_resp_cnt; i++)
    {
-      dtc_count += parse_dtcs(can_resp_buf[i], pending);
+      dtc_count += parse_dtcs(can_resp_buf[i], pending, -1);
       free(can_resp_buf[i]);
    }
    
@@ -971,113 +1059,36 @@ int handle_read_codes(char *vehicle_response, int pending)
 
 void populate_trouble_codes_list()
 {
-   char character;
-   int i, j, min;
-   char temp_buf[1024];
+   const char *description;
+   const char *solution;
+   int i;
    TROUBLE_CODE *trouble_code;
-   int count = get_number_of_codes();
-   PACKFILE *code_def_file;
 
-   if (count == 0)
+   if (num_of_codes == 0)
       return;
 
-   for (i = 0; i < count; i++)    // sort codes in ascending order
-   {
-      min = i;
-
-      for (j = i+1; j < count; j++)
-         if(strcmp(get_trouble_code(j)->code, get_trouble_code(min)->code) < 0)
-            min = j;
+   qsort(trouble_codes, num_of_codes, sizeof(TROUBLE_CODE), compare_codes);    // sort codes in ascending order
 
-      swap_codes(get_trouble_code(i), get_trouble_code(min));
-   }
-   
-   for (trouble_code = trouble_codes; trouble_code; trouble_code = trouble_code->next)   // search for descriptions and solutions
+   for (i = 0; i < num_of_codes; i++)   // search for descriptions and solutions
    {
-      // pass the letter (B, C, P, or U) to file_handle, which returns the file handle
-      // if we reached EOF, or the file does not exist, go to the next DTC
-      if ((code_def_file = file_handle(trouble_code->code[0])) == NULL)
+      trouble_code = &trouble_codes[i];
+      if (!find_code_def(trouble_code->code, &description, &solution))
          continue;
 
-      while (TRUE)
+      if (description)
       {
-         j = 0;
-
-         // copy DTC from file to temp_buf
-         while (((character = pack_getc(code_def_file)) != FIELD_DELIMITER) && (character != RECORD_DELIMITER) && (character != EOF))
+         if (trouble_code->pending)
          {
-            temp_buf[j] = character;
-            j++;
-         }
-         temp_buf[j] = '\0';
-
-         if (character == EOF) // reached end of file, break out of while()
-            break;             // advance to next code
-
-         if (strncmp(trouble_code->code, temp_buf, 5) == 0) // if we found the code,
-         {
-            if (character == RECORD_DELIMITER)  // reached end of record, no description or solution,
-               break;                        // break out of while(), advance to next code
-
-            j = 0;
-
-            //copy description from file to temp_buf
-            while (((character = pack_getc(code_def_file)) != FIELD_DELIMITER) && (character != RECORD_DELIMITER) && (character != EOF))
-            {
-               temp_buf[j] = character;
-               j++;
-            }
-            temp_buf[j] = '\0';  // terminate string
-            if (j > 0)
-            {
-               if (!(trouble_code->description = (char *)malloc(sizeof(char)*(j + 1 + ((trouble_code->pending) ? 10 : 0)))))
-               {
-                  sprintf(temp_error_buf, "Could not allocate enough memory for trouble code description [%i]", count);
-                  fatal_error(temp_error_buf);
-               }
-               if (trouble_code->pending)
-               {
-                  strcpy(trouble_code->description, "[Pending]\n");
-                  strcpy(trouble_code->description + 10, temp_buf);  // copy description from temp_buf
-               }
-               else
-                  strcpy(trouble_code->description, temp_buf);  // copy description from temp_buf
-            }
-
-            if (character == FIELD_DELIMITER)   // if we have solution,
-            {
-               j = 0;
-
-               // copy solution from file to temp_buf
-               while (((character = pack_getc(code_def_file)) != RECORD_DELIMITER) && (character != EOF))
-               {
-                  temp_buf[j] = character;
-                  j++;
-               }
-               temp_buf[j] = '\0';   // terminate string
-               if (j > 0)
-               {
-                  if (!(trouble_code->solution = (char *)malloc(sizeof(char)*(j+1))))
-                  {
-                     sprintf(temp_error_buf, "Could not allocate enough memory for trouble code solution [%i]", count);
-                     fatal_error(temp_error_buf);
-                  }
-                  strcpy(trouble_code->solution, temp_buf);  // copy solution from temp_buf
-               }
-            }
-            break;  // break out of while(TRUE)
+            trouble_code->description = arena_alloc(strlen(description) + 11);
+            strcpy(trouble_code->description, "[Pending]\n");
+            strcpy(trouble_code->description + 10, description);
          }
          else
-         {
-            // skip to next record
-            while (((character = pack_getc(code_def_file)) != RECORD_DELIMITER) && (character != EOF));
+            trouble_code->description = (char *)description;
+      }
 
-            if (character == EOF)
-               break;   // break out of while(TRUE), advance to next code
-         }
-      } // end of while(TRUE)
-   } // end of for() loop
-   file_handle(0); // close the code definition file if it's still open
+      trouble_code->solution = (char *)solution;
+   }
 }
 
 
@@ -1125,129 +1136,100 @@ void handle_errors(int error, int operation)
 }
 
 
-void swap_codes(TROUBLE_CODE *code1, TROUBLE_CODE *code2)
-{
-   char temp_str[256];
-   int temp_int;
-   
-   temp_int = code1->pending;
-   strcpy(temp_str, code1->code);
-   code1->pending = code2->pending;
-   strcpy(code1->code, code2->code);
-   code2->pending = temp_int;
-   strcpy(code2->code, temp_str);
-}
-
-
+/* add_trouble_code:
+ *  Appends a copy of the code to the array.  Codes that are already there (i.e.,
+ *  the same code reported by several ECUs) are only counted.
+ */
 void add_trouble_code(const TROUBLE_CODE * init_code)
 {
-   TROUBLE_CODE *next = trouble_codes;
+   TROUBLE_CODE *trouble_code;
+   int i;
 
-   if (!(trouble_codes = (TROUBLE_CODE *)malloc(sizeof(TROUBLE_CODE))))
-      fatal_error("Could not allocate enough memory for new trouble code");
-   
-   if (init_code)
+   for (i = 0; i < num_of_codes; i++)
    {
-      strcpy(trouble_codes->code, init_code->code);
-      trouble_codes->description = init_code->description;
-      trouble_codes->solution = init_code->solution;
-      trouble_codes->pending = init_code->pending;
+      if (strcmp(trouble_codes[i].code, init_code->code) == 0)
+      {
+         num_of_duplicate_codes++;
+         return;
+      }
    }
-   else
+
+   if (num_of_codes >= trouble_codes_size)
    {
-      trouble_codes->code[0] = 0;
-      trouble_codes->description = NULL;
-      trouble_codes->solution = NULL;
-      trouble_codes->pending = FALSE;
+      trouble_codes_size = (trouble_codes_size > 0) ? trouble_codes_size*2 : 32;
+      if (!(trouble_codes = (TROUBLE_CODE *)realloc(trouble_codes, trouble_codes_size*sizeof(TROUBLE_CODE))))
+         fatal_error("Could not allocate enough memory for new trouble code");
    }
-   
-   trouble_codes->next = next;
+
+   trouble_code = &trouble_codes[num_of_codes++];
+   strcpy(trouble_code->code, init_code->code);
+   trouble_code->description = init_code->description;
+   trouble_code->solution = init_code->solution;
+   trouble_code->pending = init_code->pending;
+   trouble_code->ecu = init_code->ecu;
 }
 
 
 TROUBLE_CODE *get_trouble_code(int index)
 {
-   int i;
-   TROUBLE_CODE *trouble_code = trouble_codes;
-
-   for(i = 0; i < index; i++)
-   {
-      if (trouble_code->next == NULL)
-         return NULL;
-      trouble_code = trouble_code->next;
-   }
+   if (index < 0 || index >= num_of_codes)
+      return NULL;
 
-   return trouble_code;
+   return &trouble_codes[index];
 }
 
 
 int get_number_of_codes()
 {
-   TROUBLE_CODE *trouble_code = trouble_codes;
-   int ret = 0;
-   
-   while(trouble_code)
-   {
-      trouble_code = trouble_code->next;
-      ret++;
-   }
-   
-   return ret;
+   return num_of_codes;
 }
 
 
+/* clear_trouble_codes:
+ *  Empties the array and the text arena.  Memory is kept for the next read.
+ */
 void clear_trouble_codes()
 {
-   TROUBLE_CODE *next;
-   
-   while (trouble_codes)
-   {
-      next = trouble_codes->next;
+   TEXT_BLOCK *block;
 
-      if (trouble_codes->description)
-         free(trouble_codes->description);
-      if (trouble_codes->solution)
-         free(trouble_codes->solution);
-      free(trouble_codes);
+   for (block = text_arena; block; block = block->next)
+      block->used = 0;
+   text_block = text_arena;
 
-      trouble_codes = next;
-   }
+   num_of_codes = 0;
+   num_of_duplicate_codes = 0;
 }
 
 
-PACKFILE *file_handle(char code_letter)
+// returns size bytes from the text arena, the memory is valid until clear_trouble_codes()
+char *arena_alloc(int size)
 {
-   static PACKFILE *file = NULL;
-   static char current_code_letter = 0;
-   char file_name[30];
-   
-   if (code_letter == 0)
+   TEXT_BLOCK *block;
+   TEXT_BLOCK **link;
+
+   // look for room in the current block and the ones left over from previous reads
+   for (link = (text_block) ? &text_block : &text_arena; *link; link = &(*link)->next)
+      if ((*link)->size - (*link)->used >= size)
+         break;
+
+   if (*link == NULL)  // none of them is big enough, add a new block at the end
    {
-      current_code_letter = 0;
-      if (file != NULL)
-         pack_fclose(file);
-      file = NULL;
+      if (!(block = (TEXT_BLOCK *)malloc(sizeof(TEXT_BLOCK) + MAX(size, TEXT_BLOCK_SIZE))))
+         fatal_error("Could not allocate enough memory for trouble code description");
+      block->next = NULL;
+      block->size = MAX(size, TEXT_BLOCK_SIZE);
+      block->used = 0;
+      *link = block;
    }
-   else if (code_letter != current_code_letter)
-   {
-      if (file != NULL)
-      {
-         pack_fclose(file);
-         file = NULL;
-      }
-   
-      sprintf(file_name, "%s#%ccodes", code_defs_file_name, tolower(code_letter));
-      packfile_password(PASSWORD);
-      file = pack_fopen(file_name, F_READ_PACKED);
-      packfile_password(NULL);
-      current_code_letter = code_letter;
-   }
-   
-   if (file == NULL)     
-      return NULL;
-      
-   if (pack_feof(file) == TRUE) 
-      return NULL;
-      
-   return file;
+
+   text_block = *link;
+   text_block->used += size;
+
+   return (char *)(text_block + 1) + text_block->used - size;
+}
+
+
+int compare_codes(const void *a, const void *b)
+{
+   return strcmp(((const TROUBLE_CODE *)a)->code, ((const TROUBLE_CODE *)b)->code);
 }
@@ -0,0 +1,250 @@
+#include <ctype.h>
+#include <string.h>
+#include "globals.h"
+#include "serial.h"
+#include "vehicle_info.h"
+
+/* The VIN, calibration IDs, and CVNs are read with mode 09 from the OBD
+ * Information dialog (and the VIN by the session, too).  On CAN, each of them is a multi-frame message, which
+ * next_message() reassembles; on the other protocols, they come in numbered
+ * messages of 4 bytes each.  Either way, the data bytes are collected in
+ * order and split into items afterwards.
+ *
+ * What we learn about a vehicle is kept in scantool.cfg, in a section of
+ * its own named after the VIN: the protocol, the supported PIDs, the slowest
+ * response time (which the interface timeout is programmed from), and the
+ * supported MIDs (see load_mid_map()).  The VIN is read when we connect, and
+ * if it's one we've seen before, the rest is restored instead of found out
+ * again.  Vehicles are only ever told apart by the VIN they report: two cars
+ * of the same model look the same in everything else.  The calibration IDs
+ * and CVNs are kept too, because the CALIDs are slow to read.  An ECU that
+ * was reflashed has the same VIN, so the short list of CVNs is read every
+ * time, and the CALIDs only when the CVNs changed.
+ */
+
+static VEHICLE_INFO vehicle_info;
+
+static int collect_info_data(int info_type, char *response, char *data, int size);
+static int hex_to_text(const char *hex, int len, char *text, int max);
+
+
+void clear_vehicle_info()
+{
+   vehicle_info.vin[0] = 0;
+   clear_calibration_info();
+}
+
+
+// forgets the calibration IDs and CVNs, but not the VIN
+void clear_calibration_info()
+{
+   vehicle_info.num_of_calids = 0;
+   vehicle_info.num_of_cvns = 0;
+}
+
+
+const VEHICLE_INFO *get_vehicle_info()
+{
+   return &vehicle_info;
+}
+
+
+// collects the data bytes of all the messages with the info type, as hex digits, returns the number of digits
+int collect_info_data(int info_type, char *response, char *data, int size)
+{
+   static RESPONSE_INDEX index;
+   MESSAGE_READER reader;
+   const char *message;
+   char prefix[8];
+   char buf[256];
+   long ecu;
+
+   sprintf(prefix, "49%02X", info_type);
+   data[0] = 0;
+
+   index_response(response, &index);
+   start_message_reader(&reader);
+   while ((message = next_message(&reader, buf, sizeof(buf), response, &index, &ecu)))
+   {
+      // on CAN the byte after the info type is the number of items, otherwise it's the message number
+      if (strncmp(message, prefix, 4) == 0 && strlen(message) > 6)
+         strncat(data, message + 6, size - 1 - strlen(data));
+   }
+
+   return strlen(data);
+}
+
+
+// converts len hex digits to at most max characters, the NULs it's padded with are dropped
+int hex_to_text(const char *hex, int len, char *text, int max)
+{
+   char byte[4];
+   int n = 0;
+   int i;
+
+   for (i = 0; i + 2 <= len && n < max; i += 2)
+   {
+      byte[0] = hex[i];
+      byte[1] = hex[i+1];
+      byte[2] = 0;
+      if ((text[n] = strtol(byte, NULL, 16)) != 0)
+         n++;
+   }
+   text[n] = 0;
+
+   return n;
+}
+
+
+/* parse_vehicle_info:
+ *  Takes the VIN, calibration IDs, or CVNs from a HEX_DATA response to 09xx,
+ *  where xx is info_type.  Returns the number of items found.
+ */
+int parse_vehicle_info(int info_type, char *response)
+{
+   char data[512];
+   char buf[12];
+   int len = collect_info_data(info_type, response, data, sizeof(data));
+   int i;
+
+   switch (info_type)
+   {
+      case INFO_TYPE_VIN:
+         if (hex_to_text(data, len, vehicle_info.vin, VIN_LENGTH) < VIN_LENGTH)
+            vehicle_info.vin[0] = 0;  // incomplete
+         for (i = 0; vehicle_info.vin[i]; i++)
+            if (!isalnum(vehicle_info.vin[i]))  // it's used in scantool.cfg section names
+               vehicle_info.vin[0] = 0;
+         return (vehicle_info.vin[0]) ? 1 : 0;
+
+      case INFO_TYPE_CALID:
+         for (i = 0; i + CALID_LENGTH*2 <= len && vehicle_info.num_of_calids < MAX_CALIDS; i += CALID_LENGTH*2)
+            hex_to_text(data + i, CALID_LENGTH*2, vehicle_info.calid[vehicle_info.num_of_calids++], CALID_LENGTH);
+         return vehicle_info.num_of_calids;
+
+      case INFO_TYPE_CVN:
+         for (i = 0; i + 8 <= len && vehicle_info.num_of_cvns < MAX_CALIDS; i += 8)
+         {
+            strncpy(buf, data + i, 8);
+            buf[8] = 0;
+            vehicle_info.cvn[vehicle_info.num_of_cvns++] = strtoul(buf, NULL, 16);
+         }
+         return vehicle_info.num_of_cvns;
+   }
+
+   return 0;
+}
+
+
+/* ---- DO NOT TRANSLATE FROM HERE ---- */
+/* load_vehicle_profile:
+ *  Restores what was learned about the vehicle with the VIN in vehicle_info the
+ *  last time it was connected.  The supported PIDs and the response time are
+ *  only restored if they were not found out yet.  Returns FALSE if we haven't
+ *  seen the vehicle before.
+ */
+int load_vehicle_profile()
+{
+   char section[32];
+   char value[32];
+   const char *cached;
+   int protocol;
+   int response_time;
+   int i;
+
+   if (!vehicle_info.vin[0])
+      return FALSE;
+
+   sprintf(section, "vehicle_%s", vehicle_info.vin);
+   if ((protocol = get_config_int(section, "protocol", -1)) < 0)
+      return FALSE;
+
+   if (obd_device.protocol == 0 && protocol > 0 && obd_device.interface_type == INTERFACE_ELM327)
+   {
+      obd_device.protocol = protocol;
+      save_protocol();  // try it first the next time we connect
+   }
+
+   cached = get_config_string(section, "pids", "");
+   if (!obd_device.pid_map_valid && protocol == obd_device.protocol && strlen(cached) == PID_MAP_RANGES*8)
+   {
+      for (i = 0; i < PID_MAP_RANGES; i++)
+      {
+         strncpy(value, cached + i*8, 8);
+         value[8] = 0;
+         obd_device.pid_map[i] = strtoul(value, NULL, 16);
+      }
+      obd_device.pid_map_valid = TRUE;
+   }
+
+   // the VIN was read from the vehicle, so this is its own response time:
+   // one more timed response, and the interface timeout is programmed (see learn_response_time())
+   response_time = get_config_int(section, "response_time", 0);
+   if (response_time > 0 && obd_device.adapter_timeout == 0 && obd_device.num_of_timed_responses < TIMING_SAMPLES - 1)
+   {
+      obd_device.max_response_time = MAX(obd_device.max_response_time, response_time);
+      obd_device.num_of_timed_responses = TIMING_SAMPLES - 1;
+   }
+
+   cached = get_config_string(section, "calids", "");
+   for (vehicle_info.num_of_calids = 0; *cached && vehicle_info.num_of_calids < MAX_CALIDS; vehicle_info.num_of_calids++)
+   {
+      for (i = 0; *cached && *cached != ',' && i < CALID_LENGTH; i++)
+         vehicle_info.calid[vehicle_info.num_of_calids][i] = *cached++;
+      vehicle_info.calid[vehicle_info.num_of_calids][i] = 0;
+      while (*cached && *cached++ != ',')
+         ;
+   }
+
+   cached = get_config_string(section, "cvns", "");
+   for (vehicle_info.num_of_cvns = 0; strlen(cached) >= 8 && vehicle_info.num_of_cvns < MAX_CALIDS; cached += 8)
+   {
+      strncpy(value, cached, 8);
+      value[8] = 0;
+      vehicle_info.cvn[vehicle_info.num_of_cvns++] = strtoul(value, NULL, 16);
+   }
+
+   return TRUE;
+}
+
+
+// does nothing if the VIN is not known
+void save_vehicle_profile()
+{
+   char section[32];
+   char value[MAX_CALIDS*(CALID_LENGTH + 1) + 1];
+   int i;
+
+   if (!vehicle_info.vin[0])
+      return;
+
+   sprintf(section, "vehicle_%s", vehicle_info.vin);
+   set_config_int(section, "protocol", obd_device.protocol);
+   if (obd_device.pid_map_valid)
+   {
+      value[0] = 0;
+      for (i = 0; i < PID_MAP_RANGES; i++)
+         sprintf(value + strlen(value), "%08lX", obd_device.pid_map[i]);
+      set_config_string(section, "pids", value);
+   }
+   if (obd_device.max_response_time > 0)
+      set_config_int(section, "response_time", obd_device.max_response_time);
+
+   // the calibration is only saved when it was read, it's not known yet while connecting
+   if (vehicle_info.num_of_calids > 0)
+   {
+      value[0] = 0;
+      for (i = 0; i < vehicle_info.num_of_calids; i++)
+         sprintf(value + strlen(value), (i > 0) ? ",%s" : "%s", vehicle_info.calid[i]);
+      set_config_string(section, "calids", value);
+   }
+
+   if (vehicle_info.num_of_cvns > 0)
+   {
+      value[0] = 0;
+      for (i = 0; i < vehicle_info.num_of_cvns; i++)
+         sprintf(value + strlen(value), "%08lX", vehicle_info.cvn[i]);
+      set_config_string(section, "cvns", value);
+   }
+}
+/* ---- TO HERE ---- */
@@ -0,0 +1,29 @@
+#ifndef VEHICLE_INFO_H
+#define VEHICLE_INFO_H
+
+#define VIN_LENGTH       17
+#define CALID_LENGTH     16
+#define MAX_CALIDS       4
+
+// mode 09 info types
+#define INFO_TYPE_VIN    0x02
+#define INFO_TYPE_CALID  0x04
+#define INFO_TYPE_CVN    0x06
+
+typedef struct
+{
+   char vin[VIN_LENGTH + 1];                   // "" if not known
+   char calid[MAX_CALIDS][CALID_LENGTH + 1];   // calibration IDs
+   int num_of_calids;
+   unsigned long cvn[MAX_CALIDS];              // calibration verification numbers
+   int num_of_cvns;
+} VEHICLE_INFO;
+
+void clear_vehicle_info();
+void clear_calibration_info();
+const VEHICLE_INFO *get_vehicle_info();
+int parse_vehicle_info(int info_type, char *response);
+int load_vehicle_profile();
+void save_vehicle_profile();
+
+#endif